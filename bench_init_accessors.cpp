@@ -0,0 +1,98 @@
+#include "openfhe.h"
+#include "crypto_matrix_operations.h"
+#include "crypto_noteqzero.h"
+#include <map>
+#include <omp.h>
+
+using namespace lbcrypto;
+
+
+// Microbenchmark: mask lookups of the evalMatrixMult loops, through by-value container copies (the former
+// std::map accessors of InitMatrixMult) and through the index-addressed const-reference accessors.
+int main(int argc, char* argv[]) {
+
+    int d = (argc > 1) ? std::stoi(argv[1]) : 20;
+    int repetitions = (argc > 2) ? std::stoi(argv[2]) : 10000;
+    std::cout << "Thread count: " << omp_get_max_threads() << std::endl;
+
+    CCParams<CryptoContextBGVRNS> params;
+    params.SetPlaintextModulus(65537);
+    params.SetMultiplicativeDepth(2);
+    params.SetSecurityLevel(lbcrypto::HEStd_128_classic);
+    params.SetScalingTechnique(FIXEDMANUAL);
+    CryptoContext<DCRTPoly> cc = GenCryptoContext(params);
+    cc->Enable(PKE);
+    cc->Enable(KEYSWITCH);
+    cc->Enable(LEVELEDSHE);
+    cc->Enable(ADVANCEDSHE);
+    KeyPair<DCRTPoly> keyPair = cc->KeyGen();
+
+    InitMatrixMult initMatrixMult(cc, keyPair, nullptr, d);  // Accessors only, no rotations.
+    InitNotEqualZero initNotEqualZero(cc, keyPair, d, d);
+    // Former storage: std::map keyed by rotation, returned by value.
+    std::map<int, Ciphertext<DCRTPoly>> u_sigma;
+    for (int k = -d; k <= d; k++) { u_sigma[k] = initMatrixMult.u_sigma(k); }
+    std::vector<Ciphertext<DCRTPoly>> encNegRange = initNotEqualZero.encNegRange();
+    auto u_sigmaByValue = [&]() { return u_sigma; };
+    auto encNegRangeByValue = [&]() { return encNegRange; };
+
+    TimeVar t;
+    double runtime(0.0);
+    int64_t lookups = int64_t(repetitions)*(2*d+1);
+    size_t checksum = 0;
+
+    auto report = [&](std::string name, int64_t count) {
+        std::cout << name << ": " << runtime << " ms, " << 1e6*runtime/count << " ns per lookup" << std::endl;
+    };
+
+    // STEP 1-1 lookups, serial.
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        for (int k = -d; k <= d; k++) { checksum += size_t(u_sigmaByValue()[k].get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("u_sigma by value (map copy)", lookups);
+
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        for (int k = -d; k <= d; k++) { checksum += size_t(initMatrixMult.u_sigma(k).get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("u_sigma const reference", lookups);
+
+    // STEP 1-1 lookups, inside omp parallel for (shared_ptr reference count contention).
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        #pragma omp parallel for reduction(+:checksum)
+        for (int k = -d; k <= d; k++) { checksum += size_t(u_sigmaByValue()[k].get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("u_sigma by value (map copy), parallel", lookups);
+
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        #pragma omp parallel for reduction(+:checksum)
+        for (int k = -d; k <= d; k++) { checksum += size_t(initMatrixMult.u_sigma(k).get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("u_sigma const reference, parallel", lookups);
+
+    // evalNotEqualZero factor lookups.
+    lookups = int64_t(repetitions)*d;
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        for (int i = 0; i < d; i++) { checksum += size_t(encNegRangeByValue()[i].get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("encNegRange by value (vector copy)", lookups);
+
+    TIC(t);
+    for (int r = 0; r < repetitions; r++) {
+        for (int i = 0; i < d; i++) { checksum += size_t(initNotEqualZero.encNegRange()[i].get()) & 1; }
+    }
+    runtime = TOC(t);
+    report("encNegRange const reference", lookups);
+
+    std::cout << "Checksum: " << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,281 @@
+#include "openfhe.h"
+#include "utilities.h"
+#include "crypto_utilities.h"
+#include "crypto_enc_transform.h"
+#include "crypto_matrix_operations.h"
+#include "crypto_prefix_mult.h"
+#include "crypto_noteqzero.h"
+#include "crypto_rotation_plan.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <omp.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+using namespace lbcrypto;
+
+
+// Per-kernel microbenchmarks. Arguments of every benchmark: d, log2 ring dimension, multiplicative depth,
+// OpenMP threads. Example: bench_kernels --benchmark_filter=MatrixMult/d:10/
+// NotEqualZero also takes the evaluator (0: Product, 1: PatersonStockmeyer, 2: Fermat) and reports its planned
+// ciphertext multiplications and depth as the mults and depth counters. Evaluators deeper than the multiplicative
+// depth are skipped (Fermat needs --kernel-depth=16 for p = 65537).
+//
+// The swept values are comma-separated lists given by --kernel-d (default 5,10,20), --kernel-logn (default 14,15,
+// i.e. ring dimensions 16K and 32K) and --kernel-depth (default 10), or by the environment variables BENCH_KERNEL_D,
+// BENCH_KERNEL_LOGN and BENCH_KERNEL_DEPTH. The command line takes precedence.
+//
+// Crypto context, keys and Init* objects are generated once per (d, ring dimension, depth) and reused.
+struct KernelSetup {
+    CryptoContext<DCRTPoly> cc;
+    KeyPair<DCRTPoly> keyPair;
+    std::unique_ptr<InitRotationPlan> rotationPlan;
+    std::unique_ptr<InitRotsMasks> initRotsMasks;
+    std::unique_ptr<InitMatrixMult> initMatrixMult;
+    std::unique_ptr<InitPreserveLeadOne> initPreserveLeadOne;
+    std::unique_ptr<InitPrefixScan> initPrefixScan;
+    std::vector<std::unique_ptr<InitNotEqualZero>> initNotEqualZero;  // By NotEqualZeroMethod.
+    std::vector<Ciphertext<DCRTPoly>> encDiagonals;
+    Ciphertext<DCRTPoly> encVec;
+    Ciphertext<DCRTPoly> encMatrixFlat;
+    std::vector<Ciphertext<DCRTPoly>> encRows;
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encElems;
+};
+
+static KernelSetup &kernelSetup(int d, int logRingDim, int depth) {
+    static std::map<std::tuple<int,int,int>, std::unique_ptr<KernelSetup>> setups;
+    auto &setup = setups[std::make_tuple(d, logRingDim, depth)];
+    if (setup) { return *setup; }
+    setup.reset(new KernelSetup());
+
+    CCParams<CryptoContextBGVRNS> params;
+    params.SetPlaintextModulus(65537);
+    params.SetMultiplicativeDepth(depth);
+    params.SetMaxRelinSkDeg(3);
+    params.SetSecurityLevel(lbcrypto::HEStd_NotSet);
+    params.SetScalingTechnique(FIXEDMANUAL);
+    params.SetRingDim(1 << logRingDim);
+    setup->cc = GenCryptoContext(params);
+    setup->cc->Enable(PKE);
+    setup->cc->Enable(KEYSWITCH);
+    setup->cc->Enable(LEVELEDSHE);
+    setup->cc->Enable(ADVANCEDSHE);
+    auto &cc = setup->cc;
+    setup->keyPair = cc->KeyGen();
+    cc->EvalMultKeysGen(setup->keyPair.secretKey);
+
+    std::set<int32_t> rotIndices;
+    for (auto indices : {rotIndicesDiagMatrixVecMult(d), rotIndicesMatrixMult(d), rotIndicesPrefixMult(d),
+                         rotIndicesPreserveLeadOne(d), rotIndicesPrefixAdd(d)}) {
+        rotIndices.insert(indices.begin(), indices.end());
+    }
+    for (int i = 1; i <= d; i++) { rotIndices.insert(i); rotIndices.insert(-i); }
+    setup->rotationPlan.reset(new InitRotationPlan(cc, setup->keyPair, rotIndices, RotationKeyMode::Full));
+    setup->initRotsMasks.reset(new InitRotsMasks(cc, setup->keyPair, d));
+    auto rotationPlan = setup->rotationPlan.get();
+    setup->initMatrixMult.reset(new InitMatrixMult(cc, setup->keyPair, rotationPlan, d, true));
+    setup->initPreserveLeadOne.reset(new InitPreserveLeadOne(cc, setup->keyPair, rotationPlan, d, 1, depth+1));
+    setup->initPrefixScan.reset(new InitPrefixScan(cc, rotationPlan, d, false, depth+1));
+    for (auto method : {NotEqualZeroMethod::Product, NotEqualZeroMethod::PatersonStockmeyer, NotEqualZeroMethod::Fermat}) {
+        setup->initNotEqualZero.emplace_back(new InitNotEqualZero(cc, setup->keyPair, d, d, 1, method, depth+1));
+    }
+
+    // Permutation matrix (i -> i+1 mod d), its diagonals, a 0/1 vector and matrix rows/elements.
+    int slots = cc->GetRingDimension();
+    std::vector<std::vector<int64_t>> matrix(d, std::vector<int64_t>(d,0));
+    std::vector<int64_t> matrixFlat(d*d,0);
+    for (int i = 0; i < d; i++) { matrix[i][(i+1)%d] = 1; matrixFlat[i*d+(i+1)%d] = 1; }
+    for (auto &diagonal : matrixDiagonals(matrix)) {
+        setup->encDiagonals.push_back(cc->Encrypt(setup->keyPair.publicKey,
+                                                  cc->MakePackedPlaintext(repFillSlots(diagonal,slots))));
+    }
+    std::vector<int64_t> vec(d,0); for (int i = 0; i < d; i += 2) { vec[i] = 1; }
+    setup->encVec = cc->Encrypt(setup->keyPair.publicKey, cc->MakePackedPlaintext(repFillSlots(vec,slots)));
+    setup->encMatrixFlat = cc->Encrypt(setup->keyPair.publicKey,
+                                       cc->MakePackedPlaintext(repFillSlots(matrixFlat,slots)));
+    for (int i = 0; i < d; i++) {
+        setup->encRows.push_back(cc->Encrypt(setup->keyPair.publicKey, cc->MakePackedPlaintext(matrix[i])));
+        std::vector<Ciphertext<DCRTPoly>> encRowElems;
+        for (int j = 0; j < d; j++) {
+            encRowElems.push_back(cc->Encrypt(setup->keyPair.publicKey, cc->MakePackedPlaintext({matrix[i][j]})));
+        }
+        setup->encElems.push_back(encRowElems);
+    }
+    return *setup;
+}
+
+static KernelSetup &benchmarkSetup(benchmark::State &state) {
+    omp_set_num_threads(state.range(3));
+    return kernelSetup(state.range(0), state.range(1), state.range(2));
+}
+
+
+static void BM_DiagMatrixVecMult(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evalDiagMatrixVecMult(s.encDiagonals, s.encVec, s.cc, s.rotationPlan.get()));
+    }
+}
+
+static void BM_MatrixMult(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evalMatrixMult(s.cc, s.encMatrixFlat, s.encMatrixFlat, *s.initMatrixMult));
+    }
+}
+
+static void BM_MatrixMultParallel(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evalMatrixMultParallel(s.cc, s.encMatrixFlat, s.encMatrixFlat, *s.initMatrixMult));
+    }
+}
+
+static void BM_PrefixMult(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) { benchmark::DoNotOptimize(evalPrefixMult(s.encVec, *s.initPrefixScan, s.cc)); }
+}
+
+static void BM_PrefixAdd(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) { benchmark::DoNotOptimize(evalPrefixAdd(s.encVec, *s.initPrefixScan, s.cc)); }
+}
+
+static void BM_PreserveLeadOne(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) { benchmark::DoNotOptimize(evalPreserveLeadOne(s.encVec, s.cc, *s.initPreserveLeadOne)); }
+}
+
+static void BM_NotEqualZero(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    auto &init = *s.initNotEqualZero[state.range(4)];
+    state.counters["mults"] = init.multCount();
+    state.counters["depth"] = init.depth();
+    if (init.depth() > state.range(2)) { state.SkipWithError("NotEqualZero depth exceeds the multiplicative depth"); }
+    for (auto _ : state) { benchmark::DoNotOptimize(evalNotEqualZero(s.encVec, s.cc, init)); }
+}
+
+static void BM_Exponentiate(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    // All bits set below 2^(depth/2): depth/2-1 squarings and a product of depth/2 factors.
+    int exponent = (1 << (state.range(2)/2)) - 1;
+    for (auto _ : state) { benchmark::DoNotOptimize(evalExponentiate(s.encVec, exponent, s.cc)); }
+}
+
+static void BM_RowToColEnc(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(rowToColEnc(s.encRows, s.cc, *s.initRotsMasks));
+    }
+}
+
+static void BM_EncElem2Rows(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encElem2Rows(s.encElems, s.cc, *s.initRotsMasks));
+    }
+}
+
+static void BM_EncElem2Cols(benchmark::State &state) {
+    auto &s = benchmarkSetup(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encElem2Cols(s.encElems, s.cc, *s.initRotsMasks));
+    }
+}
+
+
+// Swept d, log2 ring dimension and depth values; see the header comment.
+static std::vector<int64_t> kernelD = {5, 10, 20};
+static std::vector<int64_t> kernelLogN = {14, 15};
+static std::vector<int64_t> kernelDepth = {10};
+
+static std::vector<int64_t> parseKernelList(const std::string &value, const std::string &name) {
+    std::vector<int64_t> list;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        try { list.push_back(std::stoll(item)); }
+        catch (const std::exception &) { throw std::invalid_argument("invalid value for " + name + ": " + value); }
+        if (list.back() <= 0) { throw std::invalid_argument("invalid value for " + name + ": " + value); }
+    }
+    if (list.empty()) { throw std::invalid_argument("empty value for " + name); }
+    return list;
+}
+
+// Reads the environment first, then removes the --kernel-* flags from argv before the benchmark flags are parsed.
+static void parseKernelArgs(int &argc, char **argv) {
+    std::vector<std::tuple<std::string, std::string, std::vector<int64_t>*>> options = {
+        {"--kernel-d=", "BENCH_KERNEL_D", &kernelD},
+        {"--kernel-logn=", "BENCH_KERNEL_LOGN", &kernelLogN},
+        {"--kernel-depth=", "BENCH_KERNEL_DEPTH", &kernelDepth}};
+    for (auto &option : options) {
+        if (const char *value = std::getenv(std::get<1>(option).c_str())) {
+            *std::get<2>(option) = parseKernelList(value, std::get<1>(option));
+        }
+    }
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool consumed = false;
+        for (auto &option : options) {
+            auto &flag = std::get<0>(option);
+            if (arg.compare(0, flag.size(), flag) == 0) {
+                *std::get<2>(option) = parseKernelList(arg.substr(flag.size()), flag.substr(0, flag.size()-1));
+                consumed = true;
+            }
+        }
+        if (!consumed) { argv[kept++] = argv[i]; }
+    }
+    argc = kept;
+}
+
+// d, log2 ring dimension, depth, threads, then the kernel's own arguments.
+static void kernelArgsProduct(benchmark::internal::Benchmark *b, std::vector<std::string> names,
+                              std::vector<std::vector<int64_t>> lists) {
+    std::vector<int64_t> threads = {1};
+    if (omp_get_max_threads() > 1) { threads.push_back(omp_get_max_threads()); }
+    names.insert(names.begin(), {"d", "logN", "depth", "threads"});
+    lists.insert(lists.begin(), {kernelD, kernelLogN, kernelDepth, threads});
+    b->ArgNames(names);
+    b->ArgsProduct(lists);
+    b->Unit(benchmark::kMillisecond);
+    b->UseRealTime();
+}
+
+static void kernelArgs(benchmark::internal::Benchmark *b) { kernelArgsProduct(b, {}, {}); }
+
+// NotEqualZeroMethod: Product, PatersonStockmeyer, Fermat.
+static void notEqualZeroArgs(benchmark::internal::Benchmark *b) { kernelArgsProduct(b, {"method"}, {{0, 1, 2}}); }
+
+// Registered from main: the argument lists are only known once the command line is parsed.
+int main(int argc, char **argv) {
+    try { parseKernelArgs(argc, argv); }
+    catch (const std::invalid_argument &e) { std::cerr << e.what() << std::endl; return 1; }
+    std::vector<std::tuple<const char*, void (*)(benchmark::State&), void (*)(benchmark::internal::Benchmark*)>> kernels = {
+        {"BM_DiagMatrixVecMult", BM_DiagMatrixVecMult, kernelArgs},
+        {"BM_MatrixMult", BM_MatrixMult, kernelArgs},
+        {"BM_MatrixMultParallel", BM_MatrixMultParallel, kernelArgs},
+        {"BM_PrefixMult", BM_PrefixMult, kernelArgs},
+        {"BM_PrefixAdd", BM_PrefixAdd, kernelArgs},
+        {"BM_PreserveLeadOne", BM_PreserveLeadOne, kernelArgs},
+        {"BM_NotEqualZero", BM_NotEqualZero, notEqualZeroArgs},
+        {"BM_Exponentiate", BM_Exponentiate, kernelArgs},
+        {"BM_RowToColEnc", BM_RowToColEnc, kernelArgs},
+        {"BM_EncElem2Rows", BM_EncElem2Rows, kernelArgs},
+        {"BM_EncElem2Cols", BM_EncElem2Cols, kernelArgs}};
+    for (auto &kernel : kernels) {
+        benchmark::RegisterBenchmark(std::get<0>(kernel), std::get<1>(kernel))->Apply(std::get<2>(kernel));
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
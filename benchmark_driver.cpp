@@ -0,0 +1,284 @@
+#include "benchmark_driver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <tuple>
+
+
+std::string benchmarkUsage(std::string program) {
+    return "Usage: " + program + " [--parties N] [--generator fixed|random|long-cycles|self-loops] [--seed S]\n"
+           "       [--threads T] [--repetitions R] [--depth D] [--format csv|json] [--output FILE] [--ops-report]\n"
+           "       [--trace FILE] [--cache DIR] [--refresh-workers W] [--max-cycle-length L]\n"
+           "       [--early-termination K] [--rotation-keys full|bsgs]\n"
+           "       [--cycle-engine functional-graph|matrix-squaring] [--compare-engines] [--markets M]\n"
+           "       [--preference-upload diagonals|ranking] [--phase1 packed|per-user]\n"
+           "       [--noteqzero product|paterson-stockmeyer|fermat]";
+}
+
+bool parseBenchmarkArgs(int argc, char* argv[], BenchmarkConfig &config) {
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--help" || option == "-h") { std::cerr << benchmarkUsage(argv[0]) << std::endl; return false; }
+        if (option == "--ops-report") { config.opsReport = true; continue; }
+        if (option == "--compare-engines") { config.compareEngines = true; continue; }
+        if (i+1 >= argc) { std::cerr << "Missing value for " << option << std::endl; return false; }
+        std::string value = argv[++i];
+        try {
+            if (option == "--parties") { config.parties = std::stoi(value); }
+            else if (option == "--markets") { config.markets = std::stoi(value); }
+            else if (option == "--generator") { config.generator = value; }
+            else if (option == "--seed") { config.seed = std::stoull(value); }
+            else if (option == "--threads") { config.threads = std::stoi(value); }
+            else if (option == "--repetitions") { config.repetitions = std::stoi(value); }
+            else if (option == "--depth") { config.depth = std::stoi(value); }
+            else if (option == "--format") { config.format = value; }
+            else if (option == "--output") { config.output = value; }
+            else if (option == "--trace") { config.trace = value; }
+            else if (option == "--cache") { config.cache = value; }
+            else if (option == "--refresh-workers") { config.refreshWorkers = std::stoi(value); }
+            else if (option == "--max-cycle-length") { config.maxCycleLength = std::stoi(value); }
+            else if (option == "--early-termination") { config.earlyTermination = std::stoi(value); }
+            else if (option == "--rotation-keys") { config.rotationKeys = value; }
+            else if (option == "--cycle-engine") { config.cycleEngine = value; }
+            else if (option == "--preference-upload") { config.preferenceUpload = value; }
+            else if (option == "--phase1") { config.phase1 = value; }
+            else if (option == "--noteqzero") { config.notEqualZero = value; }
+            else { std::cerr << "Unknown option " << option << std::endl; return false; }
+        }
+        catch (std::exception &e) {
+            std::cerr << "Invalid value " << value << " for " << option << std::endl; return false;
+        }
+    }
+    if (config.parties < 2 || config.markets < 1 || config.repetitions < 1 || config.threads < 0 || config.depth < 0
+        || config.refreshWorkers < 0 || config.maxCycleLength < 0
+        || config.earlyTermination < 0) {
+        std::cerr << "Invalid configuration" << std::endl; return false;
+    }
+    if ((config.markets & (config.markets-1)) != 0) {
+        std::cerr << "Markets must be a power of two: " << config.markets << std::endl; return false;
+    }
+    if (config.format != "csv" && config.format != "json") {
+        std::cerr << "Unknown format " << config.format << std::endl; return false;
+    }
+    if (config.rotationKeys != "full" && config.rotationKeys != "bsgs") {
+        std::cerr << "Unknown rotation keys " << config.rotationKeys << std::endl; return false;
+    }
+    if (config.cycleEngine != "functional-graph" && config.cycleEngine != "matrix-squaring") {
+        std::cerr << "Unknown cycle engine " << config.cycleEngine << std::endl; return false;
+    }
+    if (config.preferenceUpload != "diagonals" && config.preferenceUpload != "ranking") {
+        std::cerr << "Unknown preference upload " << config.preferenceUpload << std::endl; return false;
+    }
+    if (config.phase1 != "packed" && config.phase1 != "per-user") {
+        std::cerr << "Unknown phase 1 layout " << config.phase1 << std::endl; return false;
+    }
+    if (config.notEqualZero != "product" && config.notEqualZero != "paterson-stockmeyer"
+        && config.notEqualZero != "fermat") {
+        std::cerr << "Unknown NotEqualZero evaluator " << config.notEqualZero << std::endl; return false;
+    }
+    return true;
+}
+
+
+std::vector<std::vector<int64_t>> generatePreferences(int parties, std::string generator, uint64_t seed) {
+    std::vector<std::vector<int64_t>> prefs;
+    if (generator == "fixed") {
+        if (parties == 5) {
+            prefs.push_back({4, 1, 2, 3, 0});
+            prefs.push_back({4, 3, 2, 1, 0});
+            prefs.push_back({4, 1, 0, 2, 3});
+            prefs.push_back({1, 3, 4, 0, 2});
+            prefs.push_back({3, 1, 2, 0, 4});
+        }
+        else if (parties == 10) {
+            prefs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9});
+            prefs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9});
+            prefs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9});
+            prefs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9});
+            prefs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8});
+            prefs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7});
+            prefs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9});
+        }
+        else if (parties == 15) {
+            prefs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14});
+        }
+        else if (parties == 20) {
+            prefs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14, 15, 16, 17, 18, 19});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 17, 18, 15});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 18, 17, 16, 15});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 15, 17, 18});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, 18, 19, 15, 17});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 18, 16, 17, 15, 19});
+        }
+        else if (parties == 25) {
+            prefs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 17, 18, 15, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 18, 17, 16, 15, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 15, 17, 18, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, 18, 19, 15, 17, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 18, 16, 17, 15, 19, 20, 21, 22, 23, 24});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 21, 22, 23, 20});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 23, 22, 21, 20});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 21, 20, 22, 23});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 21, 23, 24, 20, 22});
+            prefs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 23, 21, 22, 20, 24});
+        }
+    }
+    else if (generator == "random") {
+        std::mt19937_64 rng(seed);
+        for (int user = 0; user < parties; user++) {
+            std::vector<int64_t> pref(parties);
+            std::iota(pref.begin(), pref.end(), 0);
+            std::shuffle(pref.begin(), pref.end(), rng);
+            prefs.push_back(pref);
+        }
+    }
+    else if (generator == "long-cycles") {
+        int length = std::max(2, int(std::sqrt(parties)));
+        int groups = std::max(1, parties / length);
+        auto groupStart = [&](int group) { return group * length; };
+        auto groupEnd = [&](int group) { return (group == groups-1) ? parties : (group+1) * length; };
+        for (int user = 0; user < parties; user++) {
+            int group = std::min(user / length, groups-1);
+            std::vector<int64_t> pref;
+            std::vector<bool> listed(parties, false);
+            auto append = [&](int other) { if (!listed[other]) { listed[other] = true; pref.push_back(other); } };
+            // Users of the previous group, from the one at the same position on.
+            if (group > 0) {
+                int size = groupEnd(group-1) - groupStart(group-1);
+                for (int i = 0; i < size; i++) { append(groupStart(group-1) + (user - groupStart(group) + i) % size); }
+            }
+            // Next user of the own group, then all users in order.
+            int size = groupEnd(group) - groupStart(group);
+            append(groupStart(group) + (user - groupStart(group) + 1) % size);
+            for (int rank = 1; rank <= parties; rank++) { append((user+rank) % parties); }
+            prefs.push_back(pref);
+        }
+    }
+    else if (generator == "self-loops") {
+        for (int user = 0; user < parties; user++) {
+            std::vector<int64_t> pref;
+            for (int rank = 0; rank < parties; rank++) { pref.push_back((user+rank) % parties); }
+            prefs.push_back(pref);
+        }
+    }
+    return prefs;
+}
+
+
+void PhaseTimings::add(std::string phase, double ms) {
+    if (samples_.find(phase) == samples_.end()) { phases_.push_back(phase); }
+    samples_[phase].push_back(ms);
+}
+
+double PhaseTimings::mean(std::string phase) const {
+    auto &samples = samples_.at(phase);
+    return std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+}
+
+double PhaseTimings::percentile(std::string phase, double p) const {
+    auto samples = samples_.at(phase);
+    std::sort(samples.begin(), samples.end());
+    double rank = p/100 * (samples.size()-1);
+    int lower = std::floor(rank); int upper = std::ceil(rank);
+    return samples[lower] + (rank-lower) * (samples[upper]-samples[lower]);
+}
+
+// Configuration fields of both reports (CSV columns, JSON members): name, value, JSON string.
+static std::vector<std::tuple<std::string, std::string, bool>> reportFields(const BenchmarkConfig &config) {
+    return {{"parties", std::to_string(config.parties), false},
+            {"markets", std::to_string(config.markets), false},
+            {"generator", config.generator, true},
+            {"seed", std::to_string(config.seed), false},
+            {"threads", std::to_string(config.threads), false},
+            {"refresh_workers", std::to_string(config.refreshWorkers), false},
+            {"repetitions", std::to_string(config.repetitions), false},
+            {"depth", std::to_string(config.depth), false},
+            {"max_cycle_length", std::to_string(config.maxCycleLength), false},
+            {"early_termination", std::to_string(config.earlyTermination), false},
+            {"rotation_keys", config.rotationKeys, true},
+            {"cycle_engine", config.cycleEngine, true},
+            {"compare_engines", config.compareEngines ? "true" : "false", false},
+            {"preference_upload", config.preferenceUpload, true},
+            {"phase1", config.phase1, true},
+            {"noteqzero", config.notEqualZero, true}};
+}
+
+void PhaseTimings::writeCsv(std::ostream &out, const BenchmarkConfig &config) const {
+    auto fields = reportFields(config);
+    for (auto &field : fields) { out << std::get<0>(field) << ","; }
+    out << "phase,mean_ms,min_ms,p50_ms,p90_ms,p99_ms,max_ms" << std::endl;
+    for (auto &phase : phases_) {
+        for (auto &field : fields) { out << std::get<1>(field) << ","; }
+        out << phase << "," << mean(phase) << "," << percentile(phase,0) << "," << percentile(phase,50) << ","
+            << percentile(phase,90) << "," << percentile(phase,99) << "," << percentile(phase,100) << std::endl;
+    }
+}
+
+void PhaseTimings::writeJson(std::ostream &out, const BenchmarkConfig &config) const {
+    out << "{";
+    for (auto &field : reportFields(config)) {
+        auto quote = std::get<2>(field) ? "\"" : "";
+        out << "\"" << std::get<0>(field) << "\": " << quote << std::get<1>(field) << quote << ", ";
+    }
+    out << "\"phases\": {";
+    for (size_t i = 0; i < phases_.size(); i++) {
+        auto &phase = phases_[i];
+        out << (i ? ", " : "") << "\"" << phase << "\": {\"mean_ms\": " << mean(phase)
+            << ", \"min_ms\": " << percentile(phase,0) << ", \"p50_ms\": " << percentile(phase,50)
+            << ", \"p90_ms\": " << percentile(phase,90) << ", \"p99_ms\": " << percentile(phase,99)
+            << ", \"max_ms\": " << percentile(phase,100) << ", \"samples_ms\": [";
+        auto &samples = samples_.at(phase);
+        for (size_t j = 0; j < samples.size(); j++) { out << (j ? ", " : "") << samples[j]; }
+        out << "]}";
+    }
+    out << "}}" << std::endl;
+}
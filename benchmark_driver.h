@@ -0,0 +1,65 @@
+#ifndef BENCHMARK_DRIVER_H
+#define BENCHMARK_DRIVER_H
+
+#include <stdint.h>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// Command line configuration of secure_cycle_finding.
+struct BenchmarkConfig {
+    int parties = 20;
+    int markets = 1;            // Independent markets packed side by side in the slots (power of two).
+    std::string generator = "fixed";
+    uint64_t seed = 1;
+    int threads = 0;            // 0: OpenMP default.
+    int refreshWorkers = 0;     // Worker threads of the refresh pool. 0: half of the threads, at least one.
+    int repetitions = 1;
+    int depth = 0;              // 0: planned (ParameterPlan).
+    int maxCycleLength = 0;     // Only cycles of at most this length are traded (matrix squaring). 0: any length.
+    int earlyTermination = 0;   // Stop once all users are assigned, checked every this many rounds. 0: n rounds.
+    std::string rotationKeys = "bsgs"; // Rotation keys: full (one key per amount) or bsgs (composed rotations).
+    std::string cycleEngine = "functional-graph"; // Phase 2a engine: functional-graph or matrix-squaring.
+    bool compareEngines = false; // Also run the other engine on every adjacency matrix (compare_phase2a/2b timings).
+    std::string preferenceUpload = "diagonals"; // Preference upload: diagonals or ranking (expanded by the server).
+    std::string notEqualZero = "paterson-stockmeyer"; // NotEqualZero evaluator: product, paterson-stockmeyer, fermat.
+    std::string phase1 = "packed"; // Phase 1 layout: packed (all users in one ciphertext if they fit) or per-user.
+    std::string format = "csv";
+    std::string output = "";    // Empty: standard output.
+    bool opsReport = false;     // Crypto operations per scope (round/phase/kernel) and thread.
+    std::string trace = "";     // Chrome trace-event JSON file of phases and kernels. Empty: no trace.
+    std::string cache = "";     // Crypto cache directory (context, keys, encrypted constants). Empty: no cache.
+};
+
+std::string benchmarkUsage(std::string program);
+// Returns false (with a message on std::cerr) on unknown options or invalid values.
+bool parseBenchmarkArgs(int argc, char* argv[], BenchmarkConfig &config);
+
+// Preference lists: row u lists all users in decreasing preference of user u.
+// fixed: built-in test vectors (5, 10, 15, 20 or 25 parties, empty otherwise).
+// random: uniformly random permutations from seed.
+// long-cycles: groups of max(2, floor(sqrt(parties))) users (the last takes the remainder). Group g prefers the users
+// of group g-1, then the next user of its own group: the groups are disjoint cycles, and group g trades in round g+1,
+// once group g-1 has left.
+// self-loops: user u prefers itself (every user is a cycle of length 1 in the first round).
+std::vector<std::vector<int64_t>> generatePreferences(int parties, std::string generator, uint64_t seed);
+
+
+// Timings per phase, one sample per repetition. Summary: mean, min, max and percentiles (linear interpolation).
+class PhaseTimings {
+public:
+    void add(std::string phase, double ms);
+    double mean(std::string phase) const;
+    double percentile(std::string phase, double p) const;
+    void writeCsv(std::ostream &out, const BenchmarkConfig &config) const;
+    void writeJson(std::ostream &out, const BenchmarkConfig &config) const;
+
+private:
+    std::vector<std::string> phases_;
+    std::map<std::string, std::vector<double>> samples_;
+};
+
+
+#endif
@@ -0,0 +1,201 @@
+#include "crypto_cache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+MappedFileBuf::MappedFileBuf(std::string path) : data_(nullptr), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { throw std::runtime_error("Cannot open " + path); }
+    struct stat status;
+    if (fstat(fd, &status) != 0) { ::close(fd); throw std::runtime_error("Cannot stat " + path); }
+    size_ = status.st_size;
+    if (size_ > 0) {
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { ::close(fd); throw std::runtime_error("Cannot map " + path); }
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<char*>(data);
+    }
+    ::close(fd);
+    setg(data_, data_, data_ + size_);
+}
+
+MappedFileBuf::~MappedFileBuf() { if (data_) { munmap(data_, size_); } }
+
+
+static const std::string cryptoCacheVersion = "2";
+
+CryptoCache::CryptoCache() : mode_(CryptoCacheMode::Off), replayed_(0) {}
+
+void CryptoCache::open(std::string directory, std::string key) {
+    key_ = key;
+    path_ = directory + "/" + key;
+    std::ifstream manifest(path_ + "/manifest");
+    std::string version, manifestKey;
+    size_t count = 0;
+    manifest >> version >> manifestKey >> count;
+    entries_.clear();
+    replayed_ = 0;
+    for (size_t i = 0; manifest && i < count; i++) {
+        Entry entry;
+        if (manifest >> entry.tag >> entry.level >> entry.length) { entries_.push_back(entry); }
+    }
+    mode_ = (manifest && version == cryptoCacheVersion && manifestKey == key) ? CryptoCacheMode::Replay
+                                                                              : CryptoCacheMode::Record;
+    if (mode_ == CryptoCacheMode::Replay) {
+        replayBuf_.reset(new MappedFileBuf(path_ + "/ciphertexts"));
+        replayStream_.reset(new std::istream(replayBuf_.get()));
+    } else {
+        entries_.clear();
+    }
+}
+
+CryptoCacheMode CryptoCache::mode() const { return mode_; }
+std::string CryptoCache::path() const { return path_; }
+bool CryptoCache::generateKeys() const { return mode_ != CryptoCacheMode::Replay; }
+
+void CryptoCache::load(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> &keyPair) {
+    auto deserialize = [&](std::string name, auto &object) {
+        MappedFileBuf buf(path_ + "/" + name);
+        std::istream in(&buf);
+        Serial::Deserialize(object, in, SerType::BINARY);
+    };
+    // Context first: keys and ciphertexts are bound to it.
+    deserialize("context", cryptoContext);
+    deserialize("publicKey", keyPair.publicKey);
+    deserialize("secretKey", keyPair.secretKey);
+    auto deserializeKeys = [&](std::string name, auto deserializeKeys) {
+        MappedFileBuf buf(path_ + "/" + name);
+        std::istream in(&buf);
+        if (!deserializeKeys(in)) { throw std::runtime_error("Cannot load " + path_ + "/" + name); }
+    };
+    deserializeKeys("evalMultKeys", [&](std::istream &in) {
+        return cryptoContext->DeserializeEvalMultKey(in, SerType::BINARY); });
+    // Rotation and sum keys (both automorphism keys).
+    deserializeKeys("evalAutomorphismKeys", [&](std::istream &in) {
+        return cryptoContext->DeserializeEvalAutomorphismKey(in, SerType::BINARY); });
+}
+
+void CryptoCache::save(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> &keyPair) {
+    std::filesystem::create_directories(path_);
+    auto serialize = [&](std::string name, const auto &object) {
+        if (!Serial::SerializeToFile(path_ + "/" + name, object, SerType::BINARY)) {
+            throw std::runtime_error("Cannot write " + path_ + "/" + name);
+        }
+    };
+    serialize("context", cryptoContext);
+    serialize("publicKey", keyPair.publicKey);
+    // Secret key readable by the owner only: created with mode 0600 before it is written.
+    std::string secretKeyPath = path_ + "/secretKey";
+    int fd = ::open(secretKeyPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0 || fchmod(fd, S_IRUSR | S_IWUSR) != 0) {
+        if (fd >= 0) { ::close(fd); }
+        throw std::runtime_error("Cannot write " + secretKeyPath);
+    }
+    ::close(fd);
+    serialize("secretKey", keyPair.secretKey);
+    std::ofstream evalMultKeys(path_ + "/evalMultKeys", std::ios::binary);
+    cryptoContext->SerializeEvalMultKey(evalMultKeys, SerType::BINARY);
+    std::ofstream evalAutomorphismKeys(path_ + "/evalAutomorphismKeys", std::ios::binary);
+    cryptoContext->SerializeEvalAutomorphismKey(evalAutomorphismKeys, SerType::BINARY);
+    std::ofstream ciphertexts(path_ + "/ciphertexts", std::ios::binary);
+    for (auto &ciphertext : recorded_) { Serial::Serialize(ciphertext, ciphertexts, SerType::BINARY); }
+    if (!evalMultKeys || !evalAutomorphismKeys || !ciphertexts) { throw std::runtime_error("Cannot write " + path_); }
+    evalMultKeys.close(); evalAutomorphismKeys.close(); ciphertexts.close();
+
+    std::ofstream manifest(path_ + "/manifest");
+    manifest << cryptoCacheVersion << " " << key_ << " " << entries_.size() << std::endl;
+    for (auto &entry : entries_) { manifest << entry.tag << " " << entry.level << " " << entry.length << std::endl; }
+    recorded_.clear();
+    entries_.clear();
+}
+
+void CryptoCache::finishReplay() {
+    if (mode_ != CryptoCacheMode::Replay || replayed_ == entries_.size()) { return; }
+    throw std::runtime_error("Crypto cache " + path_ + ": set-up does not match (" + std::to_string(replayed_)
+                             + " of " + std::to_string(entries_.size()) + " ciphertexts replayed)");
+}
+
+CryptoCache::Entry CryptoCache::entry(const Plaintext &plaintext, const std::string &tag) const {
+    if (tag.empty() || std::any_of(tag.begin(), tag.end(), [](char c) { return std::isspace((unsigned char)c); })) {
+        throw std::invalid_argument("Crypto cache tag must be a non-empty word: '" + tag + "'");
+    }
+    return {tag, plaintext->GetLevel(), plaintext->GetLength()};
+}
+
+// Replay: next recorded entry, which must have been recorded at the same call site with the same shape.
+void CryptoCache::checkEntry(const Entry &expected) {
+    if (replayed_ == entries_.size()) {
+        throw std::runtime_error("Crypto cache " + path_ + ": set-up does not match (no ciphertext recorded for "
+                                 + expected.tag + ")");
+    }
+    auto &recorded = entries_[replayed_];
+    if (recorded.tag != expected.tag || recorded.level != expected.level || recorded.length != expected.length) {
+        throw std::runtime_error("Crypto cache " + path_ + ": set-up does not match (ciphertext "
+                                 + std::to_string(replayed_) + " recorded as " + recorded.tag + " level "
+                                 + std::to_string(recorded.level) + " length " + std::to_string(recorded.length)
+                                 + ", replayed as " + expected.tag + " level " + std::to_string(expected.level)
+                                 + " length " + std::to_string(expected.length) + ")");
+    }
+    replayed_++;
+}
+
+Ciphertext<DCRTPoly> CryptoCache::encrypt(CryptoContext<DCRTPoly> &cryptoContext,
+                                          const PublicKey<DCRTPoly> &publicKey, const Plaintext &plaintext,
+                                          const std::string &tag) {
+    if (mode_ == CryptoCacheMode::Off) { return cryptoContext->Encrypt(publicKey, plaintext); }
+    auto expected = entry(plaintext, tag);
+    if (mode_ == CryptoCacheMode::Replay) {
+        checkEntry(expected);
+        Ciphertext<DCRTPoly> ciphertext;
+        Serial::Deserialize(ciphertext, *replayStream_, SerType::BINARY);
+        return ciphertext;
+    }
+    auto ciphertext = cryptoContext->Encrypt(publicKey, plaintext);
+    recorded_.push_back(ciphertext);
+    entries_.push_back(expected);
+    return ciphertext;
+}
+
+std::vector<Ciphertext<DCRTPoly>> CryptoCache::encrypt(CryptoContext<DCRTPoly> &cryptoContext,
+                                                       const PublicKey<DCRTPoly> &publicKey,
+                                                       const std::vector<Plaintext> &plaintexts,
+                                                       const std::string &tag) {
+    std::vector<Ciphertext<DCRTPoly>> ciphertexts(plaintexts.size());
+    if (mode_ == CryptoCacheMode::Replay) {
+        for (size_t i = 0; i < plaintexts.size(); i++) {
+            ciphertexts[i] = encrypt(cryptoContext, publicKey, plaintexts[i], tag);
+        }
+        return ciphertexts;
+    }
+    #pragma omp parallel for
+    for (size_t i = 0; i < plaintexts.size(); i++) { ciphertexts[i] = cryptoContext->Encrypt(publicKey, plaintexts[i]); }
+    if (mode_ == CryptoCacheMode::Record) {
+        recorded_.insert(recorded_.end(), ciphertexts.begin(), ciphertexts.end());
+        for (auto &plaintext : plaintexts) { entries_.push_back(entry(plaintext, tag)); }
+    }
+    return ciphertexts;
+}
+
+CryptoCache &cryptoCache() {
+    static CryptoCache cache;
+    return cache;
+}
+
+Ciphertext<DCRTPoly> cachedEncrypt(CryptoContext<DCRTPoly> &cryptoContext, const PublicKey<DCRTPoly> &publicKey,
+                                   const Plaintext &plaintext, const std::string &tag) {
+    return cryptoCache().encrypt(cryptoContext, publicKey, plaintext, tag);
+}
+
+std::vector<Ciphertext<DCRTPoly>> cachedEncrypt(CryptoContext<DCRTPoly> &cryptoContext,
+                                                const PublicKey<DCRTPoly> &publicKey,
+                                                const std::vector<Plaintext> &plaintexts, const std::string &tag) {
+    return cryptoCache().encrypt(cryptoContext, publicKey, plaintexts, tag);
+}
@@ -0,0 +1,94 @@
+#ifndef CRYPTO_CACHE_H
+#define CRYPTO_CACHE_H
+
+#include "openfhe.h"
+#include "ciphertext-ser.h"
+#include "cryptocontext-ser.h"
+#include "key/key-ser.h"
+#include "scheme/bgvrns/bgvrns-ser.h"
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+using namespace lbcrypto;
+
+
+// Read-only memory mapped file as stream buffer (deserialization without copies into an ifstream buffer).
+class MappedFileBuf : public std::streambuf {
+public:
+    MappedFileBuf(std::string path);
+    ~MappedFileBuf();
+    MappedFileBuf(const MappedFileBuf&) = delete;
+    MappedFileBuf& operator=(const MappedFileBuf&) = delete;
+
+private:
+    char *data_;
+    size_t size_;
+};
+
+
+// On-disk cache of the offline set-up, keyed by parameter set and set-up options: crypto context, key pair,
+// evaluation keys (multiplication, rotation and sum keys) and the encrypted constants of the Init* objects.
+// Record: the set-up runs as usual, its encryptions are collected and saved with the context and keys.
+// Replay: context and keys are loaded (memory mapped), key generation is skipped and the encryptions of the
+// set-up return the recorded ciphertexts in order. The set-up must be deterministic for a given key: every
+// encryption carries a tag (its call site), checked on replay together with the plaintext level and length,
+// and finishReplay() checks that all recorded ciphertexts were consumed.
+enum class CryptoCacheMode { Off, Record, Replay };
+
+class CryptoCache {
+public:
+    CryptoCache();
+
+    // Replay if a complete cache for key exists in directory, record otherwise.
+    void open(std::string directory, std::string key);
+    CryptoCacheMode mode() const;
+    std::string path() const;
+    // False when replaying: evaluation keys come from the cache.
+    bool generateKeys() const;
+
+    // Replay: context, key pair and evaluation keys.
+    void load(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> &keyPair);
+    // Record: context, key pair, evaluation keys and recorded ciphertexts. The manifest is written last,
+    // so an interrupted save leaves an incomplete (ignored) cache. The secret key file is owner-only (0600).
+    void save(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> &keyPair);
+    // Replay: end of the set-up, throws unless every recorded ciphertext was replayed.
+    void finishReplay();
+
+    // Tags must not contain whitespace.
+    Ciphertext<DCRTPoly> encrypt(CryptoContext<DCRTPoly> &cryptoContext, const PublicKey<DCRTPoly> &publicKey,
+                                 const Plaintext &plaintext, const std::string &tag);
+    // Encryptions in parallel (recorded and replayed in order).
+    std::vector<Ciphertext<DCRTPoly>> encrypt(CryptoContext<DCRTPoly> &cryptoContext,
+                                              const PublicKey<DCRTPoly> &publicKey,
+                                              const std::vector<Plaintext> &plaintexts, const std::string &tag);
+
+private:
+    // Call site and shape of a recorded ciphertext (manifest line).
+    struct Entry { std::string tag; uint32_t level; size_t length; };
+    Entry entry(const Plaintext &plaintext, const std::string &tag) const;
+    void checkEntry(const Entry &expected);
+
+    CryptoCacheMode mode_;
+    std::string path_;
+    std::string key_;
+    std::vector<Ciphertext<DCRTPoly>> recorded_;
+    std::vector<Entry> entries_;
+    size_t replayed_;
+    std::unique_ptr<MappedFileBuf> replayBuf_;
+    std::unique_ptr<std::istream> replayStream_;
+};
+
+// Process-wide cache of the set-up (Off unless opened).
+CryptoCache &cryptoCache();
+
+// Encryption of a set-up constant through cryptoCache().
+Ciphertext<DCRTPoly> cachedEncrypt(CryptoContext<DCRTPoly> &cryptoContext, const PublicKey<DCRTPoly> &publicKey,
+                                   const Plaintext &plaintext, const std::string &tag);
+std::vector<Ciphertext<DCRTPoly>> cachedEncrypt(CryptoContext<DCRTPoly> &cryptoContext,
+                                                const PublicKey<DCRTPoly> &publicKey,
+                                                const std::vector<Plaintext> &plaintexts, const std::string &tag);
+
+
+#endif
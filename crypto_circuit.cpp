@@ -0,0 +1,280 @@
+#include "crypto_circuit.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <omp.h>
+
+
+std::string circuitOpName(CircuitOp op) {
+    switch (op) {
+        case CircuitOp::Input: return "Input";
+        case CircuitOp::Rotate: return "Rotate";
+        case CircuitOp::FastRotate: return "FastRotate";
+        case CircuitOp::Mult: return "Mult";
+        case CircuitOp::MultNoRelin: return "MultNoRelin";
+        case CircuitOp::MultConst: return "MultConst";
+        case CircuitOp::MultConstNoRelin: return "MultConstNoRelin";
+        case CircuitOp::Add: return "Add";
+        case CircuitOp::AddConst: return "AddConst";
+        case CircuitOp::AddMany: return "AddMany";
+        case CircuitOp::Relinearize: return "Relinearize";
+        case CircuitOp::ModReduce: return "ModReduce";
+        case CircuitOp::LevelReduce: return "LevelReduce";
+    }
+    return "";
+}
+
+CircuitConstant circuitConstant(const LevelConstant &constant) {
+    return {&constant, 0, [&constant](uint32_t level) { return constant.at(level); }, nullptr};
+}
+
+CircuitConstant circuitConstant(const Ciphertext<DCRTPoly> &constant) {
+    return {constant.get(), 0, [constant](uint32_t) { return constant; }, nullptr};
+}
+
+CircuitConstant circuitConstant(const Plaintext &constant) {
+    return {constant.get(), 0, nullptr, [constant](uint32_t) { return constant; }};
+}
+
+
+Circuit::Circuit(const InitRotationPlan *rotationPlan) : rotationPlan_(rotationPlan) {}
+
+Circuit::Node Circuit::emit(CircuitOp op, std::vector<Node> operands, int32_t param, CircuitConstant constant) {
+    // Commutative operations: one node for both operand orders.
+    if (op == CircuitOp::Mult || op == CircuitOp::MultNoRelin || op == CircuitOp::Add) {
+        std::sort(operands.begin(), operands.end());
+    }
+    NodeKey key(int(op), operands, param, constant.source, constant.index);
+    auto existing = index_.find(key);
+    if (existing != index_.end()) { merged_++; return existing->second; }
+
+    NodeData node{op, operands, param, constant, nullptr, "", {}};
+    for (auto &scope : scopes_) {
+        if (!scope.first.empty()) { node.scope = scope.first; }
+        node.args.insert(node.args.end(), scope.second.begin(), scope.second.end());
+    }
+    nodes_.push_back(node);
+    index_[key] = nodes_.size()-1;
+    return nodes_.size()-1;
+}
+
+Circuit::Node Circuit::input(const Ciphertext<DCRTPoly> &ciphertext) {
+    NodeKey key(int(CircuitOp::Input), {}, 0, ciphertext.get(), 0);
+    auto existing = index_.find(key);
+    if (existing != index_.end()) { return existing->second; }
+    nodes_.push_back({CircuitOp::Input, {}, 0, {nullptr, 0, nullptr, nullptr}, ciphertext, "", {}});
+    index_[key] = nodes_.size()-1;
+    return nodes_.size()-1;
+}
+
+Circuit::Node Circuit::rotate(Node x, int32_t index) {
+    return (index == 0) ? x : emit(CircuitOp::Rotate, {x}, index);
+}
+
+Circuit::Node Circuit::fastRotate(Node x, int32_t index) {
+    return (index == 0) ? x : emit(CircuitOp::FastRotate, {x}, index);
+}
+
+Circuit::Node Circuit::mult(Node x, Node y) { return emit(CircuitOp::Mult, {x, y}); }
+Circuit::Node Circuit::multNoRelin(Node x, Node y) { return emit(CircuitOp::MultNoRelin, {x, y}); }
+Circuit::Node Circuit::mult(Node x, const CircuitConstant &constant) {
+    return emit(CircuitOp::MultConst, {x}, 0, constant);
+}
+Circuit::Node Circuit::multNoRelin(Node x, const CircuitConstant &constant) {
+    return emit(CircuitOp::MultConstNoRelin, {x}, 0, constant);
+}
+Circuit::Node Circuit::add(Node x, Node y) { return emit(CircuitOp::Add, {x, y}); }
+Circuit::Node Circuit::add(Node x, const CircuitConstant &constant) {
+    return emit(CircuitOp::AddConst, {x}, 0, constant);
+}
+Circuit::Node Circuit::addMany(std::vector<Node> xs) {
+    return (xs.size() == 1) ? xs[0] : emit(CircuitOp::AddMany, xs);
+}
+Circuit::Node Circuit::relinearize(Node x) { return emit(CircuitOp::Relinearize, {x}); }
+Circuit::Node Circuit::modReduce(Node x) { return emit(CircuitOp::ModReduce, {x}); }
+Circuit::Node Circuit::levelReduce(Node x, Node ref, int offset) {
+    return emit(CircuitOp::LevelReduce, {x, ref}, offset);
+}
+
+void Circuit::pushScope(std::string name, TraceArgs args) { scopes_.push_back({name, args}); }
+void Circuit::popScope() { scopes_.pop_back(); }
+
+size_t Circuit::size() const { return nodes_.size(); }
+size_t Circuit::merged() const { return merged_; }
+
+
+CircuitScope::CircuitScope(Circuit &circuit, std::string name, TraceArgs args) : circuit_(circuit) {
+    circuit_.pushScope(name, args);
+}
+CircuitScope::~CircuitScope() { circuit_.popScope(); }
+
+
+std::vector<Ciphertext<DCRTPoly>> evalCircuit(CryptoContext<DCRTPoly> &cryptoContext, Circuit &circuit,
+                                              const std::vector<Circuit::Node> &outputs) {
+    auto &nodes = circuit.nodes_;
+    int count = nodes.size();
+    TraceSpan span("evalCircuit", {{"nodes", count}});
+
+    // Nodes the outputs depend on (operands precede their consumers), consumers and remaining uses.
+    std::vector<bool> live(count, false);
+    for (auto output : outputs) { live[output] = true; }
+    for (int node = count-1; node >= 0; node--) {
+        if (live[node]) { for (auto operand : nodes[node].operands) { live[operand] = true; } }
+    }
+    std::vector<std::vector<Circuit::Node>> consumers(count);
+    std::vector<std::atomic<int>> pending(count);
+    std::vector<std::atomic<int>> uses(count);
+    for (int node = 0; node < count; node++) { pending[node] = 0; uses[node] = 0; }
+    for (auto output : outputs) { uses[output]++; }
+    int liveCount = 0;
+    for (int node = 0; node < count; node++) {
+        if (!live[node]) { continue; }
+        liveCount++;
+        for (auto operand : nodes[node].operands) { consumers[operand].push_back(node); pending[node]++; uses[operand]++; }
+    }
+
+    std::vector<Ciphertext<DCRTPoly>> values(count);
+    // Digit decompositions of FastRotate operands, computed by the first rotation.
+    std::vector<std::shared_ptr<std::vector<DCRTPoly>>> precomps(count);
+    std::vector<std::once_flag> precomputed(count);
+    auto m = cryptoContext->GetCryptoParameters()->GetElementParams()->GetCyclotomicOrder();
+
+    auto run = [&](Circuit::Node node) {
+        auto &data = nodes[node];
+        auto operand = [&](int i) -> const Ciphertext<DCRTPoly>& { return values[data.operands[i]]; };
+        TraceArgs args = data.args;
+        if (!data.operands.empty()) { args.push_back({"level", operand(0)->GetLevel()}); }
+        std::unique_ptr<CryptoOpsScope> scope;
+        std::unique_ptr<TraceSpan> opSpan;
+        if (!data.scope.empty()) { scope.reset(new CryptoOpsScope(data.scope, args)); }
+        else if (data.op != CircuitOp::Input) { opSpan.reset(new TraceSpan(circuitOpName(data.op), args)); }
+        // In-place operations work on a copy unless this node is the last use of an intermediate operand.
+        auto owned = [&](int i) {
+            auto x = data.operands[i];
+            return (nodes[x].op != CircuitOp::Input && uses[x] == 1) ? values[x] : values[x]->Clone();
+        };
+        Ciphertext<DCRTPoly> result;
+        switch (data.op) {
+            case CircuitOp::Input:
+                result = data.ciphertext; break;
+            case CircuitOp::Rotate:
+                result = evalRotate(cryptoContext, operand(0), data.param, circuit.rotationPlan_); break;
+            case CircuitOp::FastRotate: {
+                auto x = data.operands[0];
+                std::call_once(precomputed[x], [&]() {
+                    precomps[x] = cryptoContext->EvalFastRotationPrecompute(values[x]);
+                });
+                result = evalFastRotate(cryptoContext, operand(0), data.param, m, precomps[x], circuit.rotationPlan_);
+                break;
+            }
+            case CircuitOp::Mult:
+                result = evalMult(cryptoContext, operand(0), operand(1)); break;
+            case CircuitOp::MultNoRelin:
+                result = evalMultNoRelin(cryptoContext, operand(0), operand(1)); break;
+            case CircuitOp::MultConst: {
+                uint32_t level = operand(0)->GetLevel();
+                result = data.constant.ciphertext ? evalMult(cryptoContext, operand(0), data.constant.ciphertext(level))
+                                                  : evalMult(cryptoContext, operand(0), data.constant.plaintext(level));
+                break;
+            }
+            case CircuitOp::MultConstNoRelin:
+                result = evalMultNoRelin(cryptoContext, operand(0), data.constant.ciphertext(operand(0)->GetLevel()));
+                break;
+            case CircuitOp::Add:
+                result = evalAdd(cryptoContext, operand(0), operand(1)); break;
+            case CircuitOp::AddConst: {
+                uint32_t level = operand(0)->GetLevel();
+                result = data.constant.ciphertext ? evalAdd(cryptoContext, data.constant.ciphertext(level), operand(0))
+                                                  : evalAdd(cryptoContext, operand(0), data.constant.plaintext(level));
+                break;
+            }
+            case CircuitOp::AddMany: {
+                std::vector<Ciphertext<DCRTPoly>> addContainer;
+                for (auto x : data.operands) { addContainer.push_back(values[x]); }
+                result = evalAddMany(cryptoContext, addContainer);
+                break;
+            }
+            case CircuitOp::Relinearize:
+                result = owned(0); evalRelinearizeInPlace(result, cryptoContext); break;
+            case CircuitOp::ModReduce:
+                result = owned(0); evalModReduceInPlace(cryptoContext, result); break;
+            case CircuitOp::LevelReduce:
+                result = evalLevelReduce(cryptoContext, operand(0), operand(1)->GetLevel() + data.param); break;
+        }
+        values[node] = result;
+        for (auto x : data.operands) {
+            if (--uses[x] == 0) { values[x] = nullptr; precomps[x] = nullptr; }
+        }
+    };
+
+    // Ready queues per thread: the owner pushes and pops at the back, thieves take from the front.
+    int threads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    std::vector<std::deque<Circuit::Node>> queues(threads);
+    std::vector<std::mutex> queueMutexes(threads);
+    int seeded = 0;
+    for (int node = 0; node < count; node++) {
+        if (live[node] && pending[node] == 0) { queues[seeded++ % threads].push_back(node); }
+    }
+    std::atomic<int> remaining(liveCount);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    // Idle threads block until a node is queued, the circuit completes or a node fails. The state changes before
+    // readyMutex is taken for the notification, so a thread checking it under the mutex misses no wake-up.
+    std::atomic<int> ready(seeded);
+    std::mutex readyMutex;
+    std::condition_variable readyCondition;
+    auto notifyReady = [&]() {
+        { std::lock_guard<std::mutex> lock(readyMutex); }
+        readyCondition.notify_all();
+    };
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int self = omp_get_thread_num();
+        auto take = [&](int queue, bool back, Circuit::Node &node) {
+            std::lock_guard<std::mutex> lock(queueMutexes[queue]);
+            if (queues[queue].empty()) { return false; }
+            node = back ? queues[queue].back() : queues[queue].front();
+            if (back) { queues[queue].pop_back(); } else { queues[queue].pop_front(); }
+            ready--;
+            return true;
+        };
+        while (remaining > 0 && !failed) {
+            Circuit::Node node;
+            bool found = take(self, true, node);
+            for (int victim = 1; !found && victim < threads; victim++) { found = take((self+victim) % threads, false, node); }
+            if (!found) {
+                std::unique_lock<std::mutex> lock(readyMutex);
+                readyCondition.wait(lock, [&]() { return ready > 0 || remaining == 0 || failed; });
+                continue;
+            }
+            try { run(node); }
+            catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error) { error = std::current_exception(); }
+                }
+                failed = true;
+                notifyReady();
+            }
+            bool queued = false;
+            for (auto consumer : consumers[node]) {
+                if (--pending[consumer] == 0) {
+                    std::lock_guard<std::mutex> lock(queueMutexes[self]);
+                    queues[self].push_back(consumer);
+                    ready++;
+                    queued = true;
+                }
+            }
+            if (--remaining == 0 || queued) { notifyReady(); }
+        }
+    }
+    if (error) { std::rethrow_exception(error); }
+
+    std::vector<Ciphertext<DCRTPoly>> results;
+    for (auto output : outputs) { results.push_back(values[output]); }
+    return results;
+}
@@ -0,0 +1,112 @@
+#ifndef CRYPTO_CIRCUIT_H
+#define CRYPTO_CIRCUIT_H
+
+#include "openfhe.h"
+#include "utilities.h"
+#include "crypto_utilities.h"
+#include "crypto_rotation_plan.h"
+#include <functional>
+#include <map>
+#include <tuple>
+
+using namespace lbcrypto;
+
+
+// Homomorphic circuit: kernels emit their operations as nodes of a DAG (circuitXxx next to the evalXxx kernels)
+// and evalCircuit() runs the DAG. Nodes are merged on insertion: an operation on the same operands with the same
+// rotation index or constant returns the existing node, so identical rotations and constant products of different
+// kernels, steps or users are evaluated once. Constants are resolved at the level of their ciphertext operand when
+// the node runs (LevelConstant copies, per-level masks), so circuits are built without knowing levels.
+enum class CircuitOp { Input, Rotate, FastRotate, Mult, MultNoRelin, MultConst, MultConstNoRelin, Add, AddConst,
+                       AddMany, Relinearize, ModReduce, LevelReduce };
+std::string circuitOpName(CircuitOp op);
+
+// Constant operand (ciphertext or plaintext per level), identified by (source, index) for merging.
+struct CircuitConstant {
+    const void *source;
+    int index;
+    std::function<Ciphertext<DCRTPoly>(uint32_t)> ciphertext;
+    std::function<Plaintext(uint32_t)> plaintext;
+};
+// Copy of a LevelConstant at the operand level, or a fixed ciphertext/plaintext (e.g. matrix masks).
+CircuitConstant circuitConstant(const LevelConstant &constant);
+CircuitConstant circuitConstant(const Ciphertext<DCRTPoly> &constant);
+CircuitConstant circuitConstant(const Plaintext &constant);
+
+class Circuit {
+public:
+    typedef int Node;
+    // Rotation nodes run through rotationPlan (evalRotate()).
+    explicit Circuit(const InitRotationPlan *rotationPlan);
+
+    Node input(const Ciphertext<DCRTPoly> &ciphertext);
+    // Rotation by index (x for index 0).
+    Node rotate(Node x, int32_t index);
+    // Hoisted rotation: the rotations of x share one digit decomposition (evalFastRotate).
+    Node fastRotate(Node x, int32_t index);
+    Node mult(Node x, Node y);
+    Node multNoRelin(Node x, Node y);
+    Node mult(Node x, const CircuitConstant &constant);
+    // Ciphertext constants only (mask products accumulated and relinearized once).
+    Node multNoRelin(Node x, const CircuitConstant &constant);
+    Node add(Node x, Node y);
+    Node add(Node x, const CircuitConstant &constant);
+    Node addMany(std::vector<Node> xs);
+    // Relinearization (degree > 1) and rescaling, see evalRelinearizeInPlace().
+    Node relinearize(Node x);
+    Node modReduce(Node x);
+    // x dropped to the level of ref plus offset (unchanged at or above it).
+    Node levelReduce(Node x, Node ref, int offset = 0);
+
+    // Ops report scope and span args of the nodes emitted until popScope(). Nodes record the innermost scope name
+    // (empty name: args only) and the args of all open scopes.
+    void pushScope(std::string name, TraceArgs args = {});
+    void popScope();
+
+    // Nodes, and emitted operations answered by an existing node.
+    size_t size() const;
+    size_t merged() const;
+
+private:
+    struct NodeData {
+        CircuitOp op;
+        std::vector<Node> operands;
+        int32_t param;
+        CircuitConstant constant;
+        Ciphertext<DCRTPoly> ciphertext;
+        std::string scope;
+        TraceArgs args;
+    };
+    typedef std::tuple<int, std::vector<Node>, int32_t, const void*, int> NodeKey;
+    Node emit(CircuitOp op, std::vector<Node> operands, int32_t param = 0,
+              CircuitConstant constant = {nullptr, 0, nullptr, nullptr});
+
+    const InitRotationPlan *rotationPlan_;
+    std::vector<NodeData> nodes_;
+    std::map<NodeKey, Node> index_;
+    std::vector<std::pair<std::string, TraceArgs>> scopes_;
+    size_t merged_ = 0;
+
+    friend std::vector<Ciphertext<DCRTPoly>> evalCircuit(CryptoContext<DCRTPoly> &cryptoContext, Circuit &circuit,
+                                                         const std::vector<Circuit::Node> &outputs);
+};
+
+// Scope of a circuit for the lifetime of the object.
+class CircuitScope {
+public:
+    CircuitScope(Circuit &circuit, std::string name, TraceArgs args = {});
+    ~CircuitScope();
+private:
+    Circuit &circuit_;
+};
+
+// Runs the nodes the outputs depend on, on all OpenMP threads: a node becomes ready once its operands are
+// evaluated, and each thread runs ready nodes from its own queue (newest first, so a node's consumers tend to run
+// on the thread holding its result) and steals the oldest ready nodes of other threads when its queue is empty.
+// Threads without any ready node to run or steal sleep until one is queued.
+// Intermediate results are released after their last consumer.
+std::vector<Ciphertext<DCRTPoly>> evalCircuit(CryptoContext<DCRTPoly> &cryptoContext, Circuit &circuit,
+                                              const std::vector<Circuit::Node> &outputs);
+
+
+#endif
@@ -4,8 +4,8 @@
 
 std::vector<Ciphertext<DCRTPoly>> rowToColEnc(std::vector<Ciphertext<DCRTPoly>> &encRows, 
                                               CryptoContext<DCRTPoly> &cryptoContext,
-                                              InitRotsMasks &InitRotsMasks,
-                                              CryptoOpsLogger &cryptoOpsLogger) {
+                                              InitRotsMasks &InitRotsMasks) {
+    CryptoOpsScope scope("rowToColEnc", {{"level", encRows[0]->GetLevel()}});
     // Assumes n x n matrix: n plaintext slots in each row encryption.
     int n = encRows.size();
     // Populate column containers with encryptions of isolated matrix elements.
@@ -13,16 +13,10 @@ std::vector<Ciphertext<DCRTPoly>> rowToColEnc(std::vector<Ciphertext<DCRTPoly>>
     for (int row=0 ; row < n ; ++row){ 
         for (int elem=0 ; elem < n ; ++elem){ 
             // Isolate row element and shift element to corresponding position in column.
-            // Compute & log Multiplication over ciphertexts.
-            auto mask = InitRotsMasks.encMasks();
-            TimeVar t; TIC(t);
-            auto masked_enc_row = cryptoContext->EvalMult(encRows[row], mask[elem]); // Masked enc(row).
-            cryptoContext->ModReduceInPlace(masked_enc_row);
-            cryptoOpsLogger.logMult(TOC(t));
-            // Compute & log Rotation over ciphertexts.
-            TIC(t);
-            auto enc_elem = cryptoContext->EvalRotate(masked_enc_row, elem - row);
-            cryptoOpsLogger.logRot(TOC(t));
+            auto &mask = InitRotsMasks.encMasks();
+            auto masked_enc_row = evalMult(cryptoContext, encRows[row], mask[elem]); // Masked enc(row).
+            evalModReduceInPlace(cryptoContext, masked_enc_row);
+            auto enc_elem = evalRotate(cryptoContext, masked_enc_row, elem - row, nullptr);
             // Insert isolated column element into column container.
             if (row == 0) {
                 std::vector<Ciphertext<DCRTPoly>> enc_elem_vec;
@@ -37,9 +31,7 @@ std::vector<Ciphertext<DCRTPoly>> rowToColEnc(std::vector<Ciphertext<DCRTPoly>>
     // Add all ciphertexts in each column container.
     std::vector<Ciphertext<DCRTPoly>> encCols; 
     for (int col=0 ; col < n ; ++col){ 
-        TimeVar t; int len = enc_col_container[col].size();
-        TIC(t); auto res = cryptoContext->EvalAddMany(enc_col_container[col]); 
-        cryptoOpsLogger.logAddMany(len,TOC(t)); 
+        auto res = evalAddMany(cryptoContext, enc_col_container[col]);
         encCols.push_back(res);
     }   
     return encCols;
@@ -49,8 +41,8 @@ std::vector<Ciphertext<DCRTPoly>> rowToColEnc(std::vector<Ciphertext<DCRTPoly>>
 std::vector<Ciphertext<DCRTPoly>> // Row-encrypted output matrix.
     encElem2Rows(std::vector<std::vector<Ciphertext<DCRTPoly>>> &encMatElems,
                 CryptoContext<DCRTPoly> &cryptoContext,
-                InitRotsMasks &initRotsMasks,
-                CryptoOpsLogger &cryptoOpsLogger) {
+                InitRotsMasks &initRotsMasks) {
+    CryptoOpsScope scope("encElem2Rows", {{"level", encMatElems[0][0]->GetLevel()}});
     // Derive enc(row) form of input matrix elements.
     int n = encMatElems.size(); 
     std::vector<Ciphertext<DCRTPoly>> encMatRows;
@@ -58,16 +50,10 @@ std::vector<Ciphertext<DCRTPoly>> // Row-encrypted output matrix.
         std::vector<Ciphertext<DCRTPoly>> encRowContainer;
         for (int col=0 ; col < n ; ++col){ 
             auto encElemMasked = encMatElems[row][col];
-            // Compute & Log Rotation of ciphertexts.
-            TimeVar t; TIC(t);
-            auto res = cryptoContext->EvalRotate(encElemMasked, -col);
-            cryptoOpsLogger.logRot(TOC(t));
+            auto res = evalRotate(cryptoContext, encElemMasked, -col, nullptr);
             encRowContainer.push_back(res);
         }
-        // Compute & Log AddMany over ciphertexts..
-        TimeVar t; int len = encRowContainer.size();
-        TIC(t); auto encMatRow = cryptoContext->EvalAddMany(encRowContainer);
-        cryptoOpsLogger.logAddMany(len,TOC(t));
+        auto encMatRow = evalAddMany(cryptoContext, encRowContainer);
         encMatRows.push_back(encMatRow);
     }
     return encMatRows;       
@@ -77,8 +63,8 @@ std::vector<Ciphertext<DCRTPoly>> // Row-encrypted output matrix.
 std::vector<Ciphertext<DCRTPoly>> // Col-encrypted output matrix.
     encElem2Cols(std::vector<std::vector<Ciphertext<DCRTPoly>>> &encMatElems,
                 CryptoContext<DCRTPoly> &cryptoContext,
-                InitRotsMasks &initRotsMasks,
-                CryptoOpsLogger &cryptoOpsLogger) {
+                InitRotsMasks &initRotsMasks) {
+    CryptoOpsScope scope("encElem2Cols", {{"level", encMatElems[0][0]->GetLevel()}});
     // Derive enc(col) form of input matrix elements.
     int n = encMatElems.size(); 
     std::vector<Ciphertext<DCRTPoly>> encMatCols;
@@ -86,15 +72,9 @@ std::vector<Ciphertext<DCRTPoly>> // Col-encrypted output matrix.
         std::vector<Ciphertext<DCRTPoly>> encColContainer;
         for (int row=0 ; row < n ; ++row){ 
             auto encElemMasked = encMatElems[row][col];
-            // Compute & Log Rotation of ciphertexts.
-            TimeVar t; TIC(t);
-            encColContainer.push_back(cryptoContext->EvalRotate(encElemMasked, -row));
-            cryptoOpsLogger.logRot(TOC(t));
+            encColContainer.push_back(evalRotate(cryptoContext, encElemMasked, -row, nullptr));
         }
-        // Compute & Log AddMany over ciphertexts.
-        TimeVar t; int len = encColContainer.size();
-        TIC(t); auto encMatCol = cryptoContext->EvalAddMany(encColContainer);
-        cryptoOpsLogger.logAddMany(len,TOC(t));
+        auto encMatCol = evalAddMany(cryptoContext, encColContainer);
         encMatCols.push_back(encMatCol);
     }
     return encMatCols;
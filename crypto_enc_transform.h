@@ -4,24 +4,24 @@
 #include "openfhe.h"
 #include "utilities.h"
 #include "crypto_utilities.h"
+#include "crypto_rotation_plan.h"
 
 using namespace lbcrypto;
 
 // Helper method for matrix exponentiation: transforms row encryptions to encryptions of columns.
+// Crypto operations are logged to cryptoOpsLogger(), under the scope of the function name. Rotations use the keys
+// generated by InitRotsMasks (no rotation plan).
 std::vector<Ciphertext<DCRTPoly>> rowToColEnc(std::vector<Ciphertext<DCRTPoly>> &encRows, 
                                               CryptoContext<DCRTPoly> &cryptoContext,
-                                              InitRotsMasks &InitRotsMasks,
-                                              CryptoOpsLogger &cryptoOpsLogger);
+                                              InitRotsMasks &InitRotsMasks);
 
 std::vector<Ciphertext<DCRTPoly>> encElem2Rows(std::vector<std::vector<Ciphertext<DCRTPoly>>> &encMatElems,
                                                CryptoContext<DCRTPoly> &cryptoContext,
-                                               InitRotsMasks &initRotsMasks,
-                                               CryptoOpsLogger &cryptoOpsLogger);
+                                               InitRotsMasks &initRotsMasks);
 
 std::vector<Ciphertext<DCRTPoly>> encElem2Cols(std::vector<std::vector<Ciphertext<DCRTPoly>>> &encMatElems,
                                                CryptoContext<DCRTPoly> &cryptoContext,
-                                               InitRotsMasks &initRotsMasks,
-                                               CryptoOpsLogger &cryptoOpsLogger);
+                                               InitRotsMasks &initRotsMasks);
 
 
 #endif
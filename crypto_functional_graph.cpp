@@ -0,0 +1,91 @@
+#include "crypto_functional_graph.h"
+
+
+std::string cycleFindingEngineName(CycleFindingMode mode) {
+    return (mode == CycleFindingMode::FunctionalGraph) ? "Functional graph walk counts" : "Matrix exponentiation";
+}
+
+std::vector<bool> cycleSumSteps(int maxCycleLength) {
+    std::vector<bool> steps;
+    for (int bit = int(std::floor(std::log2(maxCycleLength))) - 1; bit >= 0; bit--) {
+        steps.push_back(true);
+        if (maxCycleLength >> bit & 1) { steps.push_back(false); }
+    }
+    return steps;
+}
+
+InitFunctionalGraph::InitFunctionalGraph(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                                         const InitRotationPlan *rotationPlan, int d, int markets, uint32_t levels) :
+    d(d), markets(markets), rotationPlan(rotationPlan) {
+    // Masks in each market segment, capped at the segment size (the engine itself requires d^2 <= segment).
+    int maxSlots = cryptoContext->GetRingDimension();
+    int maskSlots = std::min(d*d, marketSlots(maxSlots, markets));
+    std::vector<int64_t> rowMask(maskSlots,0);
+    std::vector<int64_t> blockMask(maskSlots,0);
+    for (int i = 0; i < d && i*d < maskSlots; i++) { rowMask[i] = 1; blockMask[i*d] = 1; }
+    for (uint32_t level = 0; level < std::max(levels, 1u); level++) {
+        rowMask_.push_back(cryptoContext->MakePackedPlaintext(
+            packMarkets(std::vector<std::vector<int64_t>>(markets,rowMask),maxSlots), 1, level));
+        rowMask_.back()->SetFormat(EVALUATION);
+        blockMask_.push_back(cryptoContext->MakePackedPlaintext(
+            packMarkets(std::vector<std::vector<int64_t>>(markets,blockMask),maxSlots), 1, level));
+        blockMask_.back()->SetFormat(EVALUATION);
+    }
+    std::vector<int64_t> onesRow(d,1);
+    encOnesRow_ = cachedEncrypt(cryptoContext, keyPair.publicKey,
+                                cryptoContext->MakePackedPlaintext(packMarkets(std::vector<std::vector<int64_t>>(markets,onesRow),maxSlots)),
+                                "InitFunctionalGraph");
+}
+
+Plaintext InitFunctionalGraph::rowMask(uint32_t level) {
+    return rowMask_[std::min<size_t>(level, rowMask_.size()-1)];
+}
+Plaintext InitFunctionalGraph::blockMask(uint32_t level) {
+    return blockMask_[std::min<size_t>(level, blockMask_.size()-1)];
+}
+Ciphertext<DCRTPoly> InitFunctionalGraph::encOnesRow() { return encOnesRow_; }
+int InitFunctionalGraph::steps() const { return d + d % 2; }
+
+
+Ciphertext<DCRTPoly> evalWalkStepRowToBlock(Ciphertext<DCRTPoly> encVecRow,
+                                            Ciphertext<DCRTPoly> &encAdjMatrixTransposedFlat,
+                                            CryptoContext<DCRTPoly> &cryptoContext,
+                                            InitFunctionalGraph &initFunctionalGraph) {
+    CryptoOpsScope scope("evalWalkStepRowToBlock", {{"level", encVecRow->GetLevel()}});
+    int d = initFunctionalGraph.d;
+    // Replicate v into each block: slot j*d+i = v_i.
+    auto encVecRep = evalRotateSum(cryptoContext, encVecRow, d, -d, initFunctionalGraph.rotationPlan);
+    // Slot j*d+i = A[i][j] v_i, summed within block j into its head.
+    auto encProd = evalMult(cryptoContext, encAdjMatrixTransposedFlat, encVecRep);
+    evalModReduceInPlace(cryptoContext, encProd);
+    auto encSum = evalRotateSum(cryptoContext, encProd, d, 1, initFunctionalGraph.rotationPlan);
+    auto res = evalMult(cryptoContext, encSum, initFunctionalGraph.blockMask(encSum->GetLevel()));
+    evalModReduceInPlace(cryptoContext, res);
+    return res;
+}
+
+Ciphertext<DCRTPoly> evalWalkStepBlockToRow(Ciphertext<DCRTPoly> encVecBlock,
+                                            Ciphertext<DCRTPoly> &encAdjMatrixFlat,
+                                            CryptoContext<DCRTPoly> &cryptoContext,
+                                            InitFunctionalGraph &initFunctionalGraph) {
+    CryptoOpsScope scope("evalWalkStepBlockToRow", {{"level", encVecBlock->GetLevel()}});
+    int d = initFunctionalGraph.d;
+    // Broadcast block heads within each block: slot i*d+j = v_i.
+    auto encVecRep = evalRotateSum(cryptoContext, encVecBlock, d, -1, initFunctionalGraph.rotationPlan);
+    // Slot i*d+j = A[i][j] v_i, summed over blocks into slot j.
+    auto encProd = evalMult(cryptoContext, encAdjMatrixFlat, encVecRep);
+    evalModReduceInPlace(cryptoContext, encProd);
+    auto encSum = evalRotateSum(cryptoContext, encProd, d, d, initFunctionalGraph.rotationPlan);
+    auto res = evalMult(cryptoContext, encSum, initFunctionalGraph.rowMask(encSum->GetLevel()));
+    evalModReduceInPlace(cryptoContext, res);
+    return res;
+}
+
+std::set<int32_t> rotIndicesFunctionalGraph(int d) {
+    std::set<int32_t> rotIndices;
+    for (int32_t stride : {-d, 1, -1, d}) {
+        auto indices = rotIndicesRotateSum(d, stride);
+        rotIndices.insert(indices.begin(), indices.end());
+    }
+    return rotIndices;
+}
@@ -0,0 +1,70 @@
+#ifndef CRYPTO_FUNCTIONAL_GRAPH_H
+#define CRYPTO_FUNCTIONAL_GRAPH_H
+
+#include "openfhe.h"
+#include "utilities.h"
+#include "crypto_utilities.h"
+#include "crypto_rotation_plan.h"
+
+using namespace lbcrypto;
+
+
+// Cycle finding engine of phase (2a).
+// MatrixSquaring: repeated squaring of the flat packed adjacency matrix (evalMatrixMultParallel).
+// FunctionalGraph: the adjacency matrix of a TTC round has at most one out-edge per user, so the column sums
+// of A^t count the walks of length t ending in each user. Walks of length t >= d end only in users on a cycle,
+// so v <- A^T v (from v = ones) over t steps replaces the full matrix powers with matrix-vector products.
+enum class CycleFindingMode { MatrixSquaring, FunctionalGraph };
+std::string cycleFindingEngineName(CycleFindingMode mode);
+
+// Maximum cycle length L (MatrixSquaring): phase (2a) computes S = A + A^2 + ... + A^L instead of A^(2^ceil(log2 d)).
+// With one out-edge per user, S_ii = floor(L/c) for a user on a cycle of length c <= L and 0 otherwise, so phase (2b)
+// tests the diagonal of S with NotEqualZero over [0,L]. S follows the bits of L below the most significant one:
+// doubling S_2m = S_m + A^m S_m (A^2m = A^m A^m), then for a set bit S_m+1 = S_m + A^m A.
+// Steps of phase (2a), one matrix product level each: true doubles, false increments.
+std::vector<bool> cycleSumSteps(int maxCycleLength);
+
+
+// Layouts of v (d x d flat packing):
+//   row layout:   v_i in slot i, 0 elsewhere.
+//   block layout: v_i in slot i*d (head of block i), 0 elsewhere.
+// Steps alternate between both layouts, so the adjacency matrix is needed in flat form (slot i*d+j = A[i][j])
+// and transposed flat form (slot j*d+i = A[i][j]).
+class InitFunctionalGraph {
+public:
+    InitFunctionalGraph(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                        const InitRotationPlan *rotationPlan, int d, int markets = 1, uint32_t levels = 1);
+    // Masks encoded at the ciphertext level (capped at the highest cached level).
+    Plaintext rowMask(uint32_t level = 0);
+    Plaintext blockMask(uint32_t level = 0);
+    Ciphertext<DCRTPoly> encOnesRow();
+    // Number of steps: smallest even t >= d, so that the walk counts end in row layout.
+    int steps() const;
+
+    const int d;
+    const int markets;
+    const InitRotationPlan *const rotationPlan;
+private:
+    std::vector<Plaintext> rowMask_;
+    std::vector<Plaintext> blockMask_;
+    Ciphertext<DCRTPoly> encOnesRow_;
+};
+
+
+// A^T v: v in row layout, transposed flat adjacency matrix (at the level of v, see LevelConstant). Output in
+// block layout.
+Ciphertext<DCRTPoly> evalWalkStepRowToBlock(Ciphertext<DCRTPoly> encVecRow,
+                                            Ciphertext<DCRTPoly> &encAdjMatrixTransposedFlat,
+                                            CryptoContext<DCRTPoly> &cryptoContext,
+                                            InitFunctionalGraph &initFunctionalGraph);
+
+// A^T v: v in block layout, flat adjacency matrix (at the level of v). Output in row layout.
+Ciphertext<DCRTPoly> evalWalkStepBlockToRow(Ciphertext<DCRTPoly> encVecBlock,
+                                            Ciphertext<DCRTPoly> &encAdjMatrixFlat,
+                                            CryptoContext<DCRTPoly> &cryptoContext,
+                                            InitFunctionalGraph &initFunctionalGraph);
+
+std::set<int32_t> rotIndicesFunctionalGraph(int d);
+
+
+#endif
@@ -4,31 +4,258 @@
 
 Ciphertext<DCRTPoly> evalDiagMatrixVecMult(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals, // Output of repFillSlots()
                                            Ciphertext<DCRTPoly> encVec,                        // Output of repFillSlots()
-                                           CryptoContext<DCRTPoly> &cryptoContext) {
+                                           CryptoContext<DCRTPoly> &cryptoContext,
+                                           const InitRotationPlan *rotationPlan) {
+    CryptoOpsScope scope("evalDiagMatrixVecMult", {{"level", encVec->GetLevel()}});
     int d = encMatDiagonals.size();
     std::vector<Ciphertext<DCRTPoly>> addContainer;
     addContainer.resize(d);
 
     #pragma omp parallel for
     for (int l = 0; l < d; l++) {
-        auto encVecRot = cryptoContext->EvalRotate(encVec,l);
-        auto encVecRotMult = cryptoContext->EvalMult(encMatDiagonals[l],encVecRot);
+        auto encVecRot = evalRotate(cryptoContext, encVec, l, rotationPlan);
+        auto encVecRotMult = evalMultNoRelin(cryptoContext, encMatDiagonals[l],encVecRot);
         addContainer[l] = encVecRotMult;
     }
 
-    auto res = cryptoContext->EvalAddMany(addContainer);
+    auto res = evalAddManyRelin(addContainer, cryptoContext);
     return res;
 }
 
-InitMatrixMult::InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int d) :
-    d(d) {
+Ciphertext<DCRTPoly> evalDiagMatrixVecMultHoisted(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals, // Output of repFillSlots()
+                                                  Ciphertext<DCRTPoly> encVec,                        // Output of repFillSlots()
+                                                  CryptoContext<DCRTPoly> &cryptoContext,
+                                                  const InitRotationPlan *rotationPlan) {
+    CryptoOpsScope scope("evalDiagMatrixVecMultHoisted", {{"level", encVec->GetLevel()}});
+    int d = encMatDiagonals.size();
+    auto m = cryptoContext->GetCryptoParameters()->GetElementParams()->GetCyclotomicOrder();
+    // Digit decomposition of encVec is shared by all d rotations.
+    auto encVecPrecomp = cryptoContext->EvalFastRotationPrecompute(encVec);
+    std::vector<Ciphertext<DCRTPoly>> addContainer;
+    addContainer.resize(d);
+
+    #pragma omp parallel for
+    for (int l = 0; l < d; l++) {
+        auto encVecRot = (l == 0) ? encVec : evalFastRotate(cryptoContext, encVec, l, m, encVecPrecomp, rotationPlan);
+        addContainer[l] = evalMultNoRelin(cryptoContext, encMatDiagonals[l], encVecRot);
+    }
+
+    return evalAddManyRelin(addContainer, cryptoContext);
+}
+
+int bsgsBabySteps(int d) {
+    return std::ceil(std::sqrt(d));
+}
+
+std::vector<Ciphertext<DCRTPoly>> preRotateDiagonals(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals,
+                                                     int babySteps,
+                                                     CryptoContext<DCRTPoly> &cryptoContext,
+                                                     const InitRotationPlan *rotationPlan) {
+    CryptoOpsScope scope("preRotateDiagonals", {{"level", encMatDiagonals[0]->GetLevel()}});
+    int d = encMatDiagonals.size();
+    std::vector<Ciphertext<DCRTPoly>> encMatDiagonalsPreRotated;
+    encMatDiagonalsPreRotated.resize(d);
+
+    #pragma omp parallel for
+    for (int l = 0; l < d; l++) {
+        int giantStep = babySteps * (l / babySteps);
+        encMatDiagonalsPreRotated[l] = (giantStep == 0) ? encMatDiagonals[l]
+                                                        : evalRotate(cryptoContext, encMatDiagonals[l], -giantStep,
+                                                                     rotationPlan);
+    }
+    return encMatDiagonalsPreRotated;
+}
+
+std::vector<Ciphertext<DCRTPoly>> evalTransposeDiagonals(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals,
+                                                         int babySteps,
+                                                         CryptoContext<DCRTPoly> &cryptoContext,
+                                                         const InitRotationPlan *rotationPlan) {
+    CryptoOpsScope scope("evalTransposeDiagonals", {{"level", encMatDiagonals[0]->GetLevel()}});
+    int d = encMatDiagonals.size();
+    std::vector<Ciphertext<DCRTPoly>> encTransposedDiagonals;
+    encTransposedDiagonals.resize(d);
+
+    #pragma omp parallel for
+    for (int l = 0; l < d; l++) {
+        int shift = (babySteps > 0) ? l % babySteps : l;
+        auto &encDiagonal = encMatDiagonals[(d-l)%d];
+        encTransposedDiagonals[l] = (shift == 0) ? encDiagonal
+                                                  : evalRotate(cryptoContext, encDiagonal, shift, rotationPlan);
+    }
+    return encTransposedDiagonals;
+}
+
+std::vector<int64_t> rankingOffsets(const std::vector<int64_t> &permutation) {
+    int d = permutation.size();
+    std::vector<int64_t> offsets(d);
+    for (int i = 0; i < d; i++) { offsets[i] = 1 + ((permutation[i] - i) % d + d) % d; }
+    return offsets;
+}
+
+std::vector<std::vector<int64_t>> diagonalExpansionCoefficients(int d, int64_t plaintextModulus) {
+    // P(x) = x(x-1)...(x-d).
+    std::vector<int64_t> nodesPoly = {1};
+    for (int m = 0; m <= d; m++) {
+        std::vector<int64_t> next(nodesPoly.size()+1,0);
+        for (size_t j = 0; j < nodesPoly.size(); j++) {
+            next[j+1] = (next[j+1] + nodesPoly[j]) % plaintextModulus;
+            next[j] = (next[j] + nodesPoly[j] * (plaintextModulus-m)) % plaintextModulus;
+        }
+        nodesPoly = next;
+    }
+    // L(x) = P(x)/(x-node) / prod_{m != node} (node-m), synthetic division.
+    std::vector<std::vector<int64_t>> coeffs;
+    for (int node = 1; node <= d; node++) {
+        std::vector<int64_t> quotient(d+1,0);
+        int64_t carry = 0;
+        for (int j = d+1; j >= 1; j--) {
+            carry = (nodesPoly[j] + carry * node) % plaintextModulus;
+            quotient[j-1] = carry;
+        }
+        int64_t denominator = 1;
+        for (int m = 0; m <= d; m++) {
+            if (m != node) { denominator = denominator * ((node - m + plaintextModulus) % plaintextModulus) % plaintextModulus; }
+        }
+        int64_t scale = modInverse(denominator, plaintextModulus);
+        for (auto &coeff : quotient) { coeff = coeff * scale % plaintextModulus; }
+        coeffs.push_back(quotient);
+    }
+    return coeffs;
+}
+
+int diagonalExpansionDepth(int d) { return std::ceil(std::log2(d)) + 1; }
+
+std::vector<std::vector<Ciphertext<DCRTPoly>>> evalExpandDiagonals(std::vector<Ciphertext<DCRTPoly>> &encRankingOffsets,
+                                                                   int d, CryptoContext<DCRTPoly> &cryptoContext) {
+    CryptoOpsScope scope("evalExpandDiagonals", {{"level", encRankingOffsets[0]->GetLevel()}});
+    int users = encRankingOffsets.size();
+    auto coefficients = diagonalExpansionCoefficients(d, cryptoContext->GetCryptoParameters()->GetPlaintextModulus());
+
+    // Powers x^1..x^d per user, x^j = x^(2^floor(log2 j)) * x^(j - 2^floor(log2 j)), dropped to the level of x^d.
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encPowers(users, std::vector<Ciphertext<DCRTPoly>>(d+1));
+    #pragma omp parallel for
+    for (int user = 0; user < users; user++) {
+        auto &powers = encPowers[user];
+        powers[1] = encRankingOffsets[user];
+        for (int j = 2; j <= d; j++) {
+            int pow2 = 1 << int(std::floor(std::log2(j)));
+            powers[j] = (pow2 == j) ? evalMult(cryptoContext, powers[j/2], powers[j/2])
+                                    : evalMult(cryptoContext, powers[pow2],
+                                               evalLevelReduce(cryptoContext, powers[j-pow2], powers[pow2]->GetLevel()));
+            evalModReduceInPlace(cryptoContext, powers[j]);
+        }
+        for (int j = 1; j < d; j++) { powers[j] = evalLevelReduce(cryptoContext, powers[j], powers[d]->GetLevel()); }
+    }
+
+    // Diagonal l = sum over degrees of coefficient x power. Constant plaintexts (all slots): empty slots stay 0.
+    int slots = cryptoContext->GetRingDimension();
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encDiagonals(users, std::vector<Ciphertext<DCRTPoly>>(d));
+    #pragma omp parallel for
+    for (int l = 0; l < d; l++) {
+        for (int j = 1; j <= d; j++) {
+            if (coefficients[l][j] == 0) { continue; }
+            auto coefficient = cryptoContext->MakePackedPlaintext(std::vector<int64_t>(slots, coefficients[l][j]));
+            for (int user = 0; user < users; user++) {
+                auto term = evalMult(cryptoContext, encPowers[user][j], coefficient);
+                encDiagonals[user][l] = encDiagonals[user][l] ? evalAdd(cryptoContext, encDiagonals[user][l], term) : term;
+            }
+        }
+        for (int user = 0; user < users; user++) { evalModReduceInPlace(cryptoContext, encDiagonals[user][l]); }
+    }
+    return encDiagonals;
+}
+
+std::set<int32_t> rotIndicesDiagMatrixVecMult(int d, RotationMode mode, int babySteps) {
+    std::set<int32_t> rotIndices;
+    if (mode != RotationMode::BabyStepGiantStep) {
+        for (int l = 1; l < d; l++) { rotIndices.insert(l); }
+        return rotIndices;
+    }
+    for (int i = 1; i < babySteps; i++) { rotIndices.insert(i); }
+    for (int j = 1; babySteps*j < d; j++) { rotIndices.insert(babySteps*j); rotIndices.insert(-babySteps*j); }
+    return rotIndices;
+}
+
+Ciphertext<DCRTPoly> evalDiagMatrixVecMultBSGS(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonalsPreRotated,
+                                               Ciphertext<DCRTPoly> encVec,                        // Output of repFillSlots()
+                                               int babySteps,
+                                               CryptoContext<DCRTPoly> &cryptoContext,
+                                               const InitRotationPlan *rotationPlan) {
+    CryptoOpsScope scope("evalDiagMatrixVecMultBSGS", {{"level", encVec->GetLevel()}});
+    // sum_j rot( sum_i rot(diag_{g*j+i}, -g*j) * rot(vec, i), g*j ), with g baby steps.
+    int d = encMatDiagonalsPreRotated.size();
+    int giantSteps = std::ceil(double(d)/babySteps);
+    auto m = cryptoContext->GetCryptoParameters()->GetElementParams()->GetCyclotomicOrder();
+
+    // Baby steps: hoisted rotations of encVec.
+    auto encVecPrecomp = cryptoContext->EvalFastRotationPrecompute(encVec);
+    std::vector<Ciphertext<DCRTPoly>> encVecRots;
+    encVecRots.resize(babySteps);
+    #pragma omp parallel for
+    for (int i = 0; i < babySteps; i++) {
+        encVecRots[i] = (i == 0) ? encVec : evalFastRotate(cryptoContext, encVec, i, m, encVecPrecomp, rotationPlan);
+    }
+
+    // Giant steps: one rotation per inner sum.
+    std::vector<Ciphertext<DCRTPoly>> addContainer;
+    addContainer.resize(giantSteps);
+    #pragma omp parallel for
+    for (int j = 0; j < giantSteps; j++) {
+        std::vector<Ciphertext<DCRTPoly>> innerContainer;
+        for (int i = 0; i < babySteps && babySteps*j+i < d; i++) {
+            innerContainer.push_back(evalMultNoRelin(cryptoContext, encMatDiagonalsPreRotated[babySteps*j+i], encVecRots[i]));
+        }
+        // Relinearize once per giant step (rotation requires a degree-1 ciphertext).
+        auto inner = evalAddManyRelin(innerContainer, cryptoContext);
+        addContainer[j] = (j == 0) ? inner : evalRotate(cryptoContext, inner, babySteps*j, rotationPlan);
+    }
+
+    return evalAddMany(cryptoContext, addContainer);
+}
+
+Circuit::Node circuitDiagMatrixVecMult(Circuit &circuit, const std::vector<Circuit::Node> &matDiagonals,
+                                       Circuit::Node vec, RotationMode mode, int babySteps) {
+    int d = matDiagonals.size();
+    if (mode != RotationMode::BabyStepGiantStep) {
+        CircuitScope scope(circuit, (mode == RotationMode::Hoisted) ? "evalDiagMatrixVecMultHoisted"
+                                                                     : "evalDiagMatrixVecMult");
+        std::vector<Circuit::Node> addContainer;
+        for (int l = 0; l < d; l++) {
+            auto vecRot = (mode == RotationMode::Hoisted) ? circuit.fastRotate(vec, l) : circuit.rotate(vec, l);
+            addContainer.push_back(circuit.multNoRelin(matDiagonals[l], vecRot));
+        }
+        return circuit.relinearize(circuit.addMany(addContainer));
+    }
+    // As evalDiagMatrixVecMultBSGS: hoisted baby steps of vec, one rotation per giant step.
+    CircuitScope scope(circuit, "evalDiagMatrixVecMultBSGS");
+    int giantSteps = std::ceil(double(d)/babySteps);
+    std::vector<Circuit::Node> addContainer;
+    for (int j = 0; j < giantSteps; j++) {
+        std::vector<Circuit::Node> innerContainer;
+        for (int i = 0; i < babySteps && babySteps*j+i < d; i++) {
+            innerContainer.push_back(circuit.multNoRelin(matDiagonals[babySteps*j+i], circuit.fastRotate(vec, i)));
+        }
+        addContainer.push_back(circuit.rotate(circuit.relinearize(circuit.addMany(innerContainer)), babySteps*j));
+    }
+    return circuit.addMany(addContainer);
+}
+
+InitMatrixMult::InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                               const InitRotationPlan *rotationPlan, int d, bool plaintextMasks, int markets) :
+    d(d), plaintextMasks(plaintextMasks), markets(markets), rotationPlan(rotationPlan),
+    _u_sigma(2*d+1), _u_tau(d), _v1(d), _v2(d), _u_sigma_ptxt(2*d+1), _u_tau_ptxt(d), _v1_ptxt(d), _v2_ptxt(d) {
         auto maxSlots = cryptoContext->GetRingDimension();
         auto n = d*d;
+        // Masks are replicated in each market segment.
+        auto encodeMask = [&](std::vector<int64_t> &mask) {
+            return cryptoContext->MakePackedPlaintext(tileMarkets(std::vector<std::vector<int64_t>>(markets,mask),maxSlots));
+        };
+        // Masks in set-up order (the crypto cache records and replays them in this order): u_sigma_k
+        // (k = -d..d), u_tau_k (k = 0..d-1), v1_k and v2_k (k = 1..d-1). Encoded and encrypted in parallel.
+        std::vector<std::vector<int64_t>> masks;
         // STEP 1-1
-        std::vector<int> iterRange;
-        for (int k = -d; k <= d; k++){ iterRange.push_back(k); }
          // Pre-process encryption of u_sigma.
-        for (int k : iterRange) {
+        for (int k = -d; k <= d; k++) {
             std::vector<int64_t> u_sigma_k(n,0);
             if (k < 0) {
                 for (int l = 0; l < n; l++){
@@ -40,8 +267,7 @@ InitMatrixMult::InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<D
                     if (0<=(l-d*k) && (l-d*k) < (d-k)){ u_sigma_k[l] = 1; }
                 }
             }
-            _u_sigma[k] = cryptoContext->Encrypt(keyPair.publicKey,
-                                                 cryptoContext->MakePackedPlaintext(repFillSlots(u_sigma_k,maxSlots)));
+            masks.push_back(u_sigma_k);
         }
         // STEP 1-2
          // Pre-process encryption of u_tau.
@@ -50,8 +276,7 @@ InitMatrixMult::InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<D
             for (int i = 0; i < d; i++){
                 u_tau_k[k+d*i]=1;
             }
-            _u_tau[d*k] = cryptoContext->Encrypt(keyPair.publicKey,
-                                                 cryptoContext->MakePackedPlaintext(repFillSlots(u_tau_k,maxSlots)));
+            masks.push_back(u_tau_k);
         }
         // STEP 2
         for (int k = 1; k < d; k++) {
@@ -62,60 +287,109 @@ InitMatrixMult::InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<D
                 if (0 <= l % d && l % d < d-k) { v1_k[l] = 1; }
                 if (d-k <= l % d && l % d < d) { v2_k_d[l] = 1; }
             }
-            _v1[k] = cryptoContext->Encrypt(keyPair.publicKey,
-                                           cryptoContext->MakePackedPlaintext(repFillSlots(v1_k,maxSlots)));
-            _v2[k-d] = cryptoContext->Encrypt(keyPair.publicKey,
-                                             cryptoContext->MakePackedPlaintext(repFillSlots(v2_k_d,maxSlots)));
+            masks.push_back(v1_k);
+            masks.push_back(v2_k_d);
+        }
+        std::vector<Plaintext> masks_ptxt(masks.size());
+        #pragma omp parallel for
+        for (size_t i = 0; i < masks.size(); i++) {
+            masks_ptxt[i] = encodeMask(masks[i]);
+            if (plaintextMasks) { masks_ptxt[i]->SetFormat(EVALUATION); }
+        }
+        // Masks (plaintexts or ciphertexts) in set-up order.
+        auto assignMasks = [&](auto &u_sigma, auto &u_tau, auto &v1, auto &v2, auto &values) {
+            int i = 0;
+            for (int k = -d; k <= d; k++) { u_sigma[k+d] = values[i++]; }
+            for (int k = 0; k < d; k++) { u_tau[k] = values[i++]; }
+            for (int k = 1; k < d; k++) { v1[k] = values[i++]; v2[k] = values[i++]; }
+        };
+        if (plaintextMasks) { assignMasks(_u_sigma_ptxt, _u_tau_ptxt, _v1_ptxt, _v2_ptxt, masks_ptxt); }
+        else {
+            auto encMasks = cachedEncrypt(cryptoContext, keyPair.publicKey, masks_ptxt, "InitMatrixMult.masks");
+            assignMasks(_u_sigma, _u_tau, _v1, _v2, encMasks);
         }
         std::vector<int64_t> matrixMask(n,1);
-        _matrixMask = cryptoContext->Encrypt(keyPair.publicKey,
-                                             cryptoContext->MakePackedPlaintext(matrixMask));
+        auto matrixMask_ptxt = cryptoContext->MakePackedPlaintext(packMarkets(std::vector<std::vector<int64_t>>(markets,matrixMask),maxSlots));
+        if (plaintextMasks) { matrixMask_ptxt->SetFormat(EVALUATION); _matrixMask_ptxt = matrixMask_ptxt; }
+        else { _matrixMask = cachedEncrypt(cryptoContext, keyPair.publicKey, matrixMask_ptxt,
+                                                "InitMatrixMult.matrixMask"); }
     }
 
-    std::map<int, Ciphertext<DCRTPoly>> InitMatrixMult::u_sigma() { return _u_sigma; }
-    std::map<int, Ciphertext<DCRTPoly>> InitMatrixMult::u_tau() { return _u_tau; }
-    std::map<int, Ciphertext<DCRTPoly>> InitMatrixMult::v1() { return _v1; }
-    std::map<int, Ciphertext<DCRTPoly>> InitMatrixMult::v2() { return _v2; }
-    Ciphertext<DCRTPoly> InitMatrixMult::matrixMask() { return _matrixMask; }
+    const Ciphertext<DCRTPoly>& InitMatrixMult::u_sigma(int k) const { return _u_sigma[k+d]; }
+    const Ciphertext<DCRTPoly>& InitMatrixMult::u_tau(int k) const { return _u_tau[k]; }
+    const Ciphertext<DCRTPoly>& InitMatrixMult::v1(int k) const { return _v1[k]; }
+    const Ciphertext<DCRTPoly>& InitMatrixMult::v2(int k) const { return _v2[k]; }
+    const Ciphertext<DCRTPoly>& InitMatrixMult::matrixMask() const { return _matrixMask; }
+    const Plaintext& InitMatrixMult::u_sigma_ptxt(int k) const { return _u_sigma_ptxt[k+d]; }
+    const Plaintext& InitMatrixMult::u_tau_ptxt(int k) const { return _u_tau_ptxt[k]; }
+    const Plaintext& InitMatrixMult::v1_ptxt(int k) const { return _v1_ptxt[k]; }
+    const Plaintext& InitMatrixMult::v2_ptxt(int k) const { return _v2_ptxt[k]; }
+    const Plaintext& InitMatrixMult::matrixMask_ptxt() const { return _matrixMask_ptxt; }
+
+
+// Multiply by a precomputed mask: ct x pt in plaintext-mask mode, ct x ct otherwise.
+// Not relinearized (ct x ct): results are accumulated and relinearized once, see evalAddManyRelin().
+static Ciphertext<DCRTPoly> evalMultMask(CryptoContext<DCRTPoly> &cryptoContext,
+                                         const Ciphertext<DCRTPoly> &ciphertext,
+                                         const Ciphertext<DCRTPoly> &encMask,
+                                         const Plaintext &mask) {
+    if (mask) { return evalMult(cryptoContext, ciphertext, mask); }
+    return evalMultNoRelin(cryptoContext, ciphertext, encMask);
+}
 
 
+std::set<int32_t> rotIndicesMatrixMult(int d) {
+    std::set<int32_t> rotIndices;
+    for (int k = -d; k <= d; k++) { rotIndices.insert(k); }     // STEP 1-1
+    for (int k = 1; k < d; k++) {
+        rotIndices.insert(d*k);                                  // STEP 1-2, STEP 2
+        rotIndices.insert(k-d);                                  // STEP 2
+    }
+    rotIndices.erase(0);
+    return rotIndices;
+}
+
 Ciphertext<DCRTPoly> evalMatrixMult(CryptoContext<DCRTPoly> &cryptoContext,
                                     Ciphertext<DCRTPoly> encA,
                                     Ciphertext<DCRTPoly> encB,
                                     InitMatrixMult &initMatrixMult) {
+    CryptoOpsScope scope("evalMatrixMult", {{"level", encA->GetLevel()}});
         // Note: Encrypted matrix must be consistent with initMatrixMult dimension (d).
         auto d = initMatrixMult.d;
+        auto rotationPlan = initMatrixMult.rotationPlan;
         // STEP 1-1
         std::vector<int> iterRange;
         for (int k = -d; k <= d; k++){ iterRange.push_back(k); }
         std::vector<Ciphertext<DCRTPoly>> A_0_container;
         A_0_container.resize(iterRange.size());
-        int container_idx = 0;
         // #pragma omp parallel for
         for (int k : iterRange) {
             Ciphertext<DCRTPoly> A_rot;
             Ciphertext<DCRTPoly> A_rot_mult;
             if (k != 0) {
-                A_rot = cryptoContext->EvalRotate(encA,k);
+                A_rot = evalRotate(cryptoContext, encA, k, rotationPlan);
             }
             else {
                 A_rot = encA;
             }
-            A_rot_mult = cryptoContext->EvalMult(A_rot, initMatrixMult.u_sigma()[k]);
-            A_0_container[container_idx] = A_rot_mult;
-            container_idx++;
+            A_rot_mult = evalMultMask(cryptoContext, A_rot, initMatrixMult.u_sigma(k),
+                                      initMatrixMult.u_sigma_ptxt(k));
+            A_0_container[k+d] = A_rot_mult;
         }
-        auto A_0 = cryptoContext->EvalAddMany(A_0_container);
+        auto A_0 = evalAddManyRelin(A_0_container, cryptoContext);
         // STEP 1-2
         std::vector<Ciphertext<DCRTPoly>> B_0_container;
         B_0_container.resize(d);
         // #pragma omp parallel for
         for (int k = 0; k < d; k++) {
-            auto B_rot = cryptoContext->EvalRotate(encB,d*k);
-            auto B_rot_mult = cryptoContext->EvalMult(B_rot,initMatrixMult.u_tau()[d*k]);
+            auto B_rot = evalRotate(cryptoContext, encB, d*k, rotationPlan);
+            auto B_rot_mult = evalMultMask(cryptoContext, B_rot, initMatrixMult.u_tau(k),
+                                           initMatrixMult.u_tau_ptxt(k));
             B_0_container[k] = B_rot_mult;
         }
-        auto B_0 = cryptoContext->EvalAddMany(B_0_container);
+        auto B_0 = evalAddManyRelin(B_0_container, cryptoContext);
+        // B_0 at the level of the step 2 mask products: rotations and products on matching levels.
+        B_0 = evalLevelReduce(cryptoContext, B_0, A_0->GetLevel() + 1);
         // STEP 2
         // std::map<int, Ciphertext<DCRTPoly>> A;
         // std::map<int, Ciphertext<DCRTPoly>> B;
@@ -125,22 +399,23 @@ Ciphertext<DCRTPoly> evalMatrixMult(CryptoContext<DCRTPoly> &cryptoContext,
         B.resize(d);
         // #pragma omp parallel for
         for (int k = 1; k < d; k++) {
-            auto A_k = cryptoContext->EvalMult(initMatrixMult.v1()[k],
-                                               cryptoContext->EvalRotate(A_0,k));
-            auto A_k_d = cryptoContext->EvalMult(initMatrixMult.v2()[k-d],
-                                                 cryptoContext->EvalRotate(A_0,k-d));
-            A[k] = cryptoContext->EvalAdd(A_k,A_k_d);
-            B[k] = cryptoContext->EvalRotate(B_0,d*k);
+            auto A_k = evalMultMask(cryptoContext, evalRotate(cryptoContext, A_0, k, rotationPlan),
+                                       initMatrixMult.v1(k), initMatrixMult.v1_ptxt(k));
+            auto A_k_d = evalMultMask(cryptoContext, evalRotate(cryptoContext, A_0, k-d, rotationPlan),
+                                         initMatrixMult.v2(k), initMatrixMult.v2_ptxt(k));
+            A[k] = evalAdd(cryptoContext, A_k,A_k_d);
+            evalRelinearizeInPlace(A[k], cryptoContext);
+            B[k] = evalRotate(cryptoContext, B_0, d*k, rotationPlan);
         }
         // STEP 3
         std::vector<Ciphertext<DCRTPoly>> AB_container;
         AB_container.resize(d);
-        AB_container[0] =cryptoContext->EvalMult(A_0,B_0);
+        AB_container[0] =evalMultNoRelin(cryptoContext, evalLevelReduce(cryptoContext, A_0, B_0->GetLevel()),B_0);
         // #pragma omp parallel for
         for (int k = 1; k < d; k++) {
-            AB_container [k] = cryptoContext->EvalMult(A[k],B[k]);
+            AB_container [k] = evalMultNoRelin(cryptoContext, A[k],B[k]);
         }
-        auto AB =  cryptoContext->EvalAddMany(AB_container);
+        auto AB =  evalAddManyRelin(AB_container, cryptoContext);
         return AB;
     }
 
@@ -148,82 +423,142 @@ Ciphertext<DCRTPoly> evalMatrixMultParallel(CryptoContext<DCRTPoly> &cryptoConte
                                             Ciphertext<DCRTPoly> encA,
                                             Ciphertext<DCRTPoly> encB,
                                             InitMatrixMult &initMatrixMult) {
-        // Note: Encrypted matrix must be consistent with initMatrixMult dimension (d).
-        auto d = initMatrixMult.d;
-        // STEP 1-1
-        std::vector<int> iterRange;
-        for (int k = -d; k <= d; k++){ iterRange.push_back(k); }
+    CryptoOpsScope scope("evalMatrixMultParallel", {{"level", encA->GetLevel()}});
+    Circuit circuit(initMatrixMult.rotationPlan);
+    auto product = circuitMatrixMult(circuit, circuit.input(encA), circuit.input(encB), initMatrixMult);
+    return evalCircuit(cryptoContext, circuit, {product})[0];
+}
 
-        std::vector<Ciphertext<DCRTPoly>> A_0_container;
-        A_0_container.resize(2*d+1);
+Circuit::Node circuitMatrixMult(Circuit &circuit, Circuit::Node a, Circuit::Node b, InitMatrixMult &initMatrixMult) {
+    CircuitScope scope(circuit, "evalMatrixMult");
+    int d = initMatrixMult.d;
+    // Mask products as in evalMultMask(): ct x pt, or ct x ct without relinearization.
+    auto multMask = [&](Circuit::Node x, const Ciphertext<DCRTPoly> &encMask, const Plaintext &mask) {
+        return mask ? circuit.mult(x, circuitConstant(mask)) : circuit.multNoRelin(x, circuitConstant(encMask));
+    };
+    // STEP 1-1
+    std::vector<Circuit::Node> A_0_container;
+    for (int k = -d; k <= d; k++) {
+        A_0_container.push_back(multMask(circuit.rotate(a, k), initMatrixMult.u_sigma(k), initMatrixMult.u_sigma_ptxt(k)));
+    }
+    auto A_0 = circuit.relinearize(circuit.addMany(A_0_container));
+    // STEP 1-2
+    std::vector<Circuit::Node> B_0_container;
+    for (int k = 0; k < d; k++) {
+        B_0_container.push_back(multMask(circuit.rotate(b, d*k), initMatrixMult.u_tau(k), initMatrixMult.u_tau_ptxt(k)));
+    }
+    auto B_0 = circuit.relinearize(circuit.addMany(B_0_container));
+    // B_0 at the level of the step 2 mask products: rotations and products on matching levels.
+    B_0 = circuit.levelReduce(B_0, A_0, 1);
+    // STEP 2, STEP 3
+    std::vector<Circuit::Node> AB_container;
+    AB_container.push_back(circuit.multNoRelin(circuit.levelReduce(A_0, B_0), B_0));
+    for (int k = 1; k < d; k++) {
+        auto A_k = multMask(circuit.rotate(A_0, k), initMatrixMult.v1(k), initMatrixMult.v1_ptxt(k));
+        auto A_k_d = multMask(circuit.rotate(A_0, k-d), initMatrixMult.v2(k), initMatrixMult.v2_ptxt(k));
+        auto A = circuit.relinearize(circuit.add(A_k, A_k_d));
+        AB_container.push_back(circuit.multNoRelin(A, circuit.rotate(B_0, d*k)));
+    }
+    return circuit.relinearize(circuit.addMany(AB_container));
+}
 
-        int container_idx = 0;
-        #pragma omp parallel for
-        for (int k : iterRange) {
-            Ciphertext<DCRTPoly> A_rot;
-            Ciphertext<DCRTPoly> A_rot_mult;
-            if (k != 0) {
-                A_rot = cryptoContext->EvalRotate(encA,k);
-            }
-            else {
-                A_rot = encA;
-            }
-            A_rot_mult = cryptoContext->EvalMult(A_rot, initMatrixMult.u_sigma()[k]);
-            #pragma omp critical
-            {
-            A_0_container[container_idx] = A_rot_mult;
+
+int matrixMultMaxDim(CryptoContext<DCRTPoly> &cryptoContext, int markets) {
+    return std::floor(std::sqrt(marketSlots(cryptoContext->GetRingDimension(), markets)/2));
+}
+
+std::vector<std::vector<Ciphertext<DCRTPoly>>> encTiledMatrix(std::vector<std::vector<int64_t>> &matrix,
+                                                              int tile,
+                                                              CryptoContext<DCRTPoly> &cryptoContext,
+                                                              KeyPair<DCRTPoly> keyPair) {
+    int d = matrix.size();
+    int blocks = std::ceil(double(d)/tile);
+    auto maxSlots = cryptoContext->GetRingDimension();
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encBlocks(blocks, std::vector<Ciphertext<DCRTPoly>>(blocks));
+    #pragma omp parallel for
+    for (int block = 0; block < blocks*blocks; block++) {
+        int I = block / blocks; int J = block % blocks;
+        std::vector<int64_t> flatBlock(tile*tile,0);
+        for (int row = 0; row < tile && I*tile+row < d; row++) {
+            for (int col = 0; col < tile && J*tile+col < d; col++) {
+                flatBlock[row*tile+col] = matrix[I*tile+row][J*tile+col];
             }
-            container_idx++;
         }
-        auto A_0 = cryptoContext->EvalAddMany(A_0_container);
+        encBlocks[I][J] = evalEncrypt(cryptoContext, keyPair.publicKey,
+                                      cryptoContext->MakePackedPlaintext(repFillSlots(flatBlock,maxSlots)));
+    }
+    return encBlocks;
+}
 
-        // STEP 1-2
-        std::vector<Ciphertext<DCRTPoly>> B_0_container;
-        B_0_container.resize(d);
-        #pragma omp parallel for
-        for (int k = 0; k < d; k++) {
-            auto B_rot = cryptoContext->EvalRotate(encB,d*k);
-            auto B_rot_mult = cryptoContext->EvalMult(B_rot,initMatrixMult.u_tau()[d*k]);
-            #pragma omp critical
-            {
-            B_0_container[k] = B_rot_mult;
-            }
+std::vector<std::vector<Ciphertext<DCRTPoly>>> evalTiledMatrixMult(CryptoContext<DCRTPoly> &cryptoContext,
+                                                                   std::vector<std::vector<Ciphertext<DCRTPoly>>> &encA,
+                                                                   std::vector<std::vector<Ciphertext<DCRTPoly>>> &encB,
+                                                                   InitMatrixMult &initMatrixMult) {
+    CryptoOpsScope scope("evalTiledMatrixMult", {{"level", encA[0][0]->GetLevel()}});
+    int blocks = encA.size();
+    Circuit circuit(initMatrixMult.rotationPlan);
+    std::vector<std::vector<Circuit::Node>> a(blocks), b(blocks);
+    for (int I = 0; I < blocks; I++) {
+        for (int J = 0; J < blocks; J++) { a[I].push_back(circuit.input(encA[I][J])); b[I].push_back(circuit.input(encB[I][J])); }
+    }
+    auto c = circuitTiledMatrixMult(circuit, a, b, initMatrixMult);
+    std::vector<Circuit::Node> outputs;
+    for (auto &row : c) { outputs.insert(outputs.end(), row.begin(), row.end()); }
+    auto encOutputs = evalCircuit(cryptoContext, circuit, outputs);
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encC(blocks, std::vector<Ciphertext<DCRTPoly>>(blocks));
+    for (int block = 0; block < blocks*blocks; block++) { encC[block / blocks][block % blocks] = encOutputs[block]; }
+    return encC;
+}
+
+std::vector<std::vector<Circuit::Node>> circuitTiledMatrixMult(Circuit &circuit,
+                                                               const std::vector<std::vector<Circuit::Node>> &a,
+                                                               const std::vector<std::vector<Circuit::Node>> &b,
+                                                               InitMatrixMult &initMatrixMult) {
+    int blocks = a.size();
+    std::vector<std::vector<Circuit::Node>> c(blocks);
+    for (int I = 0; I < blocks; I++) {
+        for (int J = 0; J < blocks; J++) {
+            std::vector<Circuit::Node> blockProducts;
+            for (int K = 0; K < blocks; K++) { blockProducts.push_back(circuitMatrixMult(circuit, a[I][K], b[K][J], initMatrixMult)); }
+            c[I].push_back(circuit.addMany(blockProducts));
         }
-        auto B_0 = cryptoContext->EvalAddMany(B_0_container);
+    }
+    return c;
+}
 
-        // STEP 2
-        std::vector<Ciphertext<DCRTPoly>> A;
-        std::vector<Ciphertext<DCRTPoly>> B;
-        A.resize(d-1);
-        B.resize(d-1);
-        #pragma omp parallel for
-        for (int k = 1; k < d; k++) {
-            auto A_k = cryptoContext->EvalMult(initMatrixMult.v1()[k],
-                                               cryptoContext->EvalRotate(A_0,k));
-            auto A_k_d = cryptoContext->EvalMult(initMatrixMult.v2()[k-d],
-                                                 cryptoContext->EvalRotate(A_0,k-d));
-            auto A_tmp = cryptoContext->EvalAdd(A_k,A_k_d);
-            auto B_tmp = cryptoContext->EvalRotate(B_0,d*k);
-            #pragma omp critical
-            {
-            A[k-1] = A_tmp;
-            }
-            #pragma omp critical
-            {
-            B[k-1] = B_tmp;
-            }
+void evalCycleSumStep(CryptoContext<DCRTPoly> &cryptoContext,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encPower,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encSum,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encAdjMatrix,
+                      bool doubling, bool powerNeeded, InitMatrixMult &initMatrixMult) {
+    CryptoOpsScope scope("evalCycleSumStep", {{"level", encPower[0][0]->GetLevel()}});
+    int blocks = encPower.size();
+    Circuit circuit(initMatrixMult.rotationPlan);
+    std::vector<std::vector<Circuit::Node>> power(blocks), sum(blocks), adjMatrix(blocks);
+    for (int I = 0; I < blocks; I++) {
+        for (int J = 0; J < blocks; J++) {
+            power[I].push_back(circuit.input(encPower[I][J]));
+            sum[I].push_back(circuit.input(encSum[I][J]));
+            // A at the level of P (increments).
+            adjMatrix[I].push_back(circuit.levelReduce(circuit.input(encAdjMatrix[I][J]), power[I][J]));
         }
-        // STEP 3
-        std::vector<Ciphertext<DCRTPoly>> AB_container;
-        AB_container.resize(d);
-        AB_container[0] = cryptoContext->EvalMult(A_0,B_0);
-        #pragma omp parallel for
-        for (int k = 1; k < d; k++) {
-            auto res = cryptoContext->EvalMult(A[k-1],B[k-1]);
-            #pragma omp critical
-            {
-            AB_container[k] = res;
-            }
+    }
+    std::vector<std::vector<Circuit::Node>> product;
+    if (doubling) {
+        product = circuitTiledMatrixMult(circuit, power, sum, initMatrixMult);
+        if (powerNeeded) { power = circuitTiledMatrixMult(circuit, power, power, initMatrixMult); }
+    }
+    else { product = power = circuitTiledMatrixMult(circuit, power, adjMatrix, initMatrixMult); }
+    std::vector<Circuit::Node> outputs;
+    for (int I = 0; I < blocks; I++) {
+        for (int J = 0; J < blocks; J++) {
+            outputs.push_back(circuit.add(circuit.levelReduce(sum[I][J], product[I][J]), product[I][J]));
+            outputs.push_back(power[I][J]);
         }
-        return cryptoContext->EvalAddMany(AB_container);
     }
+    auto encOutputs = evalCircuit(cryptoContext, circuit, outputs);
+    for (int block = 0; block < blocks*blocks; block++) {
+        encSum[block / blocks][block % blocks] = encOutputs[2*block];
+        encPower[block / blocks][block % blocks] = encOutputs[2*block+1];
+    }
+}
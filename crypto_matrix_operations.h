@@ -6,43 +6,165 @@
 #include "crypto_utilities.h"
 #include "crypto_enc_transform.h"
 #include "crypto_prefix_mult.h"
+#include "crypto_rotation_plan.h"
+#include "crypto_circuit.h"
 #include <map>
 #include <omp.h>
 
 using namespace lbcrypto;
 
+// Rotation strategy for diagonal matrix-vector multiplication.
+// Standard: d independent rotations. Hoisted: one digit decomposition of the vector, shared by d rotations.
+// BabyStepGiantStep: hoisted baby-step rotations and ceil(d/babySteps) giant-step rotations (~2 sqrt(d) key switches),
+// on diagonals pre-rotated by preRotateDiagonals().
+enum class RotationMode { Standard, Hoisted, BabyStepGiantStep };
+
 Ciphertext<DCRTPoly> evalDiagMatrixVecMult(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals, // Must be filled.
                                            Ciphertext<DCRTPoly> encVec,                        // Must be filled.
-                                           CryptoContext<DCRTPoly> &cryptoContext);
+                                           CryptoContext<DCRTPoly> &cryptoContext,
+                                           const InitRotationPlan *rotationPlan);
+
+Ciphertext<DCRTPoly> evalDiagMatrixVecMultHoisted(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals, // Must be filled.
+                                                  Ciphertext<DCRTPoly> encVec,                        // Must be filled.
+                                                  CryptoContext<DCRTPoly> &cryptoContext,
+                                                  const InitRotationPlan *rotationPlan);
+
+// Baby-step count for BSGS diagonal matrix-vector multiplication: ceil(sqrt(d)).
+int bsgsBabySteps(int d);
+
+// Offline: rotates diagonal (g*j+i) by -g*j, for g baby steps. Input of evalDiagMatrixVecMultBSGS().
+std::vector<Ciphertext<DCRTPoly>> preRotateDiagonals(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals,
+                                                     int babySteps,
+                                                     CryptoContext<DCRTPoly> &cryptoContext,
+                                                     const InitRotationPlan *rotationPlan);
+
+// Offline: diagonals of the transpose from the diagonals of a d x d matrix, diag_l(A^T) = rot(diag_{(d-l)%d}(A), l).
+// Exact on the slots [0,d) of each segment read by the products above, for diagonals replicated with period d over
+// at least 2d slots. babySteps > 0: pre-rotated for BSGS, rot(diag_{(d-l)%d}(A), l mod babySteps) (baby steps only).
+std::vector<Ciphertext<DCRTPoly>> evalTransposeDiagonals(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonals,
+                                                         int babySteps,
+                                                         CryptoContext<DCRTPoly> &cryptoContext,
+                                                         const InitRotationPlan *rotationPlan);
+
+// Preference upload of a user. Diagonals: the d diagonals of the preference permutation matrix (d ciphertexts).
+// Ranking: one packed ciphertext of rankingOffsets(), expanded to the diagonals by the server (evalExpandDiagonals).
+enum class PreferenceUpload { Diagonals, Ranking };
+
+// Client: 1 + (permutation[i] - i) mod d for row i, i.e. 1 + the index of the diagonal holding its one. Encoded with
+// the layout of the diagonals (tileMarkets), 0 in the other slots.
+std::vector<int64_t> rankingOffsets(const std::vector<int64_t> &permutation);
+// Monomial coefficients (by degree 0..d, mod plaintextModulus) of the Lagrange basis polynomials over the nodes 0..d:
+// row l is 1 at x = l+1 and 0 at the other nodes, so it maps ranking offsets to diagonal l (0 in empty slots).
+std::vector<std::vector<int64_t>> diagonalExpansionCoefficients(int d, int64_t plaintextModulus);
+// Levels of the expanded diagonals: powers x^1..x^d (ceil(log2 d)) and coefficient products (1).
+int diagonalExpansionDepth(int d);
+// Server: diagonals [user][l] of d x d permutation matrices from the encrypted ranking offsets of all users, with the
+// layout of encrypted diagonals. d-1 ciphertext products per user (powers); the coefficient plaintexts are encoded
+// once per (l, degree) and shared by all users.
+std::vector<std::vector<Ciphertext<DCRTPoly>>> evalExpandDiagonals(std::vector<Ciphertext<DCRTPoly>> &encRankingOffsets,
+                                                                   int d, CryptoContext<DCRTPoly> &cryptoContext);
+
+// Rotation amounts used by evalDiagMatrixVecMult variants (BSGS includes the pre-rotation of diagonals).
+std::set<int32_t> rotIndicesDiagMatrixVecMult(int d, RotationMode mode = RotationMode::Standard, int babySteps = 0);
+
+Ciphertext<DCRTPoly> evalDiagMatrixVecMultBSGS(std::vector<Ciphertext<DCRTPoly>> &encMatDiagonalsPreRotated,
+                                               Ciphertext<DCRTPoly> encVec,                        // Must be filled.
+                                               int babySteps,
+                                               CryptoContext<DCRTPoly> &cryptoContext,
+                                               const InitRotationPlan *rotationPlan);
 
+// Circuit of the diagonal matrix-vector product of mode (diagonals pre-rotated for BSGS). The rotations of vec are
+// shared by all products on the same vector.
+Circuit::Node circuitDiagMatrixVecMult(Circuit &circuit, const std::vector<Circuit::Node> &matDiagonals,
+                                       Circuit::Node vec, RotationMode mode, int babySteps = 0);
 
-// Class initializes rotation keys and encrypted masks.
+
+// Class initializes masks; products rotate through rotationPlan.
+// Masks are public constants: with plaintextMasks, they are kept as encoded plaintexts (ct x pt products),
+// otherwise they are encrypted (ct x ct products with relinearization).
 class InitMatrixMult {
 public:
-    InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int d);
-    std::map<int, Ciphertext<DCRTPoly>> u_sigma();
-    std::map<int, Ciphertext<DCRTPoly>> u_tau();
-    std::map<int, Ciphertext<DCRTPoly>> v1();
-    std::map<int, Ciphertext<DCRTPoly>> v2();
-    Ciphertext<DCRTPoly> matrixMask();
+    InitMatrixMult(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                   const InitRotationPlan *rotationPlan, int d, bool plaintextMasks = false, int markets = 1);
+    // Masks by step index, O(1) const-reference lookup (null in the other mask mode):
+    // u_sigma(k), k in [-d,d] (rotation k); u_tau(k), k in [0,d) (rotation d*k); v1(k), v2(k), k in [1,d)
+    // (rotations k and k-d).
+    const Ciphertext<DCRTPoly>& u_sigma(int k) const;
+    const Ciphertext<DCRTPoly>& u_tau(int k) const;
+    const Ciphertext<DCRTPoly>& v1(int k) const;
+    const Ciphertext<DCRTPoly>& v2(int k) const;
+    const Ciphertext<DCRTPoly>& matrixMask() const;
+    const Plaintext& u_sigma_ptxt(int k) const;
+    const Plaintext& u_tau_ptxt(int k) const;
+    const Plaintext& v1_ptxt(int k) const;
+    const Plaintext& v2_ptxt(int k) const;
+    const Plaintext& matrixMask_ptxt() const;
     const int d;
+    const bool plaintextMasks;
+    const int markets;      // Masks replicated per market segment (tileMarkets).
+    const InitRotationPlan *const rotationPlan;
 private:
-    std::map<int, Ciphertext<DCRTPoly>> _u_sigma;
-    std::map<int, Ciphertext<DCRTPoly>> _u_tau;
-    std::map<int, Ciphertext<DCRTPoly>> _v1;
-    std::map<int, Ciphertext<DCRTPoly>> _v2;
+    std::vector<Ciphertext<DCRTPoly>> _u_sigma;     // Index k+d.
+    std::vector<Ciphertext<DCRTPoly>> _u_tau;
+    std::vector<Ciphertext<DCRTPoly>> _v1;
+    std::vector<Ciphertext<DCRTPoly>> _v2;
     Ciphertext<DCRTPoly> _matrixMask;
+    std::vector<Plaintext> _u_sigma_ptxt;           // Index k+d.
+    std::vector<Plaintext> _u_tau_ptxt;
+    std::vector<Plaintext> _v1_ptxt;
+    std::vector<Plaintext> _v2_ptxt;
+    Plaintext _matrixMask_ptxt;
 };
 
 
+// Rotation amounts used by evalMatrixMult / evalMatrixMultParallel.
+std::set<int32_t> rotIndicesMatrixMult(int d);
+
 Ciphertext<DCRTPoly> evalMatrixMult(CryptoContext<DCRTPoly> &cryptoContext,
                                     Ciphertext<DCRTPoly> encA,
                                     Ciphertext<DCRTPoly> encB,
                                     InitMatrixMult &initMatrixMult);
 
+// evalMatrixMult as a circuit (circuitMatrixMult) on all threads.
 Ciphertext<DCRTPoly> evalMatrixMultParallel(CryptoContext<DCRTPoly> &cryptoContext,
                                             Ciphertext<DCRTPoly> encA,
                                             Ciphertext<DCRTPoly> encB,
                                             InitMatrixMult &initMatrixMult);
 
+// Circuit of evalMatrixMult. Squarings (a == b) share the rotation by d of steps 1-1 and 1-2; products with the
+// same left (right) operand share its step 1-1 (1-2) rotations and masks.
+Circuit::Node circuitMatrixMult(Circuit &circuit, Circuit::Node a, Circuit::Node b, InitMatrixMult &initMatrixMult);
+
+
+// Tiled (block-partitioned) matrix multiplication, for d x d matrices beyond the slot capacity of evalMatrixMult.
+// Matrix: blocks x blocks grid of tile x tile flat packed ciphertexts (repFillSlots), zero padded to blocks*tile.
+// Largest tile: rotations of evalMatrixMult read from the second copy of the flat matrix, i.e. 2*tile^2 <= N/2
+// (2*tile^2 <= market segment with several markets).
+int matrixMultMaxDim(CryptoContext<DCRTPoly> &cryptoContext, int markets = 1);
+
+std::vector<std::vector<Ciphertext<DCRTPoly>>> encTiledMatrix(std::vector<std::vector<int64_t>> &matrix,
+                                                              int tile,
+                                                              CryptoContext<DCRTPoly> &cryptoContext,
+                                                              KeyPair<DCRTPoly> keyPair);
+
+// C_IJ = sum_K A_IK * B_KJ with circuitMatrixMult as block kernel (tile = initMatrixMult.d): one circuit of all block
+// products, so the rotations and masks of a block are evaluated once for all block products it enters.
+std::vector<std::vector<Ciphertext<DCRTPoly>>> evalTiledMatrixMult(CryptoContext<DCRTPoly> &cryptoContext,
+                                                                   std::vector<std::vector<Ciphertext<DCRTPoly>>> &encA,
+                                                                   std::vector<std::vector<Ciphertext<DCRTPoly>>> &encB,
+                                                                   InitMatrixMult &initMatrixMult);
+std::vector<std::vector<Circuit::Node>> circuitTiledMatrixMult(Circuit &circuit,
+                                                               const std::vector<std::vector<Circuit::Node>> &a,
+                                                               const std::vector<std::vector<Circuit::Node>> &b,
+                                                               InitMatrixMult &initMatrixMult);
+
+// Step of the cycle sums (cycleSumSteps()) on blocks x blocks grids (1 x 1: flat matrix), as one circuit.
+// Doubling: S <- S + P S, P <- P P (P S and P P share the rotations and masks of P); increment: P <- P A, S <- S + P.
+// P is left unchanged by a doubling without powerNeeded (no later step).
+void evalCycleSumStep(CryptoContext<DCRTPoly> &cryptoContext,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encPower,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encSum,
+                      std::vector<std::vector<Ciphertext<DCRTPoly>>> &encAdjMatrix,
+                      bool doubling, bool powerNeeded, InitMatrixMult &initMatrixMult);
+
 #endif
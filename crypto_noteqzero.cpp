@@ -1,50 +1,231 @@
 #include "crypto_noteqzero.h"
 
 
-InitNotEqualZero::InitNotEqualZero(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots, int range) :
-    slots(slots), range(range)
+// Paterson-Stockmeyer plan over coefficients [offset, offset + babySteps*2^level): whether the block is non-zero,
+// its ciphertext multiplications and depth. Mirrors evalPatersonStockmeyer().
+static bool planPatersonStockmeyer(std::vector<int64_t> &coeffs, int offset, int level, int babySteps,
+                                   int &mults, int &depth) {
+    int degree = coeffs.size();
+    if (level == 0) {
+        depth = 0; bool nonZero = false;
+        for (int j = 0; j < babySteps && offset+j < degree; j++) {
+            if (coeffs[offset+j] == 0) { continue; }
+            nonZero = true;
+            depth = std::max(depth, int(std::ceil(std::log2(std::max(j,1)))) + 1);
+        }
+        return nonZero;
+    }
+    int half = babySteps * (1 << (level-1));
+    int depthLo = 0; int depthHi = 0;
+    bool nonZeroLo = planPatersonStockmeyer(coeffs, offset, level-1, babySteps, mults, depthLo);
+    bool nonZeroHi = planPatersonStockmeyer(coeffs, offset+half, level-1, babySteps, mults, depthHi);
+    if (!nonZeroHi) { depth = depthLo; return nonZeroLo; }
+    mults++;
+    int depthGiant = std::ceil(std::log2(babySteps)) + level-1;
+    depth = std::max(std::max(depthHi, depthGiant) + 1, depthLo);
+    return true;
+}
+
+
+std::vector<int64_t> notEqualZeroCoefficients(int range, int64_t plaintextModulus) {
+    // Monomial coefficients of 1 + c(x-1)(x-2)...(x-range), c = -(-1)^range / range!.
+    int invFactorialRange = modInverse(modFactorial(range, plaintextModulus), plaintextModulus);
+    std::vector<int64_t> coeffs = {1};
+    for (int i = 1; i <= range; i++) {
+        std::vector<int64_t> next(coeffs.size()+1,0);
+        for (size_t j = 0; j < coeffs.size(); j++) {
+            next[j+1] = (next[j+1] + coeffs[j]) % plaintextModulus;
+            next[j] = (next[j] + coeffs[j] * (plaintextModulus-i)) % plaintextModulus;
+        }
+        coeffs = next;
+    }
+    int64_t c = (range % 2) ? invFactorialRange : plaintextModulus - invFactorialRange;
+    for (auto &coeff : coeffs) { coeff = (coeff * c) % plaintextModulus; }
+    coeffs[0] = (coeffs[0] + 1) % plaintextModulus;
+    return coeffs;
+}
+
+NotEqualZeroCost notEqualZeroCost(int range, int64_t plaintextModulus, NotEqualZeroMethod method) {
+    NotEqualZeroCost cost = {0, 0, 0};
+    if (method == NotEqualZeroMethod::Product) {
+        // Factors: range linear terms, 1/range! and -1 for even range.
+        int factors = range + 1 + (range % 2 == 0);
+        cost.multCount = factors - 1;
+        cost.depth = std::ceil(std::log2(factors));
+    }
+    else if (method == NotEqualZeroMethod::Fermat) {
+        int64_t exponent = plaintextModulus - 1;
+        int msb = std::floor(std::log2(exponent)); int bits = 0;
+        for (int64_t e = exponent; e > 0; e >>= 1) { bits += e & 1; }
+        cost.multCount = msb + bits - 1;
+        cost.depth = msb + std::ceil(std::log2(bits));
+    }
+    else {
+        auto coeffs = notEqualZeroCoefficients(range, plaintextModulus);
+        // Baby steps k = 2^a: fewest multiplications, then lowest depth.
+        cost.multCount = -1;
+        for (int k = 2; k/2 <= range; k *= 2) {
+            int level = 0;
+            while (k * (1 << level) <= range) { level++; }
+            int mults = (k-2) + (level > 0 ? level : 0); int depth = 0;
+            planPatersonStockmeyer(coeffs, 0, level, k, mults, depth);
+            if (cost.multCount < 0 || mults < cost.multCount || (mults == cost.multCount && depth < cost.depth)) {
+                cost.multCount = mults; cost.depth = depth; cost.babySteps = k;
+            }
+        }
+    }
+    return cost;
+}
+
+
+InitNotEqualZero::InitNotEqualZero(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots, int range,
+                                   int markets, NotEqualZeroMethod method, uint32_t levels) :
+    slots(slots), range(range), markets(markets), method(method)
 {
     // Precompute constants.
     auto plaintxtModulus = cryptoContext->GetCryptoParameters()->GetPlaintextModulus();
     int factorialRange = modFactorial(range, plaintxtModulus); 
     int invFactorialRange = modInverse(factorialRange, plaintxtModulus); 
 
-    // Packed encryption of constants.
+    // Packed encryption of constants, in each market segment.
     int slotsPadded = std::pow(2, std::ceil(std::log2(slots)));
-    std::vector<int64_t> invfPacked(slots*slotsPadded,invFactorialRange);
-    encInvFactorial_= cryptoContext->Encrypt(keyPair.publicKey,
-                                                cryptoContext->MakePackedPlaintext(invfPacked));
-    std::vector<int64_t> onePacked(slots*slotsPadded,1); 
-    encOne_ = cryptoContext->Encrypt(keyPair.publicKey,
-                                        cryptoContext->MakePackedPlaintext(onePacked));    
-    std::vector<int64_t> negOnePacked(slots*slotsPadded,plaintxtModulus-1); 
-    encNegOne_ = cryptoContext->Encrypt(keyPair.publicKey,
-                                        cryptoContext->MakePackedPlaintext(negOnePacked));  
+    int maxSlots = cryptoContext->GetRingDimension();
+    int packedSlots = std::min(slots*slotsPadded, marketSlots(maxSlots, markets));
+    auto encConstant = [&](int64_t value) {
+        std::vector<int64_t> constPacked(packedSlots,value);
+        return cachedEncrypt(cryptoContext, keyPair.publicKey,
+                             cryptoContext->MakePackedPlaintext(packMarkets(std::vector<std::vector<int64_t>>(markets,constPacked),maxSlots)),
+                             "InitNotEqualZero");
+    };
+    encInvFactorial_= encConstant(invFactorialRange);
+    encOne_ = encConstant(1);
+    encNegOne_ = encConstant(plaintxtModulus-1);
     for (int i=1 ; i <= range ; ++i){ 
-    std::vector<int64_t> negIntPacked(slots*slotsPadded,plaintxtModulus-i); 
-    encNegRange_.push_back(cryptoContext->Encrypt(keyPair.publicKey,
-                           cryptoContext->MakePackedPlaintext(negIntPacked)));
+    encNegRange_.push_back(encConstant(plaintxtModulus-i));
     };
+
+    auto cost = notEqualZeroCost(range, plaintxtModulus, method);
+    multCount_ = cost.multCount; depth_ = cost.depth; babySteps_ = cost.babySteps;
+    coefficients_.resize(std::max(levels, 1u));
+    if (method == NotEqualZeroMethod::PatersonStockmeyer) {
+        auto coeffs = notEqualZeroCoefficients(range, plaintxtModulus);
+        for (uint32_t level = 0; level < coefficients_.size(); level++) {
+            for (auto coeff : coeffs) {
+                if (coeff == 0) { coefficients_[level].push_back(nullptr); continue; }
+                std::vector<int64_t> coeffPacked(packedSlots,coeff);
+                coefficients_[level].push_back(cryptoContext->MakePackedPlaintext(
+                    packMarkets(std::vector<std::vector<int64_t>>(markets,coeffPacked),maxSlots), 1, level));
+            }
+        }
+    }
 }
 
 Ciphertext<DCRTPoly> InitNotEqualZero::encOne() { return encOne_; }
 Ciphertext<DCRTPoly> InitNotEqualZero::encNegOne() { return encNegOne_; }
 Ciphertext<DCRTPoly> InitNotEqualZero::encInvFactorial() { return encInvFactorial_; }
-std::vector<Ciphertext<DCRTPoly>> InitNotEqualZero::encNegRange() { return encNegRange_; }
+const std::vector<Ciphertext<DCRTPoly>>& InitNotEqualZero::encNegRange() const { return encNegRange_; }
+const std::vector<Plaintext>& InitNotEqualZero::coefficients(uint32_t level) const {
+    return coefficients_[std::min<size_t>(level, coefficients_.size()-1)];
+}
+int InitNotEqualZero::babySteps() const { return babySteps_; }
+int InitNotEqualZero::multCount() const { return multCount_; }
+int InitNotEqualZero::depth() const { return depth_; }
+
+
+// Sum of coefficients[offset+j] x^j over j < babySteps*2^level (nullptr if all coefficients are zero). Coefficient
+// plaintexts at the level of the ciphertext they multiply or are added to.
+static Ciphertext<DCRTPoly> evalPatersonStockmeyer(int offset, int level,
+                                                   std::vector<Ciphertext<DCRTPoly>> &babyPowers,
+                                                   std::vector<Ciphertext<DCRTPoly>> &giantPowers,
+                                                   CryptoContext<DCRTPoly> &cryptoContext,
+                                                   InitNotEqualZero &initNotEqualZero) {
+    auto coefficient = [&](int power, uint32_t ciphertextLevel) {
+        return initNotEqualZero.coefficients(ciphertextLevel)[power];
+    };
+    int degree = initNotEqualZero.coefficients().size();
+    int babySteps = babyPowers.size();
+    if (level == 0) {
+        std::vector<Ciphertext<DCRTPoly>> terms;
+        for (int j = 1; j < babySteps && offset+j < degree; j++) {
+            if (coefficient(offset+j, 0)) {
+                terms.push_back(evalMult(cryptoContext, babyPowers[j], coefficient(offset+j, babyPowers[j]->GetLevel())));
+            }
+        }
+        if (offset < degree && coefficient(offset, 0)) {
+            if (terms.empty()) {
+                auto constant = evalMult(cryptoContext, initNotEqualZero.encOne(),
+                                         coefficient(offset, initNotEqualZero.encOne()->GetLevel()));
+                evalModReduceInPlace(cryptoContext, constant);
+                return constant;
+            }
+        }
+        if (terms.empty()) { return nullptr; }
+        // Terms at the level of the highest power, rescaled once after the sum.
+        uint32_t termsLevel = 0;
+        for (auto &term : terms) { termsLevel = std::max(termsLevel, uint32_t(term->GetLevel())); }
+        for (auto &term : terms) { term = evalLevelReduce(cryptoContext, term, termsLevel); }
+        auto sum = evalAddMany(cryptoContext, terms);
+        evalModReduceInPlace(cryptoContext, sum);
+        return (offset < degree && coefficient(offset, 0)) ? evalAdd(cryptoContext, sum, coefficient(offset, sum->GetLevel()))
+                                                           : sum;
+    }
+    int half = babySteps * (1 << (level-1));
+    auto lo = evalPatersonStockmeyer(offset, level-1, babyPowers, giantPowers, cryptoContext, initNotEqualZero);
+    auto hi = evalPatersonStockmeyer(offset+half, level-1, babyPowers, giantPowers, cryptoContext, initNotEqualZero);
+    if (!hi) { return lo; }
+    uint32_t giantLevel = std::max(hi->GetLevel(), giantPowers[level-1]->GetLevel());
+    auto res = evalMult(cryptoContext, evalLevelReduce(cryptoContext, hi, giantLevel),
+                        evalLevelReduce(cryptoContext, giantPowers[level-1], giantLevel));
+    evalModReduceInPlace(cryptoContext, res);
+    return lo ? evalAdd(cryptoContext, res, evalLevelReduce(cryptoContext, lo, res->GetLevel())) : res;
+}
 
 
 Ciphertext<DCRTPoly> evalNotEqualZero(Ciphertext<DCRTPoly> &ciphertext,
                                   CryptoContext<DCRTPoly> &cryptoContext,
                                   InitNotEqualZero &initNotEqualZero) {
+    CryptoOpsScope scope("evalNotEqualZero", {{"level", ciphertext->GetLevel()}});
+    if (initNotEqualZero.method == NotEqualZeroMethod::Fermat) {
+        // x^(p-1) = 1 for x != 0 mod p.
+        int exponent = cryptoContext->GetCryptoParameters()->GetPlaintextModulus() - 1;
+        return evalExponentiate(ciphertext, exponent, cryptoContext);
+    }
+    if (initNotEqualZero.method == NotEqualZeroMethod::PatersonStockmeyer) {
+        int babySteps = initNotEqualZero.babySteps();
+        int degree = initNotEqualZero.coefficients().size() - 1;
+        // Baby steps x^0..x^(k-1) (x^0 unused), x^j = x^(2^floor(log2 j)) * x^(j - 2^floor(log2 j)).
+        std::vector<Ciphertext<DCRTPoly>> babyPowers(babySteps);
+        babyPowers[1] = ciphertext;
+        for (int j = 2; j < babySteps; j++) {
+            int pow2 = 1 << int(std::floor(std::log2(j)));
+            babyPowers[j] = (pow2 == j) ? evalMult(cryptoContext, babyPowers[j/2], babyPowers[j/2])
+                                        : evalMult(cryptoContext, babyPowers[pow2],
+                                                   evalLevelReduce(cryptoContext, babyPowers[j-pow2],
+                                                                   babyPowers[pow2]->GetLevel()));
+            evalModReduceInPlace(cryptoContext, babyPowers[j]);
+        }
+        // Giant steps x^(k*2^i).
+        int level = 0;
+        while (babySteps * (1 << level) <= degree) { level++; }
+        std::vector<Ciphertext<DCRTPoly>> giantPowers;
+        for (int i = 0; i < level; i++) {
+            if (i == 0) { giantPowers.push_back(evalMult(cryptoContext, babyPowers[babySteps/2], babyPowers[babySteps/2])); }
+            else { giantPowers.push_back(evalMult(cryptoContext, giantPowers[i-1], giantPowers[i-1])); }
+            evalModReduceInPlace(cryptoContext, giantPowers.back());
+        }
+        return evalPatersonStockmeyer(0, level, babyPowers, giantPowers, cryptoContext, initNotEqualZero);
+    }
     // If x is in range (0,r), outputs 1. 
     // 1-(x-1)(x-2)...(x-r)/r! 
+    // Constants reduced to the level of the ciphertext they are added to.
     std::vector<Ciphertext<DCRTPoly>> encDiffs;
     for (int i=0 ; i < initNotEqualZero.range ; ++i){ 
-        encDiffs.push_back(cryptoContext->EvalAdd(ciphertext, initNotEqualZero.encNegRange()[i]));
+        encDiffs.push_back(evalAdd(cryptoContext, ciphertext,
+                                   evalLevelReduce(cryptoContext, initNotEqualZero.encNegRange()[i], ciphertext->GetLevel())));
     }
     encDiffs.push_back(initNotEqualZero.encInvFactorial());
     if (initNotEqualZero.range % 2 - 1) { encDiffs.push_back(initNotEqualZero.encNegOne()); }
-    auto encMult = cryptoContext->EvalMultMany(encDiffs);
-    return cryptoContext->EvalAdd(initNotEqualZero.encOne(),encMult);
+    auto encMult = evalMultMany(cryptoContext, encDiffs);
+    return evalAdd(cryptoContext, evalLevelReduce(cryptoContext, initNotEqualZero.encOne(), encMult->GetLevel()), encMult);
 }
 
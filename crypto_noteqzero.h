@@ -3,26 +3,56 @@
 
 #include "openfhe.h"
 #include "utilities.h"
+#include "crypto_utilities.h"
 
 using namespace lbcrypto;
 
 
+// Evaluation of NotEqualZero(x) for x in [0,range]:
+// Product: 1 + c(x-1)(x-2)...(x-range), as EvalMultMany over range linear factors and constants.
+// PatersonStockmeyer: same polynomial in monomial form, baby steps x^1..x^k and giant steps x^(k*2^i),
+//   about 2*sqrt(range) ciphertext multiplications instead of range.
+// Fermat: x^(p-1), independent of range, depth log2(p-1) (small plaintext moduli only).
+enum class NotEqualZeroMethod { Product, PatersonStockmeyer, Fermat };
+
+// Ciphertext multiplications, multiplicative depth and Paterson-Stockmeyer baby steps of evalNotEqualZero,
+// without a crypto context (parameter planning).
+struct NotEqualZeroCost { int multCount; int depth; int babySteps; };
+NotEqualZeroCost notEqualZeroCost(int range, int64_t plaintextModulus, NotEqualZeroMethod method);
+// Monomial coefficients of 1 + c(x-1)(x-2)...(x-range) mod plaintextModulus, c = -(-1)^range / range!.
+std::vector<int64_t> notEqualZeroCoefficients(int range, int64_t plaintextModulus);
+
 class InitNotEqualZero {
 public:
-    InitNotEqualZero(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots, int range);
+    // levels: Paterson-Stockmeyer coefficients cached for ciphertext levels 0..levels-1.
+    InitNotEqualZero(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots, int range,
+                     int markets = 1, NotEqualZeroMethod method = NotEqualZeroMethod::Product, uint32_t levels = 1);
     Ciphertext<DCRTPoly> encOne();
     Ciphertext<DCRTPoly> encNegOne();
     Ciphertext<DCRTPoly> encInvFactorial();
-    std::vector<Ciphertext<DCRTPoly>> encNegRange();
+    const std::vector<Ciphertext<DCRTPoly>>& encNegRange() const;
+    // Paterson-Stockmeyer: coefficient plaintexts (by degree, nullptr if zero) encoded at the ciphertext level
+    // (capped at the highest cached level), and baby steps.
+    const std::vector<Plaintext>& coefficients(uint32_t level = 0) const;
+    int babySteps() const;
+    // Ciphertext multiplications and multiplicative depth of evalNotEqualZero (plaintext products included in depth).
+    int multCount() const;
+    int depth() const;
 
     const int slots;
     const int range;
+    const int markets;
+    const NotEqualZeroMethod method;
 
 private:
     Ciphertext<DCRTPoly> encOne_;
     Ciphertext<DCRTPoly> encNegOne_;
     Ciphertext<DCRTPoly> encInvFactorial_;
     std::vector<Ciphertext<DCRTPoly>> encNegRange_;
+    std::vector<std::vector<Plaintext>> coefficients_;
+    int babySteps_;
+    int multCount_;
+    int depth_;
 };
 
 
@@ -0,0 +1,100 @@
+#include "crypto_parameter_plan.h"
+
+
+ParameterPlan::ParameterPlan(int d, NotEqualZeroMethod notEqualZeroMethod, int depth, int64_t plaintextModulus) :
+    d(d), notEqualZeroMethod(notEqualZeroMethod), cycleRange_(d),
+    cycleFindingModes_({CycleFindingMode::MatrixSquaring, CycleFindingMode::FunctionalGraph}), fixedDepth_(depth),
+    preferenceLevels_(0)
+{
+    setPlaintextModulus(plaintextModulus);
+}
+
+int ParameterPlan::phaseDepth(std::string phase, CycleFindingMode mode) const {
+    int prefixDepth = std::ceil(std::log2(d));
+    if (phase == "phase1") { return preferenceLevels_ + 1 + (prefixDepth + 2) + 1 + 1; }
+    if (phase == "phase2a") { return (mode == CycleFindingMode::FunctionalGraph) ? 2 : 3; }
+    if (phase == "phase2b") { return (mode == CycleFindingMode::MatrixSquaring) + cycleNotEqualZeroCost_.depth; }
+    if (phase == "phase3") { return 3 + notEqualZeroCost_.depth + 1; }
+    throw std::invalid_argument("Unknown phase " + phase);
+}
+
+void ParameterPlan::setCycleFindingModes(CycleFindingMode mode, bool otherMode) {
+    cycleFindingModes_ = {mode};
+    if (otherMode) {
+        cycleFindingModes_.push_back((mode == CycleFindingMode::FunctionalGraph) ? CycleFindingMode::MatrixSquaring
+                                                                                 : CycleFindingMode::FunctionalGraph);
+    }
+}
+
+int ParameterPlan::requiredDepth() const {
+    int depth = 0;
+    for (auto mode : cycleFindingModes_) {
+        for (std::string phase : {"phase1", "phase2a", "phase2b", "phase3"}) {
+            depth = std::max(depth, phaseDepth(phase, mode));
+        }
+    }
+    return depth;
+}
+
+int ParameterPlan::depth() const { return fixedDepth_ > 0 ? fixedDepth_ : requiredDepth(); }
+int64_t ParameterPlan::plaintextModulus() const { return plaintextModulus_; }
+
+void ParameterPlan::setPlaintextModulus(int64_t plaintextModulus) {
+    plaintextModulus_ = plaintextModulus;
+    notEqualZeroCost_ = notEqualZeroCost(d, plaintextModulus, notEqualZeroMethod);
+    cycleNotEqualZeroCost_ = notEqualZeroCost(cycleRange_, plaintextModulus, notEqualZeroMethod);
+}
+
+void ParameterPlan::setPreferenceLevels(int levels) { preferenceLevels_ = levels; }
+
+void ParameterPlan::setMaxCycleLength(int maxCycleLength) {
+    cycleRange_ = (maxCycleLength > 0) ? maxCycleLength : d;
+    cycleNotEqualZeroCost_ = notEqualZeroCost(cycleRange_, plaintextModulus_, notEqualZeroMethod);
+}
+
+int ParameterPlan::cycleRange() const { return cycleRange_; }
+
+CCParams<CryptoContextBGVRNS> ParameterPlan::params() const {
+    CCParams<CryptoContextBGVRNS> params;
+    params.SetPlaintextModulus(plaintextModulus_);
+    params.SetMultiplicativeDepth(depth());
+    params.SetMaxRelinSkDeg(3);
+    params.SetSecurityLevel(lbcrypto::HEStd_128_classic);
+    // Explicit rescaling after every product, so that ciphertext levels (and LevelConstant copies) are exact.
+    params.SetScalingTechnique(FIXEDMANUAL);
+    return params;
+}
+
+int ParameterPlan::refreshInterval(CycleFindingMode mode) const {
+    return std::max(1, depth() / phaseDepth("phase2a", mode));
+}
+
+bool ParameterPlan::refreshAfterStep(CycleFindingMode mode, int step, int steps) const {
+    return step % refreshInterval(mode) == 0 && step < steps;
+}
+
+
+int64_t packingPrime(uint32_t ringDimension, int64_t lowerBound) {
+    int64_t m = 2 * int64_t(ringDimension);
+    for (int64_t p = (lowerBound / m + 1) * m + 1; ; p += m) {
+        bool prime = true;
+        for (int64_t f = 2; f * f <= p && prime; f++) { prime = (p % f != 0); }
+        if (prime) { return p; }
+    }
+}
+
+CryptoContext<DCRTPoly> genPlannedCryptoContext(ParameterPlan &plan) {
+    auto cc = GenCryptoContext(plan.params());
+    // A smaller (larger) p shrinks (grows) the modulus chain and may change N: at most a few rounds.
+    for (int round = 0; round < 4; round++) {
+        int64_t p = packingPrime(cc->GetRingDimension(), plan.d);
+        if (p == plan.plaintextModulus()) { return cc; }
+        plan.setPlaintextModulus(p);
+        cc = GenCryptoContext(plan.params());
+    }
+    if ((plan.plaintextModulus() - 1) % (2 * int64_t(cc->GetRingDimension())) != 0) {
+        throw std::runtime_error("No packing plaintext modulus for ring dimension "
+                                 + std::to_string(cc->GetRingDimension()));
+    }
+    return cc;
+}
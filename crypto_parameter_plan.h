@@ -0,0 +1,75 @@
+#ifndef CRYPTO_PARAMETER_PLAN_H
+#define CRYPTO_PARAMETER_PLAN_H
+
+#include "openfhe.h"
+#include "crypto_noteqzero.h"
+#include "crypto_functional_graph.h"
+
+using namespace lbcrypto;
+
+
+// BGV parameters of the TTC round loop for d parties, from a static walk of its depth consumption (levels above
+// fresh ciphertexts, one level per ciphertext or plaintext product):
+//   (1)  diagonal matrix-vector product 1 (after the level of the preference diagonals), evalPreserveLeadOne ceil(log2 d) + 2, row mask 1, transposed product 1.
+//   (2a) per step: functional graph 2 (ciphertext product, plaintext mask), matrix squaring 3 (two mask products,
+//        AB product). Refreshes are placed every floor(depth/step levels) steps.
+//   (2b) column sums (diagonal with a maximum cycle length) of the matrix power 1 (matrix squaring), NotEqualZero.
+//   (3)  t: inner product, leading one mask and product with u 3; NotEqualZero of the output; availability 1.
+// Each phase starts from refreshed ciphertexts: the multiplicative depth is the maximum over the phases, phases (2a)
+// and (2b) of the planned cycle finding engines only. Phase (1) also starts from the preference diagonals, above
+// fresh ciphertexts when expanded by the server.
+// Plaintext modulus: values of all phases lie in [0,d] (walk counts and column sums of a graph with at most one
+// out-edge per user, preference indices t), so p is the smallest prime p > d with p = 1 mod 2N (packing).
+class ParameterPlan {
+public:
+    // depth > 0: fixed multiplicative depth (refresh intervals follow it). plaintextModulus: first candidate,
+    // replaced by the packing prime of the ring dimension in genPlannedCryptoContext().
+    ParameterPlan(int d, NotEqualZeroMethod notEqualZeroMethod, int depth = 0, int64_t plaintextModulus = 65537);
+
+    // Levels consumed by phase "phase1", "phase2a" (one step of mode), "phase2b" or "phase3".
+    int phaseDepth(std::string phase, CycleFindingMode mode = CycleFindingMode::FunctionalGraph) const;
+    // Cycle finding engine of phases (2a) and (2b), and the other engine if it runs too (engine comparison).
+    // Default: both engines.
+    void setCycleFindingModes(CycleFindingMode mode, bool otherMode);
+    // Smallest depth supporting all phases, and the depth of the parameters (planned or fixed).
+    int requiredDepth() const;
+    int depth() const;
+    int64_t plaintextModulus() const;
+    // Replans the NotEqualZero depth for plaintextModulus.
+    void setPlaintextModulus(int64_t plaintextModulus);
+    // Level of the preference diagonals at the start of phase (1) (diagonalExpansionDepth() for ranking uploads).
+    void setPreferenceLevels(int levels);
+    // Cycles of at most maxCycleLength users (0: any length): phase (2b) NotEqualZero over [0,cycleRange()],
+    // cycleRange() = maxCycleLength (d for any length), see cycleSumSteps().
+    void setMaxCycleLength(int maxCycleLength);
+    int cycleRange() const;
+    CCParams<CryptoContextBGVRNS> params() const;
+
+    // Phase (2a) steps between refreshes.
+    int refreshInterval(CycleFindingMode mode) const;
+    // Refresh after step (1..steps) of phase (2a). Not after the last step: phase (2a) ends with a refresh.
+    bool refreshAfterStep(CycleFindingMode mode, int step, int steps) const;
+
+    const int d;
+    const NotEqualZeroMethod notEqualZeroMethod;
+
+private:
+    int64_t plaintextModulus_;
+    NotEqualZeroCost notEqualZeroCost_;
+    NotEqualZeroCost cycleNotEqualZeroCost_;
+    int cycleRange_;
+    std::vector<CycleFindingMode> cycleFindingModes_;
+    int fixedDepth_;
+    int preferenceLevels_;
+};
+
+
+// Smallest prime p > lowerBound with p = 1 mod 2*ringDimension.
+int64_t packingPrime(uint32_t ringDimension, int64_t lowerBound);
+
+// Crypto context of the plan. The ring dimension follows from the modulus chain, so the plan is regenerated
+// with packingPrime() of the ring dimension until the plaintext modulus is stable.
+CryptoContext<DCRTPoly> genPlannedCryptoContext(ParameterPlan &plan);
+
+
+#endif
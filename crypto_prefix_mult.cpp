@@ -1,83 +1,173 @@
 #include "crypto_prefix_mult.h"
 
 
-Ciphertext<DCRTPoly> evalPrefixMult(Ciphertext<DCRTPoly> &ciphertext,
-                                   int n, CryptoContext<DCRTPoly> &cryptoContext) {
-
+std::set<int32_t> rotIndicesPrefixMult(int n) {
+    std::set<int32_t> rotIndices;
     int depth = std::ceil(std::log2(n));
-    int slotsPadded = std::pow(2,depth);
-    std::vector<int32_t> rotSteps;
-    std::vector<Plaintext> leadingOnesPlaintxts;
+    for (int i = 0; i < depth; i++) { rotIndices.insert(-std::pow(2, i)); }
+    return rotIndices;
+}
+
+std::set<int32_t> rotIndicesPrefixAdd(int slots) {
+    std::set<int32_t> rotIndices;
+    int levels = std::ceil(std::log2(slots));
+    for (int i = 0; i < levels; i++) { rotIndices.insert(std::pow(2, i)); }
+    return rotIndices;
+}
+
+std::set<int32_t> rotIndicesPreserveLeadOne(int slots) {
+    auto rotIndices = rotIndicesPrefixMult(slots);
+    rotIndices.insert(-1);
+    return rotIndices;
+}
+
+
+InitPrefixScan::InitPrefixScan(CryptoContext<DCRTPoly> &cryptoContext, const InitRotationPlan *rotationPlan, int slots,
+                               bool segmentedAdd, uint32_t levels) :
+    slots(slots), slotsPadded(std::pow(2, std::ceil(std::log2(slots)))), segmentedAdd(segmentedAdd),
+    rotationPlan(rotationPlan)
+{
+    int depth = std::ceil(std::log2(slots));
+    for (int i = 0; i < depth; i++) { rotSteps_.push_back(std::pow(2, i)); }
+    // Patterns have period slotsPadded, over all slots (all market segments).
+    int maxSlots = cryptoContext->GetRingDimension();
+    std::vector<std::vector<int64_t>> prefixOnes(depth, std::vector<int64_t>(maxSlots,0));
+    std::vector<std::vector<int64_t>> segmentMasks(depth, std::vector<int64_t>(maxSlots,0));
     for (int i = 0; i < depth; i++) {
-        rotSteps.push_back(std::pow(2, i));
-        std::vector<int64_t> prefixOnes;
-        for (int copy=0;copy<slotsPadded*n;copy++){
-            for (int elem=0; elem<rotSteps.back(); elem++) { prefixOnes.push_back(1); }
-            for (int elem=0; elem<slotsPadded-rotSteps.back(); elem++) { prefixOnes.push_back(0); }
+        for (int slot = 0; slot < maxSlots; slot++) {
+            prefixOnes[i][slot] = (slot % slotsPadded < rotSteps_[i]);
+            segmentMasks[i][slot] = (slot % slotsPadded + rotSteps_[i] < slotsPadded);
         }
-        leadingOnesPlaintxts.push_back(cryptoContext->MakePackedPlaintext(prefixOnes));
     }
-    auto ciphertext1 = ciphertext;
-    for (int lvl = 0; lvl < depth; lvl++) {
-        auto ciphertext2 = cryptoContext->EvalRotate(ciphertext1, -rotSteps[lvl]);
-        ciphertext2 = cryptoContext->EvalAdd(ciphertext2, leadingOnesPlaintxts[lvl]);
-        ciphertext1 = cryptoContext->EvalMult(ciphertext1, ciphertext2);
-        cryptoContext->ModReduceInPlace(ciphertext1);
+    leadingOnes_.resize(std::max(levels, 1u));
+    segmentMasks_.resize(std::max(levels, 1u));
+    for (uint32_t level = 0; level < leadingOnes_.size(); level++) {
+        for (int i = 0; i < depth; i++) {
+            leadingOnes_[level].push_back(cryptoContext->MakePackedPlaintext(prefixOnes[i], 1, level));
+            if (segmentedAdd) {
+                segmentMasks_[level].push_back(cryptoContext->MakePackedPlaintext(segmentMasks[i], 1, level));
+            }
+        }
     }
-    return ciphertext1;
 }
 
+const std::vector<int32_t>& InitPrefixScan::rotSteps() const { return rotSteps_; }
+const std::vector<Plaintext>& InitPrefixScan::leadingOnes(uint32_t level) const {
+    return leadingOnes_[std::min<size_t>(level, leadingOnes_.size()-1)];
+}
+const std::vector<Plaintext>& InitPrefixScan::segmentMasks(uint32_t level) const {
+    return segmentMasks_[std::min<size_t>(level, segmentMasks_.size()-1)];
+}
 
-Ciphertext<DCRTPoly> evalPrefixAdd(Ciphertext<DCRTPoly> &ciphertext,
-                                   int slots, CryptoContext<DCRTPoly> &cryptoContext) {
 
-    int levels = std::ceil(std::log2(slots));
-    std::vector<int32_t> rotSteps;
-    for (int i = 0; i < levels; i++) {
-        rotSteps.push_back(std::pow(2, i));
+Ciphertext<DCRTPoly> evalPrefixMult(Ciphertext<DCRTPoly> &ciphertext,
+                                    InitPrefixScan &initPrefixScan,
+                                    CryptoContext<DCRTPoly> &cryptoContext) {
+    CryptoOpsScope scope("evalPrefixMult", {{"level", ciphertext->GetLevel()}});
+    auto &rotSteps = initPrefixScan.rotSteps();
+    auto ciphertext1 = ciphertext;
+    for (size_t lvl = 0; lvl < rotSteps.size(); lvl++) {
+        auto ciphertext2 = evalRotate(cryptoContext, ciphertext1, -rotSteps[lvl], initPrefixScan.rotationPlan);
+        ciphertext2 = evalAdd(cryptoContext, ciphertext2, initPrefixScan.leadingOnes(ciphertext2->GetLevel())[lvl]);
+        ciphertext1 = evalMult(cryptoContext, ciphertext1, ciphertext2);
+        evalModReduceInPlace(cryptoContext, ciphertext1);
     }
+    return ciphertext1;
+}
+
+Ciphertext<DCRTPoly> evalPrefixAdd(Ciphertext<DCRTPoly> &ciphertext,
+                                   InitPrefixScan &initPrefixScan,
+                                   CryptoContext<DCRTPoly> &cryptoContext) {
+    CryptoOpsScope scope("evalPrefixAdd", {{"level", ciphertext->GetLevel()}});
+    auto &rotSteps = initPrefixScan.rotSteps();
     auto ciphertext1 = ciphertext;
-    for (int i = 0; i < levels; i++) {
-        auto ciphertext2 = cryptoContext->EvalRotate(ciphertext1, rotSteps[i]);
-        ciphertext1 = cryptoContext->EvalAdd(ciphertext1, ciphertext2);
+    for (size_t i = 0; i < rotSteps.size(); i++) {
+        auto ciphertext2 = evalRotate(cryptoContext, ciphertext1, rotSteps[i], initPrefixScan.rotationPlan);
+        if (initPrefixScan.segmentedAdd) {
+            ciphertext2 = evalMult(cryptoContext, ciphertext2, initPrefixScan.segmentMasks(ciphertext2->GetLevel())[i]);
+            evalModReduceInPlace(cryptoContext, ciphertext2);
+        }
+        ciphertext1 = evalAdd(cryptoContext, ciphertext1, ciphertext2);
     }
     return ciphertext1;
 }
 
 
-InitPreserveLeadOne::InitPreserveLeadOne(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots) : slots(slots)
+InitPreserveLeadOne::InitPreserveLeadOne(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                                         const InitRotationPlan *rotationPlan, int slots, int markets, uint32_t levels,
+                                         int users, int userWidth) :
+    slots(slots), markets(markets), users(users), prefixScan_(cryptoContext, rotationPlan, slots, false, levels)
 {
-
-    cryptoContext->EvalRotateKeyGen(keyPair.secretKey, {-1});
     // Generate encryption of masks.
     std::vector<int64_t> ones(slots,1);
     std::vector<int64_t> negOnes(slots,cryptoContext->GetCryptoParameters()->GetPlaintextModulus()-1);
     std::vector<int64_t> leadingOne(slots,0); leadingOne[0]=1;
-    encOnes_ = cryptoContext->Encrypt(keyPair.publicKey,
-                                      cryptoContext->MakePackedPlaintext(ones));
-    encNegOnes_ = cryptoContext->Encrypt(keyPair.publicKey,
-                                         cryptoContext->MakePackedPlaintext(negOnes));
-    encLeadingOne_ = cryptoContext->Encrypt(keyPair.publicKey,
-                                            cryptoContext->MakePackedPlaintext(leadingOne));
+    // Masks at the start of each market segment (of each user segment).
+    auto maxSlots = cryptoContext->GetRingDimension();
+    auto encConstant = [&](std::vector<int64_t> &values) {
+        auto segment = (users > 1) ? packUsers(std::vector<std::vector<int64_t>>(users,values),userWidth) : values;
+        auto encValues = cachedEncrypt(cryptoContext, keyPair.publicKey,
+                                       cryptoContext->MakePackedPlaintext(packMarkets(std::vector<std::vector<int64_t>>(markets,segment),maxSlots)),
+                                       "InitPreserveLeadOne");
+        return LevelConstant(cryptoContext, encValues, std::max(levels, 1u));
+    };
+    encOnes_ = encConstant(ones);
+    encNegOnes_ = encConstant(negOnes);
+    encLeadingOne_ = encConstant(leadingOne);
 }
 
-Ciphertext<DCRTPoly> InitPreserveLeadOne::encOnes() { return encOnes_; }
-Ciphertext<DCRTPoly> InitPreserveLeadOne::encNegOnes() { return encNegOnes_; }
-Ciphertext<DCRTPoly> InitPreserveLeadOne::encLeadingOne() { return encLeadingOne_; }
+Ciphertext<DCRTPoly> InitPreserveLeadOne::encOnes(uint32_t level) { return encOnes_.at(level); }
+Ciphertext<DCRTPoly> InitPreserveLeadOne::encNegOnes(uint32_t level) { return encNegOnes_.at(level); }
+Ciphertext<DCRTPoly> InitPreserveLeadOne::encLeadingOne(uint32_t level) { return encLeadingOne_.at(level); }
+InitPrefixScan& InitPreserveLeadOne::prefixScan() { return prefixScan_; }
 
 
 Ciphertext<DCRTPoly> evalPreserveLeadOne(Ciphertext<DCRTPoly> &ciphertext,
                                          CryptoContext<DCRTPoly> &cryptoContext,
                                          InitPreserveLeadOne &initPreserveLeadOne) {
+    CryptoOpsScope scope("evalPreserveLeadOne", {{"level", ciphertext->GetLevel()}});
     // (1-x0),(1-x1),...,(1-xn).
-    auto encDiffs = cryptoContext->EvalAdd(cryptoContext->EvalMult(ciphertext,initPreserveLeadOne.encNegOnes()),
-                                           initPreserveLeadOne.encOnes());
+    auto encNegX = evalMult(cryptoContext, ciphertext, initPreserveLeadOne.encNegOnes(ciphertext->GetLevel()));
+    evalModReduceInPlace(cryptoContext, encNegX);
+    auto encDiffs = evalAdd(cryptoContext, encNegX, initPreserveLeadOne.encOnes(encNegX->GetLevel()));
     // y0, y1,..., yn: yi = ith multiplicative prefix.
-    auto encPrefix = evalPrefixMult(encDiffs,initPreserveLeadOne.slots,cryptoContext);
+    auto encPrefix = evalPrefixMult(encDiffs,initPreserveLeadOne.prefixScan(),cryptoContext);
     // x0, x1*y0 ,...,   xn*yn-1
-    auto result = cryptoContext->EvalMult(ciphertext,
-                                   cryptoContext->EvalAdd(initPreserveLeadOne.encLeadingOne(),
-                                                          cryptoContext->EvalRotate(encPrefix,-1)));
-    cryptoContext->ModReduceInPlace(result);
+    auto encPrefixShifted = evalRotate(cryptoContext, encPrefix, -1, initPreserveLeadOne.prefixScan().rotationPlan);
+    uint32_t level = encPrefixShifted->GetLevel();
+    auto result = evalMult(cryptoContext, evalLevelReduce(cryptoContext, ciphertext, level),
+                           evalAdd(cryptoContext, initPreserveLeadOne.encLeadingOne(level), encPrefixShifted));
+    evalModReduceInPlace(cryptoContext, result);
     return result;
-}
\ No newline at end of file
+}
+
+
+Circuit::Node circuitPrefixMult(Circuit &circuit, Circuit::Node x, InitPrefixScan &initPrefixScan) {
+    CircuitScope scope(circuit, "evalPrefixMult");
+    auto &rotSteps = initPrefixScan.rotSteps();
+    for (size_t lvl = 0; lvl < rotSteps.size(); lvl++) {
+        CircuitConstant leadingOnes{&initPrefixScan, int(lvl), nullptr,
+                                    [&initPrefixScan, lvl](uint32_t level) { return initPrefixScan.leadingOnes(level)[lvl]; }};
+        auto shifted = circuit.add(circuit.rotate(x, -rotSteps[lvl]), leadingOnes);
+        x = circuit.modReduce(circuit.mult(x, shifted));
+    }
+    return x;
+}
+
+Circuit::Node circuitPreserveLeadOne(Circuit &circuit, Circuit::Node x, InitPreserveLeadOne &initPreserveLeadOne) {
+    CircuitScope scope(circuit, "evalPreserveLeadOne");
+    // Level copies of the constants of initPreserveLeadOne (indices 0, 1, 2).
+    auto constant = [&](int index, Ciphertext<DCRTPoly> (InitPreserveLeadOne::*copy)(uint32_t)) {
+        return CircuitConstant{&initPreserveLeadOne, index,
+                               [&initPreserveLeadOne, copy](uint32_t level) { return (initPreserveLeadOne.*copy)(level); },
+                               nullptr};
+    };
+    auto negOnes = constant(0, &InitPreserveLeadOne::encNegOnes);
+    auto ones = constant(1, &InitPreserveLeadOne::encOnes);
+    auto leadingOne = constant(2, &InitPreserveLeadOne::encLeadingOne);
+    // (1-x0),(1-x1),...,(1-xn), prefix products, shifted by one slot.
+    auto diffs = circuit.add(circuit.modReduce(circuit.mult(x, negOnes)), ones);
+    auto prefixShifted = circuit.rotate(circuitPrefixMult(circuit, diffs, initPreserveLeadOne.prefixScan()), -1);
+    auto result = circuit.mult(circuit.levelReduce(x, prefixShifted), circuit.add(prefixShifted, leadingOne));
+    return circuit.modReduce(result);
+}
@@ -3,33 +3,76 @@
 
 #include "openfhe.h"
 #include "utilities.h"
+#include "crypto_utilities.h"
+#include "crypto_rotation_plan.h"
+#include "crypto_circuit.h"
 
 using namespace lbcrypto;
 
 
+// Rotation amounts used by evalPrefixMult, evalPrefixAdd and evalPreserveLeadOne.
+std::set<int32_t> rotIndicesPrefixMult(int n);
+std::set<int32_t> rotIndicesPrefixAdd(int slots);
+std::set<int32_t> rotIndicesPreserveLeadOne(int slots);
+
+
+// Precomputed prefix scan plan: rotation steps 2^i and encoded masks, per ciphertext level.
+// Scans run over segments of slotsPadded slots across the whole ciphertext, so packed rows and market
+// segments are scanned independently. The multiplicative scan is segmented by its leading-ones masks;
+// the additive scan only if segmentedAdd (one extra plaintext product per step), otherwise slot i also
+// accumulates slots of the following segments.
+class InitPrefixScan {
+public:
+    InitPrefixScan(CryptoContext<DCRTPoly> &cryptoContext, const InitRotationPlan *rotationPlan, int slots,
+                   bool segmentedAdd = false, uint32_t levels = 1);
+    const std::vector<int32_t>& rotSteps() const;
+    // Masks encoded at the ciphertext level (capped at the highest cached level).
+    const std::vector<Plaintext>& leadingOnes(uint32_t level) const;
+    const std::vector<Plaintext>& segmentMasks(uint32_t level) const;
+
+    const int slots;
+    const int slotsPadded;
+    const bool segmentedAdd;
+    const InitRotationPlan *const rotationPlan;
+
+private:
+    std::vector<int32_t> rotSteps_;
+    std::vector<std::vector<Plaintext>> leadingOnes_;
+    std::vector<std::vector<Plaintext>> segmentMasks_;
+};
+
+
 Ciphertext<DCRTPoly> evalPrefixMult(Ciphertext<DCRTPoly> &ciphertext,
-                                    int slots, 
+                                    InitPrefixScan &initPrefixScan,
                                     CryptoContext<DCRTPoly> &cryptoContext);
 
-
 Ciphertext<DCRTPoly> evalPrefixAdd(Ciphertext<DCRTPoly> &ciphertext,
-                                    int slots, 
-                                    CryptoContext<DCRTPoly> &cryptoContext);
+                                   InitPrefixScan &initPrefixScan,
+                                   CryptoContext<DCRTPoly> &cryptoContext);
 
 
 class InitPreserveLeadOne {
 public:
-    InitPreserveLeadOne(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots);
-    Ciphertext<DCRTPoly> encOnes();
-    Ciphertext<DCRTPoly> encNegOnes();
-    Ciphertext<DCRTPoly> encLeadingOne();
+    // users > 1: constants at the start of each of users segments of userWidth slots per market (packUsers()),
+    // userWidth a multiple of the scan segment. Rotations (rotIndicesPreserveLeadOne()) through rotationPlan.
+    InitPreserveLeadOne(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                        const InitRotationPlan *rotationPlan, int slots, int markets = 1, uint32_t levels = 1,
+                        int users = 1, int userWidth = 0);
+    // Constants at the ciphertext level (capped at the highest cached level).
+    Ciphertext<DCRTPoly> encOnes(uint32_t level = 0);
+    Ciphertext<DCRTPoly> encNegOnes(uint32_t level = 0);
+    Ciphertext<DCRTPoly> encLeadingOne(uint32_t level = 0);
+    InitPrefixScan& prefixScan();
 
     const int slots;
+    const int markets;
+    const int users;
 
 private:
-    Ciphertext<DCRTPoly> encOnes_;
-    Ciphertext<DCRTPoly> encNegOnes_;
-    Ciphertext<DCRTPoly> encLeadingOne_;
+    LevelConstant encOnes_;
+    LevelConstant encNegOnes_;
+    LevelConstant encLeadingOne_;
+    InitPrefixScan prefixScan_;
 };
 
 
@@ -37,5 +80,9 @@ Ciphertext<DCRTPoly> evalPreserveLeadOne(Ciphertext<DCRTPoly> &ciphertext,
                                          CryptoContext<DCRTPoly> &cryptoContext,
                                          InitPreserveLeadOne &initPreserveLeadOne);
 
+// Circuits of evalPrefixMult and evalPreserveLeadOne.
+Circuit::Node circuitPrefixMult(Circuit &circuit, Circuit::Node x, InitPrefixScan &initPrefixScan);
+Circuit::Node circuitPreserveLeadOne(Circuit &circuit, Circuit::Node x, InitPreserveLeadOne &initPreserveLeadOne);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "crypto_rotation_plan.h"
+#include "crypto_utilities.h"
+
+
+// Baby-step and giant-step rotations composing index: amounts that are multiples of stride are
+// decomposed in units of stride, all other amounts in units of 1.
+static std::vector<int32_t> bsgsSteps(int32_t index, int32_t stride, int32_t babySteps, int32_t babyStepsStride) {
+    int32_t sign = (index < 0) ? -1 : 1;
+    int32_t amount = std::abs(index);
+    int32_t unit = 1;
+    int32_t g = babySteps;
+    if (stride > 1 && amount >= stride && amount % stride == 0) { unit = stride; amount /= stride; g = babyStepsStride; }
+    std::vector<int32_t> steps;
+    int32_t baby = amount % g;
+    int32_t giant = amount - baby;
+    if (baby != 0) { steps.push_back(sign*baby*unit); }
+    if (giant != 0) { steps.push_back(sign*giant*unit); }
+    return steps;
+}
+
+
+InitRotationPlan::InitRotationPlan(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                                   std::set<int32_t> rotIndices, RotationKeyMode mode) :
+    mode(mode), keyTag_(keyPair.secretKey->GetKeyTag()), stride_(0), babySteps_(1), babyStepsStride_(1) {
+    rotIndices.erase(0);
+    if (mode == RotationKeyMode::Full) {
+        keyIndices_ = rotIndices;
+    }
+    else {
+        // Try each amount as stride (and no stride); keep the smallest key set.
+        std::set<int32_t> strides = {0};
+        for (int32_t index : rotIndices) { if (std::abs(index) > 1) { strides.insert(std::abs(index)); } }
+        for (int32_t stride : strides) {
+            int32_t maxAmount = 1; int32_t maxAmountStride = 1;
+            for (int32_t index : rotIndices) {
+                int32_t amount = std::abs(index);
+                if (stride > 1 && amount >= stride && amount % stride == 0) { maxAmountStride = std::max(maxAmountStride, amount/stride); }
+                else { maxAmount = std::max(maxAmount, amount); }
+            }
+            int32_t babySteps = std::ceil(std::sqrt(maxAmount));
+            int32_t babyStepsStride = std::ceil(std::sqrt(maxAmountStride));
+            std::set<int32_t> keyIndices;
+            for (int32_t index : rotIndices) {
+                for (int32_t step : bsgsSteps(index, stride, babySteps, babyStepsStride)) { keyIndices.insert(step); }
+            }
+            if (keyIndices_.empty() || keyIndices.size() < keyIndices_.size()) {
+                keyIndices_ = keyIndices; stride_ = stride; babySteps_ = babySteps; babyStepsStride_ = babyStepsStride;
+            }
+        }
+    }
+    // Keys of a replayed crypto cache are loaded with the context.
+    if (cryptoCache().generateKeys()) { cryptoContext->EvalRotateKeyGen(keyPair.secretKey, keyIndices()); }
+}
+
+std::vector<int32_t> InitRotationPlan::keyIndices() const {
+    return std::vector<int32_t>(keyIndices_.begin(), keyIndices_.end());
+}
+
+std::vector<int32_t> InitRotationPlan::decompose(int32_t index) const {
+    if (keyIndices_.count(index)) { return {index}; }
+    if (mode == RotationKeyMode::Full) { return {}; }
+    auto steps = bsgsSteps(index, stride_, babySteps_, babyStepsStride_);
+    for (int32_t step : steps) {
+        if (!keyIndices_.count(step)) { return {}; }
+    }
+    return steps;
+}
+
+double InitRotationPlan::keyMemoryMB(CryptoContext<DCRTPoly> &cryptoContext) const {
+    double bytes = 0.0;
+    for (auto &indexKey : cryptoContext->GetEvalAutomorphismKeyMap(keyTag_)) {
+        for (auto &poly : indexKey.second->GetAVector()) { bytes += double(poly.GetNumOfElements()) * poly.GetRingDimension() * sizeof(uint64_t); }
+        for (auto &poly : indexKey.second->GetBVector()) { bytes += double(poly.GetNumOfElements()) * poly.GetRingDimension() * sizeof(uint64_t); }
+    }
+    return bytes / (1024.0 * 1024.0);
+}
+
+
+Ciphertext<DCRTPoly> evalRotate(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext, int32_t index,
+                                const InitRotationPlan *rotationPlan) {
+    // Logged as one rotation, with one key switch per applied rotation key.
+    CryptoOpTimer timer(CryptoOp::Rotate);
+    if (index == 0 || rotationPlan == nullptr) {
+        if (index != 0) { cryptoOpsLogger().log(CryptoOp::KeySwitch, 0.0); }
+        return cryptoContext->EvalRotate(ciphertext, index);
+    }
+    auto steps = rotationPlan->decompose(index);
+    cryptoOpsLogger().log(CryptoOp::KeySwitch, 0.0, steps.empty() ? 1 : int(steps.size()));
+    if (steps.empty()) { return cryptoContext->EvalRotate(ciphertext, index); }
+    auto res = cryptoContext->EvalRotate(ciphertext, steps[0]);
+    for (size_t step = 1; step < steps.size(); step++) { res = cryptoContext->EvalRotate(res, steps[step]); }
+    return res;
+}
+
+Ciphertext<DCRTPoly> evalFastRotate(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext,
+                                    int32_t index, uint32_t m, std::shared_ptr<std::vector<DCRTPoly>> precomp,
+                                    const InitRotationPlan *rotationPlan) {
+    if (rotationPlan == nullptr || rotationPlan->decompose(index) == std::vector<int32_t>{index}) {
+        cryptoOpsLogger().log(CryptoOp::KeySwitch, 0.0);
+        CryptoOpTimer timer(CryptoOp::Rotate);
+        return cryptoContext->EvalFastRotation(ciphertext, index, m, precomp);
+    }
+    return evalRotate(cryptoContext, ciphertext, index, rotationPlan);
+}
+
+Ciphertext<DCRTPoly> evalRotateSum(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext,
+                                   int count, int32_t stride, const InitRotationPlan *rotationPlan) {
+    // res = sum_{k<width} rot(ciphertext, k*stride); width follows the bits of count from the msb.
+    int msb = 0;
+    while ((count >> (msb+1)) > 0) { msb++; }
+    auto res = ciphertext;
+    int width = 1;
+    for (int bit = msb-1; bit >= 0; bit--) {
+        res = evalAdd(cryptoContext, res, evalRotate(cryptoContext, res, width*stride, rotationPlan));
+        width *= 2;
+        if ((count >> bit) & 1) {
+            res = evalAdd(cryptoContext, ciphertext, evalRotate(cryptoContext, res, stride, rotationPlan));
+            width += 1;
+        }
+    }
+    return res;
+}
+
+std::set<int32_t> rotIndicesRotateSum(int count, int32_t stride) {
+    std::set<int32_t> rotIndices;
+    int msb = 0;
+    while ((count >> (msb+1)) > 0) { msb++; }
+    int width = 1;
+    for (int bit = msb-1; bit >= 0; bit--) {
+        rotIndices.insert(width*stride);
+        width *= 2;
+        if ((count >> bit) & 1) { rotIndices.insert(stride); width += 1; }
+    }
+    return rotIndices;
+}
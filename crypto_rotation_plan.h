@@ -0,0 +1,58 @@
+#ifndef CRYPTO_ROTATION_PLAN_H
+#define CRYPTO_ROTATION_PLAN_H
+
+#include "openfhe.h"
+#include <set>
+
+using namespace lbcrypto;
+
+
+// Rotation key set generated for a set of rotation amounts.
+// Full: one key per rotation amount, each rotation is a single key switch.
+// BabyStepGiantStep: each amount r = sign * (q*g + b) * unit is composed from a baby-step key (b < g) and a
+// giant-step key (q*g), i.e. ~2 sqrt(n) keys per unit and two key switches per rotation. Amounts that are
+// multiples of a large stride (e.g. d*k in evalMatrixMult) use the stride as unit.
+enum class RotationKeyMode { Full, BabyStepGiantStep };
+
+// Class generates the rotation keys of a plan. Kernels rotate through the plan passed to them (evalRotate()), held by
+// their Init* objects and circuits.
+class InitRotationPlan {
+public:
+    InitRotationPlan(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair,
+                     std::set<int32_t> rotIndices, RotationKeyMode mode);
+    std::vector<int32_t> keyIndices() const;
+    // Rotation steps (each with a generated key) composing a rotation by index. Empty if not composable.
+    std::vector<int32_t> decompose(int32_t index) const;
+    // Memory of all rotation (automorphism) keys of the key pair, in MB.
+    double keyMemoryMB(CryptoContext<DCRTPoly> &cryptoContext) const;
+
+    const RotationKeyMode mode;
+
+private:
+    std::string keyTag_;
+    std::set<int32_t> keyIndices_;
+    int32_t stride_;         // Unit of the large-amount baby/giant steps (0: single unit).
+    int32_t babySteps_;      // Baby steps for amounts in units of 1.
+    int32_t babyStepsStride_; // Baby steps for amounts in units of stride.
+};
+
+
+// Rotation through rotationPlan: direct key switch, or composition of planned rotations. Null plan: EvalRotate with
+// a key per rotation amount (e.g. the keys of InitRotsMasks).
+Ciphertext<DCRTPoly> evalRotate(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext, int32_t index,
+                                const InitRotationPlan *rotationPlan);
+
+// Hoisted rotation (EvalFastRotation) if the plan holds a key for index, evalRotate() otherwise.
+Ciphertext<DCRTPoly> evalFastRotate(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext,
+                                    int32_t index, uint32_t m, std::shared_ptr<std::vector<DCRTPoly>> precomp,
+                                    const InitRotationPlan *rotationPlan);
+
+
+// Sum of count rotations of ciphertext by multiples of stride: sum_{k<count} rot(ciphertext, k*stride).
+// Doubling over the bits of count: at most 2*log2(count) rotations.
+Ciphertext<DCRTPoly> evalRotateSum(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> ciphertext,
+                                   int count, int32_t stride, const InitRotationPlan *rotationPlan);
+std::set<int32_t> rotIndicesRotateSum(int count, int32_t stride);
+
+
+#endif
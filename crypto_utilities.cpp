@@ -40,25 +40,129 @@ InitRotsMasks::InitRotsMasks(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCR
     for (int i = 0; i <= slots; i++) { rotIndices.push_back(-i); rotIndices.push_back(i);}
     // Generate rotation keys for prefix addition/multiplication.
     for (int k = 0; k <= k_ceil; k++) { rotIndices.push_back(std::pow(2,k)); }
-    // Generate rotation keys for all rotation indices.
-    cryptoContext->EvalRotateKeyGen(keyPair.secretKey, rotIndices);
-    // Generate Eval Sum Key for EvalInnerProduct.
-    cryptoContext->EvalSumKeyGen(keyPair.secretKey);
+    // Generate rotation keys for all rotation indices, and Eval Sum Key for EvalInnerProduct (unless cached).
+    if (cryptoCache().generateKeys()) {
+        cryptoContext->EvalRotateKeyGen(keyPair.secretKey, rotIndices);
+        cryptoContext->EvalSumKeyGen(keyPair.secretKey);
+    }
     // Generate ciphertext masks for extraction of individual ciphertext slot values.
     for (int elem=0 ; elem < slots ; ++elem){ 
         std::vector<int64_t> mask(slots,0); mask[elem] = 1;
-        encMasks_.push_back(cryptoContext->Encrypt(keyPair.publicKey,
-                                                    cryptoContext->MakePackedPlaintext(mask)));
+        encMasks_.push_back(cachedEncrypt(cryptoContext, keyPair.publicKey,
+                                          cryptoContext->MakePackedPlaintext(mask), "InitRotsMasks"));
     }
 }
 
-std::vector<Ciphertext<DCRTPoly>> InitRotsMasks::encMasks() { return encMasks_; }
-std::vector<Ciphertext<DCRTPoly>> InitRotsMasks::encMasksFullyPacked() { return encMasksFullyPacked_; }
+const std::vector<Ciphertext<DCRTPoly>>& InitRotsMasks::encMasks() const { return encMasks_; }
+const std::vector<Ciphertext<DCRTPoly>>& InitRotsMasks::encMasksFullyPacked() const { return encMasksFullyPacked_; }
 Ciphertext<DCRTPoly> InitRotsMasks::encZeroes() { return encZeroes_; }
 
 
+Ciphertext<DCRTPoly> evalMult(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                              const Ciphertext<DCRTPoly> &ciphertext2) {
+    cryptoOpsLogger().log(CryptoOp::KeySwitch, 0.0);
+    CryptoOpTimer timer(CryptoOp::Mult);
+    return cryptoContext->EvalMult(ciphertext1, ciphertext2);
+}
+
+Ciphertext<DCRTPoly> evalMult(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                              const Plaintext &plaintext) {
+    CryptoOpTimer timer(CryptoOp::Mult);
+    return cryptoContext->EvalMult(ciphertext, plaintext);
+}
+
+Ciphertext<DCRTPoly> evalMultNoRelin(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                                     const Ciphertext<DCRTPoly> &ciphertext2) {
+    CryptoOpTimer timer(CryptoOp::Mult);
+    return cryptoContext->EvalMultNoRelin(ciphertext1, ciphertext2);
+}
+
+Ciphertext<DCRTPoly> evalMultMany(CryptoContext<DCRTPoly> &cryptoContext,
+                                  const std::vector<Ciphertext<DCRTPoly>> &ciphertexts) {
+    // Binary product tree, each product on matching levels and rescaled.
+    std::vector<Ciphertext<DCRTPoly>> factors = ciphertexts;
+    while (factors.size() > 1) {
+        std::vector<Ciphertext<DCRTPoly>> products;
+        for (size_t i = 0; i + 1 < factors.size(); i += 2) {
+            uint32_t level = std::max(factors[i]->GetLevel(), factors[i+1]->GetLevel());
+            products.push_back(evalMult(cryptoContext, evalLevelReduce(cryptoContext, factors[i], level),
+                                        evalLevelReduce(cryptoContext, factors[i+1], level)));
+            evalModReduceInPlace(cryptoContext, products.back());
+        }
+        if (factors.size() % 2) { products.push_back(factors.back()); }
+        factors = products;
+    }
+    return factors[0];
+}
+
+Ciphertext<DCRTPoly> evalAdd(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                             const Ciphertext<DCRTPoly> &ciphertext2) {
+    CryptoOpTimer timer(CryptoOp::Add);
+    return cryptoContext->EvalAdd(ciphertext1, ciphertext2);
+}
+
+Ciphertext<DCRTPoly> evalAdd(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                             const Plaintext &plaintext) {
+    CryptoOpTimer timer(CryptoOp::Add);
+    return cryptoContext->EvalAdd(ciphertext, plaintext);
+}
+
+Ciphertext<DCRTPoly> evalAddMany(CryptoContext<DCRTPoly> &cryptoContext,
+                                 const std::vector<Ciphertext<DCRTPoly>> &ciphertexts) {
+    // Reductions show up in the trace, between the kernels of parallel regions.
+    TraceSpan span("evalAddMany", {{"level", ciphertexts[0]->GetLevel()}, {"count", int64_t(ciphertexts.size())}});
+    CryptoOpTimer timer(CryptoOp::Add, ciphertexts.size()-1);
+    return cryptoContext->EvalAddMany(ciphertexts);
+}
+
+Ciphertext<DCRTPoly> evalInnerProduct(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                                      const Ciphertext<DCRTPoly> &ciphertext2, int slots) {
+    CryptoOpTimer timer(CryptoOp::InnerProd);
+    return cryptoContext->EvalInnerProduct(ciphertext1, ciphertext2, slots);
+}
+
+void evalModReduceInPlace(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> &ciphertext) {
+    CryptoOpTimer timer(CryptoOp::ModReduce);
+    cryptoContext->ModReduceInPlace(ciphertext);
+}
+
+Ciphertext<DCRTPoly> evalLevelReduce(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                                     uint32_t level) {
+    if (ciphertext->GetLevel() >= level) { return ciphertext; }
+    CryptoOpTimer timer(CryptoOp::ModReduce);
+    return cryptoContext->LevelReduce(ciphertext, nullptr, level - ciphertext->GetLevel());
+}
+
+Ciphertext<DCRTPoly> evalEncrypt(CryptoContext<DCRTPoly> &cryptoContext, const PublicKey<DCRTPoly> &publicKey,
+                                 const Plaintext &plaintext) {
+    CryptoOpTimer timer(CryptoOp::Encrypt);
+    return cryptoContext->Encrypt(publicKey, plaintext);
+}
+
+void evalDecrypt(CryptoContext<DCRTPoly> &cryptoContext, const PrivateKey<DCRTPoly> &secretKey,
+                 const Ciphertext<DCRTPoly> &ciphertext, Plaintext *plaintext) {
+    CryptoOpTimer timer(CryptoOp::Decrypt);
+    cryptoContext->Decrypt(secretKey, ciphertext, plaintext);
+}
+
+
+LevelConstant::LevelConstant(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> encConstant,
+                             uint32_t levels) {
+    copies_.push_back(encConstant);
+    for (uint32_t level = 1; level < levels; level++) {
+        copies_.push_back(evalLevelReduce(cryptoContext, copies_.back(), level));
+    }
+}
+
+Ciphertext<DCRTPoly> LevelConstant::at(uint32_t level) const {
+    return copies_[std::min<size_t>(level, copies_.size()-1)];
+}
+uint32_t LevelConstant::levels() const { return copies_.size(); }
+
+
 Ciphertext<DCRTPoly> evalExponentiate(Ciphertext<DCRTPoly> &ciphertext, int exponent, 
                                       CryptoContext<DCRTPoly> &cryptoContext) {
+    CryptoOpsScope scope("evalExponentiate", {{"level", ciphertext->GetLevel()}});
     // Get msb position of exponent.
     int numBits = sizeof(int) * 8;
     int msbPosition = -1;
@@ -72,8 +176,9 @@ Ciphertext<DCRTPoly> evalExponentiate(Ciphertext<DCRTPoly> &ciphertext, int expo
     std::vector<Ciphertext<DCRTPoly>> ciphertexts_squarings;
     ciphertexts_squarings.push_back(ciphertext);
     for (int i = 1; i < msbPosition; i++) {
-        ciphertexts_squarings.push_back(cryptoContext->EvalMult(ciphertexts_squarings[i-1], 
-                                                                ciphertexts_squarings[i-1]));
+        ciphertexts_squarings.push_back(evalMult(cryptoContext, ciphertexts_squarings[i-1],
+                                                 ciphertexts_squarings[i-1]));
+        evalModReduceInPlace(cryptoContext, ciphertexts_squarings.back());
     }
     // Select required squarings.
     std::vector<Ciphertext<DCRTPoly>> ciphertexts_squarings_container;
@@ -83,27 +188,76 @@ Ciphertext<DCRTPoly> evalExponentiate(Ciphertext<DCRTPoly> &ciphertext, int expo
         }
     }
     // Multiply selected squarings.
-    return cryptoContext->EvalMultMany(ciphertexts_squarings_container);
+    return evalMultMany(cryptoContext, ciphertexts_squarings_container);
+}
+
+void evalRelinearizeInPlace(Ciphertext<DCRTPoly> &ciphertext, CryptoContext<DCRTPoly> &cryptoContext) {
+    if (ciphertext->NumberCiphertextElements() > 2) {
+        // Completes the products of the sum: timed as multiplication, counted as key switch (count-only).
+        cryptoOpsLogger().log(CryptoOp::KeySwitch, 0.0);
+        CryptoOpTimer timer(CryptoOp::Mult, 0);
+        cryptoContext->RelinearizeInPlace(ciphertext);
+    }
+    evalModReduceInPlace(cryptoContext, ciphertext);
+}
+
+Ciphertext<DCRTPoly> evalAddManyRelin(std::vector<Ciphertext<DCRTPoly>> &ciphertexts,
+                                      CryptoContext<DCRTPoly> &cryptoContext) {
+    auto res = evalAddMany(cryptoContext, ciphertexts);
+    evalRelinearizeInPlace(res, cryptoContext);
+    return res;
 }
 
 void refreshInPlace(Ciphertext<DCRTPoly> &ciphertext, int slots, 
                     KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext){
+    CryptoOpsScope scope("refreshInPlace", {{"level", ciphertext->GetLevel()}});
     Plaintext plaintextExpRes;
-    cryptoContext->Decrypt(keyPair.secretKey, ciphertext, &plaintextExpRes); 
+    evalDecrypt(cryptoContext, keyPair.secretKey, ciphertext, &plaintextExpRes); 
     plaintextExpRes->SetLength(slots); auto payload = plaintextExpRes->GetPackedValue();
-    ciphertext = cryptoContext->Encrypt(keyPair.publicKey, cryptoContext->MakePackedPlaintext(payload));
+    ciphertext = evalEncrypt(cryptoContext, keyPair.publicKey, cryptoContext->MakePackedPlaintext(payload));
 }
 
 std::vector<Ciphertext<DCRTPoly>> refreshElems(Ciphertext<DCRTPoly> &ciphertext, int slots, 
                                                KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext){
+    CryptoOpsScope scope("refreshElems", {{"level", ciphertext->GetLevel()}});
     std::vector<Ciphertext<DCRTPoly>> ciphertexts; 
     Plaintext plaintext;
-    cryptoContext->Decrypt(keyPair.secretKey, ciphertext, &plaintext); 
+    evalDecrypt(cryptoContext, keyPair.secretKey, ciphertext, &plaintext); 
     plaintext->SetLength(slots); auto payload = plaintext->GetPackedValue();
     for (int i = 0; i < slots; i++) {
         std::vector<int64_t> elementPlaintext(slots,0);
         elementPlaintext[0] = payload[i];
-        ciphertexts.push_back(cryptoContext->Encrypt(keyPair.publicKey, cryptoContext->MakePackedPlaintext(elementPlaintext)));
+        ciphertexts.push_back(evalEncrypt(cryptoContext, keyPair.publicKey, cryptoContext->MakePackedPlaintext(elementPlaintext)));
     }
     return ciphertexts;
 }
+
+std::future<std::vector<int64_t>> decryptAsync(CryptoContext<DCRTPoly> &cryptoContext,
+                                               const PrivateKey<DCRTPoly> &privateKey,
+                                               Ciphertext<DCRTPoly> ciphertext, int slots, WorkerPool &pool){
+    return pool.submit("decrypt", [cryptoContext, privateKey, ciphertext, slots]() mutable {
+        Plaintext plaintext;
+        evalDecrypt(cryptoContext, privateKey, ciphertext, &plaintext);
+        plaintext->SetLength(slots);
+        return plaintext->GetPackedValue();
+    });
+}
+
+std::future<Ciphertext<DCRTPoly>> encryptAsync(CryptoContext<DCRTPoly> &cryptoContext,
+                                               const PublicKey<DCRTPoly> &publicKey,
+                                               Plaintext plaintext, WorkerPool &pool){
+    return pool.submit("encrypt", [cryptoContext, publicKey, plaintext]() mutable {
+        return evalEncrypt(cryptoContext, publicKey, plaintext);
+    });
+}
+
+void refreshInPlace(std::vector<Ciphertext<DCRTPoly>> &ciphertexts, int slots,
+                    KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext, WorkerPool &pool){
+    std::vector<std::future<void>> refreshed;
+    for (auto &ciphertext : ciphertexts) {
+        refreshed.push_back(pool.submit("refresh", [&ciphertext, slots, keyPair, cryptoContext]() mutable {
+            refreshInPlace(ciphertext, slots, keyPair, cryptoContext);
+        }));
+    }
+    for (auto &future : refreshed) { future.get(); }
+}
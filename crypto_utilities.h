@@ -2,6 +2,8 @@
 #define CRYPTO_UTILITIES_H
 
 #include "openfhe.h"
+#include "utilities.h"
+#include "crypto_cache.h"
 
 using namespace lbcrypto;
 
@@ -12,13 +14,15 @@ void printEncMatRows(std::vector<Ciphertext<DCRTPoly>> &encMatRows, CryptoContex
 void printEncMatElems(std::vector<std::vector<Ciphertext<DCRTPoly>>> &encMatElems, CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair);
 
 std::vector<std::vector<int64_t>> matrixDiagonals(std::vector<std::vector<int64_t>> matIn); 
+// Diagonal l of the permutation matrix with row i = e_{permutation[i]} (or of its transpose), without the matrix.
+std::vector<int64_t> permutationDiagonal(const std::vector<int64_t> &permutation, int l, bool transposed);
 
 // Class initializes rotation keys and encrypted masks.
 class InitRotsMasks {
 public:
     InitRotsMasks(CryptoContext<DCRTPoly> &cryptoContext, KeyPair<DCRTPoly> keyPair, int slots);
-    std::vector<Ciphertext<DCRTPoly>> encMasks();
-    std::vector<Ciphertext<DCRTPoly>> encMasksFullyPacked();
+    const std::vector<Ciphertext<DCRTPoly>>& encMasks() const;
+    const std::vector<Ciphertext<DCRTPoly>>& encMasksFullyPacked() const;
     Ciphertext<DCRTPoly> encZeroes();
 
     const int slots;
@@ -29,11 +33,65 @@ private:
 };
 
 
+// Crypto operations logged to cryptoOpsLogger(). Products of two ciphertexts also count their key switch
+// (relinearization); its time is included in Mult. Scaling is FIXEDMANUAL (ParameterPlan::params()): evalMult()
+// does not rescale, callers follow every product with evalModReduceInPlace() (sums of products: once, after the
+// sum). evalMultMany() rescales each product of its tree.
+Ciphertext<DCRTPoly> evalMult(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                              const Ciphertext<DCRTPoly> &ciphertext2);
+Ciphertext<DCRTPoly> evalMult(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                              const Plaintext &plaintext);
+Ciphertext<DCRTPoly> evalMultNoRelin(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                                     const Ciphertext<DCRTPoly> &ciphertext2);
+Ciphertext<DCRTPoly> evalMultMany(CryptoContext<DCRTPoly> &cryptoContext,
+                                  const std::vector<Ciphertext<DCRTPoly>> &ciphertexts);
+Ciphertext<DCRTPoly> evalAdd(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                             const Ciphertext<DCRTPoly> &ciphertext2);
+Ciphertext<DCRTPoly> evalAdd(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                             const Plaintext &plaintext);
+Ciphertext<DCRTPoly> evalAddMany(CryptoContext<DCRTPoly> &cryptoContext,
+                                 const std::vector<Ciphertext<DCRTPoly>> &ciphertexts);
+Ciphertext<DCRTPoly> evalInnerProduct(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext1,
+                                      const Ciphertext<DCRTPoly> &ciphertext2, int slots);
+void evalModReduceInPlace(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> &ciphertext);
+// Drops ciphertext to level (unchanged at or above level). Logged as ModReduce.
+Ciphertext<DCRTPoly> evalLevelReduce(CryptoContext<DCRTPoly> &cryptoContext, const Ciphertext<DCRTPoly> &ciphertext,
+                                     uint32_t level);
+Ciphertext<DCRTPoly> evalEncrypt(CryptoContext<DCRTPoly> &cryptoContext, const PublicKey<DCRTPoly> &publicKey,
+                                 const Plaintext &plaintext);
+void evalDecrypt(CryptoContext<DCRTPoly> &cryptoContext, const PrivateKey<DCRTPoly> &secretKey,
+                 const Ciphertext<DCRTPoly> &ciphertext, Plaintext *plaintext);
+
+
+// Level management: products are rescaled right after the multiplication, and both operands of a binary operation
+// are brought to the same level before it, so that OpenFHE does not adjust levels inside every operation and all
+// later operations of a round run on fewer RNS towers. Constants keep one copy per level (LevelReduce of the
+// level 0 encryption, no extra encryptions); operands used once are reduced with evalLevelReduce().
+class LevelConstant {
+public:
+    LevelConstant() {}
+    // Copies of a fresh (level 0) encryption at levels 0..levels-1.
+    LevelConstant(CryptoContext<DCRTPoly> &cryptoContext, Ciphertext<DCRTPoly> encConstant, uint32_t levels);
+    // Copy at level (capped at the highest copy).
+    Ciphertext<DCRTPoly> at(uint32_t level) const;
+    uint32_t levels() const;
+private:
+    std::vector<Ciphertext<DCRTPoly>> copies_;
+};
+
+
 // Ciphertext exponentiation, via square and multiply. Multiplicative depth: log(exponent)
 Ciphertext<DCRTPoly> evalExponentiate(Ciphertext<DCRTPoly> &ciphertext, int exponent, 
                                       CryptoContext<DCRTPoly> &cryptoContext);
 
 
+// Lazy relinearization: products accumulated via EvalMultNoRelin (degree-2 ciphertexts) are relinearized
+// and rescaled once per output, instead of one key switch per product.
+void evalRelinearizeInPlace(Ciphertext<DCRTPoly> &ciphertext, CryptoContext<DCRTPoly> &cryptoContext);
+Ciphertext<DCRTPoly> evalAddManyRelin(std::vector<Ciphertext<DCRTPoly>> &ciphertexts,
+                                      CryptoContext<DCRTPoly> &cryptoContext);
+
+
 // Decrypt and encrypt to reset ciphertext noise.
 void refreshInPlace(Ciphertext<DCRTPoly> &ciphertext, int slots, 
                     KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext);
@@ -42,6 +100,18 @@ void refreshInPlace(Ciphertext<DCRTPoly> &ciphertext, int slots,
 std::vector<Ciphertext<DCRTPoly>> refreshElems(Ciphertext<DCRTPoly> &ciphertext, int slots, 
                                                KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext);
 
+// Refresh stage on a worker pool: decryptions and encryptions run as tasks, in parallel with each other and with
+// the computation of the submitting thread.
+std::future<std::vector<int64_t>> decryptAsync(CryptoContext<DCRTPoly> &cryptoContext,
+                                               const PrivateKey<DCRTPoly> &privateKey,
+                                               Ciphertext<DCRTPoly> ciphertext, int slots, WorkerPool &pool);
+std::future<Ciphertext<DCRTPoly>> encryptAsync(CryptoContext<DCRTPoly> &cryptoContext,
+                                               const PublicKey<DCRTPoly> &publicKey,
+                                               Plaintext plaintext, WorkerPool &pool);
+// Refresh of a batch of ciphertexts, one task each; returns once all are refreshed.
+void refreshInPlace(std::vector<Ciphertext<DCRTPoly>> &ciphertexts, int slots,
+                    KeyPair<DCRTPoly> keyPair, CryptoContext<DCRTPoly> &cryptoContext, WorkerPool &pool);
+
 
 #endif
 
@@ -42,11 +42,16 @@
 #include "crypto_matrix_operations.h"
 #include "crypto_prefix_mult.h"
 #include "crypto_noteqzero.h"
+#include "crypto_functional_graph.h"
+#include "crypto_parameter_plan.h"
+#include "crypto_circuit.h"
+#include "benchmark_driver.h"
 
 #include <cassert>
 #include <iostream>
 #include <iterator>
 #include <cmath>
+#include <fstream>
 #include <vector>
 
 #include "openfhe.h"
@@ -56,116 +61,82 @@ using namespace lbcrypto;
 
 
 int main(int argc, char* argv[]) {
-    // omp_set_num_threads(30);
+    BenchmarkConfig config;
+    if (!parseBenchmarkArgs(argc, argv, config)) {
+        std::cerr << benchmarkUsage(argv[0]) << std::endl;
+        return 1;
+    }
+    if (config.threads > 0) { omp_set_num_threads(config.threads); }
+    config.threads = omp_get_max_threads();
+    cryptoOpsLogger().enabled = config.opsReport;
+    traceRecorder().enabled = !config.trace.empty();
     std::cout << "Thread count: " << omp_get_max_threads() << std::endl;
 
     ////////////////////////////////////////////////////////////
     // Client inputs.
     ////////////////////////////////////////////////////////////
 
-    // Uncomment chosen test vector.
-    // int numParties = 5;
-    // int numParties = 10;
-    // int numParties = 15;
-    int numParties = 20;
-    // int numParties = 25;
-
-    std::vector<std::vector<int64_t>> userInputs;
-    int chosen_depth(0);
-
-    if (numParties == 5) {
-        userInputs.push_back({4, 1, 2, 3, 0});
-        userInputs.push_back({4, 3, 2, 1, 0});
-        userInputs.push_back({4, 1, 0, 2, 3});
-        userInputs.push_back({1, 3, 4, 0, 2});
-        userInputs.push_back({3, 1, 2, 0, 4});
-        chosen_depth = 8;
-    }
-    else if (numParties == 10) {
-        userInputs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9});
-        userInputs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9});
-        userInputs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9});
-        userInputs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9});
-        userInputs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8});
-        userInputs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7});
-        userInputs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9});
-        chosen_depth = 9;
+    // Preference generator and party count from the command line (default: fixed test vector, 20 parties).
+    std::vector<std::vector<int64_t>> userInputs = generatePreferences(config.parties, config.generator, config.seed);
+    if (userInputs.empty()) {
+        std::cerr << "No preferences for generator " << config.generator << " with " << config.parties
+                  << " parties" << std::endl;
+        return 1;
     }
-    else if (numParties == 15) {
-        userInputs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14});
-        chosen_depth = 9;
-    }
-    else if (numParties == 20) {
-        userInputs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14, 15, 16, 17, 18, 19});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 17, 18, 15});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 18, 17, 16, 15});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 15, 17, 18});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, 18, 19, 15, 17});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 18, 16, 17, 15, 19});
-        chosen_depth = 10;
+    std::cout << "Parties: " << config.parties << ", preferences: " << config.generator
+              << " (seed " << config.seed << ")" << std::endl;
+
+    int n = config.parties;
+
+    // Multi-market mode (--markets): independent markets share the slots of each ciphertext (power of two), one pass
+    // of the round loop advances all markets. Market m: userInputs relabeled by user -> (user+m) mod n.
+    int markets = config.markets;
+    std::vector<std::vector<std::vector<int64_t>>> marketInputs;
+    for (int market = 0; market < markets; ++market) {
+        std::vector<std::vector<int64_t>> inputs(n);
+        for (int user = 0; user < n; ++user) {
+            for (int col = 0; col < n; ++col) { inputs[(user+market)%n].push_back((userInputs[user][col]+market)%n); }
+        }
+        marketInputs.push_back(inputs);
     }
-    else if (numParties == 25) {
-        userInputs.push_back({4, 1, 2, 3, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({4, 3, 2, 1, 0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({4, 1, 0, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({1, 3, 4, 0, 2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({3, 1, 2, 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 7, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 8, 7, 6, 5, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 9, 6, 5, 7, 8, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 6, 8, 9, 5, 7, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 8, 6, 7, 5, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 12, 13, 10, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 13, 12, 11, 10, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 14, 11, 10, 12, 13, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 14, 10, 12, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 13, 11, 12, 10, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 17, 18, 15, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 18, 17, 16, 15, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 19, 16, 15, 17, 18, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, 18, 19, 15, 17, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 18, 16, 17, 15, 19, 20, 21, 22, 23, 24});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 21, 22, 23, 20});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 23, 22, 21, 20});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 24, 21, 20, 22, 23});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 21, 23, 24, 20, 22});
-        userInputs.push_back({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 23, 21, 22, 20, 24});
-        chosen_depth = 10;
+    auto marketLabel = [&](int market) {
+        return (markets == 1) ? std::string("") : " (market " + std::to_string(market) + ")";
+    };
+    // Replicate a vector for all markets.
+    auto allMarkets = [&](std::vector<int64_t> vec) { return std::vector<std::vector<int64_t>>(markets, vec); };
+
+    // Set-up options (part of the crypto cache key).
+    // Rotation strategy of phase (1) matrix-vector products.
+    // BSGS requires diagonals pre-rotated by giant steps, computed once per user.
+    RotationMode phase1RotationMode = RotationMode::BabyStepGiantStep;
+    // Cycle finding engine of phase (2a) (--cycle-engine). Benchmark (--compare-engines) also runs the other engine on
+    // the same adjacency matrix.
+    CycleFindingMode cycleFindingMode = (config.cycleEngine == "matrix-squaring") ? CycleFindingMode::MatrixSquaring
+                                                                                  : CycleFindingMode::FunctionalGraph;
+    bool benchmarkCycleFinding = config.compareEngines;
+    // Rotation keys (--rotation-keys): Full (one key per rotation amount) or BabyStepGiantStep (composed rotations).
+    RotationKeyMode rotationKeyMode = (config.rotationKeys == "full") ? RotationKeyMode::Full
+                                                                     : RotationKeyMode::BabyStepGiantStep;
+    // NotEqualZero evaluator (--noteqzero): PatersonStockmeyer, Product or Fermat.
+    NotEqualZeroMethod notEqualZeroMethod = (config.notEqualZero == "product") ? NotEqualZeroMethod::Product
+                                            : (config.notEqualZero == "fermat") ? NotEqualZeroMethod::Fermat
+                                                                                : NotEqualZeroMethod::PatersonStockmeyer;
+    // Matrix multiplication masks are public: keep them as plaintexts (ct x pt), or set false to encrypt them.
+    bool plaintextMatrixMasks = true;
+    // Preference upload (--preference-upload): n diagonals per user, or one packed ranking per user expanded to the
+    // diagonals by the server (diagonalExpansionDepth(n) more levels in phase (1)).
+    PreferenceUpload preferenceUpload = (config.preferenceUpload == "ranking") ? PreferenceUpload::Ranking
+                                                                               : PreferenceUpload::Diagonals;
+    // Phase (1) layout (--phase1): all users in one ciphertext (segments of 2*slotsPadded slots, one set of rotations
+    // and scans for all users) if the n segments fit a market segment, otherwise one product chain per user.
+    bool packedPhase1 = (config.phase1 == "packed");
+    // Only cycles of at most maxCycleLength users are traded (--max-cycle-length, 0 or >= n: any length). Bounded
+    // lengths use matrix squaring on A + A^2 + ... + A^L (cycleSumSteps()), cycles are read off its diagonal.
+    int maxCycleLength = (config.maxCycleLength < n) ? config.maxCycleLength : 0;
+    if (maxCycleLength > 0) {
+        std::cout << "Cycles of at most " << maxCycleLength << " users: using matrix squaring." << std::endl;
+        cycleFindingMode = CycleFindingMode::MatrixSquaring; benchmarkCycleFinding = false;
     }
-    else { return 1; }
-
-    int n = numParties;
 
     TimeVar t;
     double runtimePhase(0.0);
@@ -174,19 +145,60 @@ int main(int argc, char* argv[]) {
     // Set-up of BGV parameters
     ////////////////////////////////////////////////////////////
 
-    // Crypto Parameters
-    // # of evalMults = 3 (first 3) is used to support the multiplication of 7
-    // ciphertexts, i.e., ceiling{log2{7}} Max depth is set to 3 (second 3) to
-    // generate homomorphic evaluation multiplication keys for s^2 and s^3
-    CCParams<CryptoContextBGVRNS> params1, params2a, params2b, params3;
+    // Multiplicative depth, plaintext modulus and phase (2a) refresh intervals planned from the depth consumption
+    // of the round loop (--depth fixes the depth).
+    ParameterPlan parameterPlan(n, notEqualZeroMethod, config.depth);
+    if (preferenceUpload == PreferenceUpload::Ranking) { parameterPlan.setPreferenceLevels(diagonalExpansionDepth(n)); }
+    parameterPlan.setMaxCycleLength(maxCycleLength);
+    parameterPlan.setCycleFindingModes(cycleFindingMode, benchmarkCycleFinding);
+    CryptoContext<DCRTPoly> cc = genPlannedCryptoContext(parameterPlan);
+    // Functional graph steps keep the flat n x n matrix within one slot row / market segment. Otherwise matrix
+    // squaring only, planned again: its depth per step is larger (the ring dimension does not shrink).
+    if (cycleFindingMode == CycleFindingMode::FunctionalGraph && n*n > marketSlots(cc->GetRingDimension(), markets)) {
+        std::cout << "Functional graph engine requires n^2 <= " << marketSlots(cc->GetRingDimension(), markets)
+                  << ": using matrix squaring." << std::endl;
+        cycleFindingMode = CycleFindingMode::MatrixSquaring; benchmarkCycleFinding = false;
+        parameterPlan.setCycleFindingModes(cycleFindingMode, benchmarkCycleFinding);
+        cc = genPlannedCryptoContext(parameterPlan);
+    }
+    int chosen_depth = parameterPlan.depth();
+    int chosen_ptxtmodulus = parameterPlan.plaintextModulus();
+    config.depth = chosen_depth;
+    std::cout << "Depth: " << chosen_depth << " (required " << parameterPlan.requiredDepth() << ": phase 1 "
+              << parameterPlan.phaseDepth("phase1") << ", phase 2b " << parameterPlan.phaseDepth("phase2b", cycleFindingMode)
+              << ", phase 3 " << parameterPlan.phaseDepth("phase3") << ")" << std::endl;
+    if (chosen_depth < parameterPlan.requiredDepth()) {
+        std::cout << "Warning: depth " << chosen_depth << " below required depth " << parameterPlan.requiredDepth()
+                  << std::endl;
+    }
 
-    int chosen_ptxtmodulus = 65537;
-    params1.SetPlaintextModulus(chosen_ptxtmodulus);
-    params1.SetMultiplicativeDepth(chosen_depth);
-    params1.SetMaxRelinSkDeg(3);
-    params1.SetSecurityLevel(lbcrypto::HEStd_128_classic);
+    // Crypto cache: context, keys and encrypted constants of the offline set-up, keyed by parameters and options.
+    CryptoCache &cache = cryptoCache();
+    if (!config.cache.empty()) {
+        std::string cacheKey = "bgvrns-p" + std::to_string(chosen_ptxtmodulus) + "-depth" + std::to_string(chosen_depth)
+                               + "-n" + std::to_string(n) + "-markets" + std::to_string(markets) + "-options";
+        // One delimited field per option, so that multi-digit values cannot collide.
+        for (int option : {int(phase1RotationMode), int(cycleFindingMode), int(benchmarkCycleFinding),
+                           int(rotationKeyMode), int(notEqualZeroMethod), int(plaintextMatrixMasks),
+                           int(preferenceUpload), int(packedPhase1)}) {
+            cacheKey += "_" + std::to_string(option);
+        }
+        cacheKey += "-L" + std::to_string(maxCycleLength);
+        cache.open(config.cache, cacheKey);
+        std::cout << "Crypto cache: " << cache.path()
+                  << (cache.mode() == CryptoCacheMode::Replay ? " (load)" : " (record)") << std::endl;
+    }
 
-    CryptoContext<DCRTPoly> cc = GenCryptoContext(params1);
+    // Single encryption/decryption key is generated for simplicity.
+    // BGV keys are additive; for fixed parameters (p, q, N), the number of decryption keys
+    // does not affect runtimes of ciphertext arithmetic or ciphertext size.
+    KeyPair<DCRTPoly> keyPair;
+    if (cache.mode() == CryptoCacheMode::Replay) {
+        TIC(t);
+        cache.load(cc, keyPair);
+        runtimePhase = TOC(t);
+        std::cout << "Crypto cache load time (context and keys): " << runtimePhase << "ms" << std::endl;
+    }
     cc->Enable(PKE);
     cc->Enable(KEYSWITCH);
     cc->Enable(LEVELEDSHE);
@@ -196,38 +208,37 @@ int main(int argc, char* argv[]) {
     std::cout << "Ciphertext slots: " << slotTotal << std::endl;
     std::cout << "Ring dimension N: " << cc->GetRingDimension() << std::endl;
     std::cout << "Plaintext modulus p = " << cc->GetCryptoParameters()->GetPlaintextModulus() << std::endl;
+    int segmentSlots = marketSlots(slotTotal, markets);
+    std::cout << "Markets: " << markets << " (" << segmentSlots << " slots each)" << std::endl;
 
     std::cout << "Cyclotomic order n = " << cc->GetCryptoParameters()->GetElementParams()->GetCyclotomicOrder()/2 << std::endl;
     std::cout << "log2 q = "
               << log2(cc->GetCryptoParameters()->GetElementParams()->GetModulus().ConvertToDouble())
               << std::endl;
 
-    // Single encryption/decryption key is generated for simplicity.
-    // BGV keys are additive; for fixed parameters (p, q, N), the number of decryption keys
-    // does not affect runtimes of ciphertext arithmetic or ciphertext size.
-    KeyPair<DCRTPoly> keyPair;
-
-    TIC(t);
-    keyPair = cc->KeyGen();
-    runtimePhase = TOC(t);
+    if (cache.generateKeys()) {
+        TIC(t);
+        keyPair = cc->KeyGen();
+        runtimePhase = TOC(t);
 
-    std::cout << "Key generation time: " << runtimePhase << "ms" << std::endl;
+        std::cout << "Key generation time: " << runtimePhase << "ms" << std::endl;
 
-    if (!keyPair.good()) {
-        std::cout << "Key generation failed!" << std::endl;
-        exit(1);
-    }
+        if (!keyPair.good()) {
+            std::cout << "Key generation failed!" << std::endl;
+            exit(1);
+        }
 
-    std::cout << "Running key generation for homomorphic multiplication "
-                 "evaluation keys..."
-              << std::endl;
+        std::cout << "Running key generation for homomorphic multiplication "
+                     "evaluation keys..."
+                  << std::endl;
 
-    TIC(t);
-    cc->EvalMultKeysGen(keyPair.secretKey);
-    runtimePhase = TOC(t);
+        TIC(t);
+        cc->EvalMultKeysGen(keyPair.secretKey);
+        runtimePhase = TOC(t);
 
-    std::cout << "Key generation time for homomorphic multiplication evaluation keys: " << runtimePhase << "ms"
-              << std::endl;
+        std::cout << "Key generation time for homomorphic multiplication evaluation keys: " << runtimePhase << "ms"
+                  << std::endl;
+    }
 
 
     ////////////////////////////////////////////////////////////
@@ -237,41 +248,146 @@ int main(int argc, char* argv[]) {
     // Offline: Init objects and encrypted constants.
     // -----------------------------------------------------------------------
 
+    // Phases: scopes of the crypto operations report and spans of the trace.
+    auto beginPhase = [&](std::string phase) { cryptoOpsLogger().pushScope(phase); traceRecorder().begin(phase); };
+    auto endPhase = [&]() { traceRecorder().end(); cryptoOpsLogger().popScope(); };
+    beginPhase("offline");
+
+    int phase1BabySteps = bsgsBabySteps(n);
+    int k_ceil = std::ceil(std::log2(n));
+    int slotsPadded = std::pow(2,k_ceil);
+    // Packed phase (1): user u in [u*W, (u+1)*W) of each market segment, W = 2*slotsPadded. Diagonals and availability
+    // are replicated twice (the products read slots [0,2n) of a segment), scans run on the first slotsPadded slots.
+    int phase1Width = 2*slotsPadded;
+    if (packedPhase1 && n*phase1Width > segmentSlots) {
+        std::cout << "Packed phase 1 requires n*" << phase1Width << " <= " << segmentSlots << ": per-user phase 1."
+                  << std::endl;
+        packedPhase1 = false;
+    }
+    // Layout actually run, for the benchmark report.
+    config.phase1 = packedPhase1 ? "packed" : "per-user";
+    // Engines actually run, for the benchmark report.
+    config.cycleEngine = (cycleFindingMode == CycleFindingMode::MatrixSquaring) ? "matrix-squaring" : "functional-graph";
+    config.compareEngines = benchmarkCycleFinding;
+    std::cout << "Cycle finding engine: " << cycleFindingEngineName(cycleFindingMode) << std::endl;
+    // Matrix squaring: tiled matrix multiplication once n exceeds the slot capacity of evalMatrixMult.
+    int matrixMultTile = matrixMultMaxDim(cc, markets);
+    bool tiledMatrixMult = n > matrixMultTile;
+    if (tiledMatrixMult && markets > 1) {
+        std::cout << "Multi-market mode requires 2n^2 <= " << segmentSlots << ": reduce markets." << std::endl;
+        return 1;
+    }
+    int matrixMultDim = tiledMatrixMult ? matrixMultTile : n;
+    CycleFindingMode otherCycleFindingMode = (cycleFindingMode == CycleFindingMode::FunctionalGraph)
+                                             ? CycleFindingMode::MatrixSquaring : CycleFindingMode::FunctionalGraph;
+    auto cycleFindingUses = [&](CycleFindingMode mode) {
+        return cycleFindingMode == mode || (benchmarkCycleFinding && otherCycleFindingMode == mode);
+    };
+
     TIC(t);
-    // Generate rotation keys.
-    std::vector<int32_t> rotIndices;
-    for (int i = 0; i <= n; i++) { rotIndices.push_back(-i); rotIndices.push_back(i); rotIndices.push_back(n*i); }
-    cc->EvalRotateKeyGen(keyPair.secretKey, rotIndices);
-    cc->EvalSumKeyGen(keyPair.secretKey);
+    std::set<int32_t> rotIndices = rotIndicesDiagMatrixVecMult(n, phase1RotationMode, phase1BabySteps);
+    for (auto indices : {rotIndicesPrefixMult(n), rotIndicesPreserveLeadOne(n), rotIndicesPrefixAdd(n)}) {
+        rotIndices.insert(indices.begin(), indices.end());
+    }
+    if (cycleFindingUses(CycleFindingMode::MatrixSquaring)) {
+        auto indices = rotIndicesMatrixMult(matrixMultDim); rotIndices.insert(indices.begin(), indices.end());
+        if (tiledMatrixMult) {
+            indices = rotIndicesRotateSum(matrixMultDim, matrixMultDim); rotIndices.insert(indices.begin(), indices.end());
+        }
+    }
+    if (cycleFindingUses(CycleFindingMode::FunctionalGraph)) {
+        auto indices = rotIndicesFunctionalGraph(n); rotIndices.insert(indices.begin(), indices.end());
+    }
+    rotIndices.insert(-n);                                        // Phase (1) row replication.
+    if (!packedPhase1) { rotIndices.insert(n); }
+    for (int user = 1; user < n; user++) { rotIndices.insert(-user); } // Phase (3) placement of t.
+    InitRotationPlan rotationPlan(cc, keyPair, rotIndices, rotationKeyMode);
+    if (cache.generateKeys()) { cc->EvalSumKeyGen(keyPair.secretKey); }
     runtimePhase = TOC(t);
     std::cout << "Rotation key generation: "
               << runtimePhase << " ms" << std::endl;
+    std::cout << "Rotation keys: " << rotationPlan.keyIndices().size()
+              << " for " << rotIndices.size() << " rotation amounts ("
+              << rotationPlan.keyMemoryMB(cc) << " MB)" << std::endl;
 
     TIC(t);
-    InitNotEqualZero initNotEqualZero(cc,keyPair,n,userInputs.size());
-    InitPreserveLeadOne initPreserveLeadOne(cc,keyPair,n);
-    InitMatrixMult initMatrixMult(cc,keyPair,n); // n in of nxn matrix.
+    // NotEqualZero evaluator; falls back to the product form if the chosen one exceeds the multiplicative depth.
+    // Coefficient plaintexts cached for every level up to the multiplicative depth.
+    auto makeNotEqualZero = [&](int range) {
+        InitNotEqualZero init(cc,keyPair,n,range,markets,notEqualZeroMethod,chosen_depth+1);
+        if (init.depth() <= int(chosen_depth)) { return init; }
+        std::cout << "NotEqualZero depth " << init.depth() << " exceeds " << chosen_depth
+                  << ", using product evaluation" << std::endl;
+        return InitNotEqualZero(cc,keyPair,n,range,markets,NotEqualZeroMethod::Product);
+    };
+    InitNotEqualZero initNotEqualZero = makeNotEqualZero(userInputs.size());
+    // Evaluator actually run (phase 3), for the benchmark report.
+    config.notEqualZero = (initNotEqualZero.method == NotEqualZeroMethod::Product) ? "product"
+                          : (initNotEqualZero.method == NotEqualZeroMethod::Fermat) ? "fermat" : "paterson-stockmeyer";
+    std::cout << "NotEqualZero: " << initNotEqualZero.multCount() << " ciphertext multiplications, depth "
+              << initNotEqualZero.depth() << std::endl;
+    // Phase (2b) inputs: column sums in [0,n], or diagonal entries in [0,L] of the bounded cycle sums.
+    InitNotEqualZero initCycleNotEqualZero = (parameterPlan.cycleRange() == n) ? initNotEqualZero
+                                             : makeNotEqualZero(parameterPlan.cycleRange());
+    // Prefix scan masks cached for every level up to the multiplicative depth.
+    InitPreserveLeadOne initPreserveLeadOne(cc,keyPair,&rotationPlan,n,markets,chosen_depth+1,packedPhase1 ? n : 1,
+                                            phase1Width);
+    InitPrefixScan initPrefixScan(cc,&rotationPlan,n,false,chosen_depth+1);
+    // n in of nxn matrix (or tile).
+    InitMatrixMult initMatrixMult(cc,keyPair,&rotationPlan,matrixMultDim,plaintextMatrixMasks,markets);
+    InitFunctionalGraph initFunctionalGraph(cc,keyPair,&rotationPlan,n,markets,chosen_depth+1);
 
     std::vector<int64_t> zeros(slotTotal,0);
     std::vector<int64_t> ones(slotTotal,1); std::vector<int64_t> negOnes(slotTotal,-1);
     std::vector<int64_t> leadingOne(n,0); leadingOne[0] = 1;
     std::vector<int64_t> onesRow(n,1);
     std::vector<int64_t> range; for (int i=0; i<n; ++i) { range.push_back(i+1); }
-    auto encZeros = cc->Encrypt(keyPair.publicKey,
-                                            cc->MakePackedPlaintext(zeros));
-    auto encOnes = cc->Encrypt(keyPair.publicKey,
-                                           cc->MakePackedPlaintext(ones));
-    auto encNegOnes = cc->Encrypt(keyPair.publicKey,
-                                              cc->MakePackedPlaintext(negOnes));
-    auto encLeadingOne = cc->Encrypt(keyPair.publicKey,
-                                                 cc->MakePackedPlaintext(leadingOne));
-    auto encRange = cc->Encrypt(keyPair.publicKey,
-                                            cc->MakePackedPlaintext(range));
-    auto encOnesRow = cc->Encrypt(keyPair.publicKey,
-                                              cc->MakePackedPlaintext(onesRow));
+    auto encZeros = cachedEncrypt(cc, keyPair.publicKey,
+                                            cc->MakePackedPlaintext(zeros), "zeros");
+    auto encOnes = cachedEncrypt(cc, keyPair.publicKey,
+                                           cc->MakePackedPlaintext(ones), "ones");
+    auto encNegOnes = cachedEncrypt(cc, keyPair.publicKey,
+                                              cc->MakePackedPlaintext(negOnes), "negOnes");
+    auto encLeadingOne = cachedEncrypt(cc, keyPair.publicKey,
+                                                 cc->MakePackedPlaintext(packMarkets(allMarkets(leadingOne),slotTotal)),
+                                                 "leadingOne");
+    auto encRange = cachedEncrypt(cc, keyPair.publicKey,
+                                            cc->MakePackedPlaintext(packMarkets(allMarkets(range),slotTotal)), "range");
+    auto encOnesRow = cachedEncrypt(cc, keyPair.publicKey,
+                                              cc->MakePackedPlaintext(packMarkets(allMarkets(onesRow),slotTotal)),
+                                              "onesRow");
+    // Bounded cycle lengths: diagonal masks of the column packed (phase (2b) layout) and tiled cycle sums.
+    Ciphertext<DCRTPoly> encDiagonalPacked, encDiagonalTile;
+    if (maxCycleLength > 0) {
+        std::vector<int64_t> diagonalPacked(slotsPadded*n,0);
+        std::vector<int64_t> diagonalTile(matrixMultDim*matrixMultDim,0);
+        for (int col = 0; col < n; col++) { diagonalPacked[col*slotsPadded + col] = 1; }
+        for (int col = 0; col < matrixMultDim; col++) { diagonalTile[col*matrixMultDim + col] = 1; }
+        encDiagonalPacked = cachedEncrypt(cc, keyPair.publicKey,
+                                          cc->MakePackedPlaintext(packMarkets(allMarkets(diagonalPacked),slotTotal)),
+                                          "diagonalPacked");
+        encDiagonalTile = cachedEncrypt(cc, keyPair.publicKey,
+                                        cc->MakePackedPlaintext(repFillSlots(diagonalTile,slotTotal)), "diagonalTile");
+    }
+    // Level-matched copies of the constants of phases (1) and (3).
+    LevelConstant levelOnes(cc, encOnes, chosen_depth+1);
+    LevelConstant levelNegOnes(cc, encNegOnes, chosen_depth+1);
+    LevelConstant levelLeadingOne(cc, encLeadingOne, chosen_depth+1);
+    // Phase (1) row mask: first n slots of each market (user) segment.
+    auto encPhase1Mask = !packedPhase1 ? encOnesRow : cachedEncrypt(cc, keyPair.publicKey,
+        cc->MakePackedPlaintext(packMarkets(allMarkets(packUsers(std::vector<std::vector<int64_t>>(n,onesRow),
+                                                                 phase1Width)),slotTotal)), "phase1Mask");
+    LevelConstant levelPhase1Mask(cc, encPhase1Mask, chosen_depth+1);
     runtimePhase = TOC(t);
     std::cout << "Encryption of constants: "
               << runtimePhase << " ms" << std::endl;
+    cache.finishReplay();
+    if (cache.mode() == CryptoCacheMode::Record) {
+        TIC(t);
+        cache.save(cc, keyPair);
+        runtimePhase = TOC(t);
+        std::cout << "Crypto cache save time: " << runtimePhase << " ms" << std::endl;
+    }
 
 
     // Online: Encryption of user preferences.
@@ -279,278 +395,691 @@ int main(int argc, char* argv[]) {
     // Represent user preferences as permutation matrices and their transpose.
     // Encrypt diagonals of permutation matrices.
 
-    std::vector<std::vector<std::vector<int64_t>>> userPrefList;
-    std::vector<std::vector<std::vector<int64_t>>> userPrefTransposedList;
-
-    int k_ceil = std::ceil(std::log2(n));
-    int slotsPadded = std::pow(2,k_ceil);
+    // Phase (1) layout of per-market vectors: tiled within each market segment, or (packed phase (1)) replicated twice
+    // in the segment of user, or of every user for user < 0.
+    auto phase1Layout = [&](std::vector<std::vector<int64_t>> marketVecs, int user) {
+        if (!packedPhase1) { return tileMarkets(marketVecs,slotTotal); }
+        for (auto &vec : marketVecs) {
+            auto copies = vec; copies.insert(copies.end(), vec.begin(), vec.end());
+            std::vector<std::vector<int64_t>> userVecs(n);
+            for (int u = 0; u < n; u++) { if (user < 0 || u == user) { userVecs[u] = copies; } }
+            vec = packUsers(userVecs, phase1Width);
+        }
+        return packMarkets(marketVecs,slotTotal);
+    };
 
-    for (int user=0; user < n; ++user) {
-        // Build user preference-permutation matrix.
-        std::vector<std::vector<int64_t>> userPrefMatrix;
-        for (int col=0; col < n; ++col) {
-            std::vector<int64_t> row(n,0); row[userInputs[user][col]] = 1;
-            userPrefMatrix.push_back(row);
+    TIC(t);
+    std::vector<std::vector<Ciphertext<DCRTPoly>>> encUsersPrefMatrixDiagonals(n, std::vector<Ciphertext<DCRTPoly>>(n));
+    if (preferenceUpload == PreferenceUpload::Ranking) {
+        // One packed ciphertext per user (ranking offsets of each market), expanded to the diagonals by the server.
+        std::vector<Ciphertext<DCRTPoly>> encRankingOffsets(n);
+        #pragma omp parallel for
+        for (int user=0; user<n ; ++user){
+            std::vector<std::vector<int64_t>> offsets;
+            for (auto &inputs : marketInputs){ offsets.push_back(rankingOffsets(inputs[user])); }
+            encRankingOffsets[user] = evalEncrypt(cc, keyPair.publicKey,
+                                                 cc->MakePackedPlaintext(phase1Layout(offsets,user)));
         }
-        userPrefList.push_back(userPrefMatrix);
-        // Transpose user preference-permutation matrix.
-        std::vector<std::vector<int64_t>> userPrefMatrixTransposed;
-        std::vector<int64_t> zeroRow(n,0);
-        for (int row=0; row < n; ++row) { userPrefMatrixTransposed.push_back(zeroRow); }
-        for (int row=0; row < n; ++row) {
-            for (int col=0; col < n; ++col) {
-                userPrefMatrixTransposed[col][row] = userPrefMatrix[row][col];
+        runtimePhase = TOC(t);
+        std::cout << "Encryption of preference rankings: " << runtimePhase << " ms" << std::endl;
+        TIC(t);
+        // Packed phase (1): uploads (each in the segment of its user) summed into one ciphertext, expanded once.
+        if (packedPhase1) { encRankingOffsets = {evalAddMany(cc, encRankingOffsets)}; }
+        encUsersPrefMatrixDiagonals = evalExpandDiagonals(encRankingOffsets, n, cc);
+        runtimePhase = TOC(t);
+        std::cout << "Expansion of rankings to diagonals: " << runtimePhase << " ms" << std::endl;
+    }
+    else {
+        // Diagonal l of user u streamed from the preference permutation of each market (row i = e_{inputs[u][i]}),
+        // without the permutation matrices, and encrypted in parallel over (u, l).
+        #pragma omp parallel for
+        for (int index=0; index<n*n ; ++index){
+            int user = index / n; int l = index % n;
+            // Diagonal l of each market, replicated within its segment.
+            std::vector<std::vector<int64_t>> diagonals;
+            for (auto &inputs : marketInputs){ diagonals.push_back(permutationDiagonal(inputs[user], l, false)); }
+            encUsersPrefMatrixDiagonals[user][l] = evalEncrypt(cc, keyPair.publicKey,
+                                                               cc->MakePackedPlaintext(phase1Layout(diagonals,user)));
+        }
+        runtimePhase = TOC(t);
+        std::cout << "Encryption of preference diagonals: " << runtimePhase << " ms" << std::endl;
+        // Packed phase (1): uploads (each in the segment of its user) summed into one ciphertext per diagonal.
+        if (packedPhase1) {
+            TIC(t);
+            std::vector<Ciphertext<DCRTPoly>> encPackedDiagonals(n);
+            #pragma omp parallel for
+            for (int l=0; l<n ; ++l){
+                std::vector<Ciphertext<DCRTPoly>> encUserDiagonals;
+                for (int user=0; user<n ; ++user){ encUserDiagonals.push_back(encUsersPrefMatrixDiagonals[user][l]); }
+                encPackedDiagonals[l] = evalAddMany(cc, encUserDiagonals);
             }
+            encUsersPrefMatrixDiagonals = {encPackedDiagonals};
+            runtimePhase = TOC(t);
+            std::cout << "Packing of preference diagonals: " << runtimePhase << " ms" << std::endl;
         }
-        userPrefTransposedList.push_back(userPrefMatrixTransposed);
-    }
-    // Build diagonals of pref permutation matrix diagonals.
-    std::vector<std::vector<std::vector<int64_t>>> usersPrefMatrixDiagonals;
-    std::vector<std::vector<std::vector<int64_t>>> usersPrefMatrixTransposedDiagonals;
-    for (int user=0; user<n ; ++user){
-        usersPrefMatrixDiagonals.push_back(matrixDiagonals(userPrefList[user]));
-        usersPrefMatrixTransposedDiagonals.push_back(matrixDiagonals(userPrefTransposedList[user]));
     }
-    // Encrypt diagonals of pref permutation matrix diagonals.
-    std::vector<std::vector<Ciphertext<DCRTPoly>>> encUsersPrefMatrixDiagonals;
+    // Diagonals of each user, or one packed set of all users.
+    int phase1Groups = encUsersPrefMatrixDiagonals.size();
+    // Level of the diagonals: availability is dropped to it in phase (1).
+    uint32_t preferenceLevel = encUsersPrefMatrixDiagonals[0][0]->GetLevel();
+
+    // Transposed diagonals derived from the encrypted diagonals (rotations, no second upload), pre-rotated for BSGS.
+    TIC(t);
+    int transposeBabySteps = (phase1RotationMode == RotationMode::BabyStepGiantStep) ? phase1BabySteps : 0;
     std::vector<std::vector<Ciphertext<DCRTPoly>>> encUsersPrefMatrixTransposedDiagonals;
-    std::vector<int64_t> zeroVec(n,0);
-    for (int user=0; user<n ; ++user){
-        std::vector<Ciphertext<DCRTPoly>> usersPrefDiagonal;
-        std::vector<Ciphertext<DCRTPoly>> usersPrefTransposedDiagonal;
-        for (int l=0; l<n ; ++l){
-            usersPrefDiagonal.push_back(cc->Encrypt(keyPair.publicKey,
-                                        cc->MakePackedPlaintext(repFillSlots(usersPrefMatrixDiagonals[user][l],slotTotal))));
-            usersPrefTransposedDiagonal.push_back(cc->Encrypt(keyPair.publicKey,
-                                                  cc->MakePackedPlaintext(repFillSlots(usersPrefMatrixTransposedDiagonals[user][l],slotTotal))));
+    for (int user=0; user<phase1Groups ; ++user){
+        encUsersPrefMatrixTransposedDiagonals.push_back(evalTransposeDiagonals(encUsersPrefMatrixDiagonals[user],
+                                                                               transposeBabySteps, cc, &rotationPlan));
+    }
+    runtimePhase = TOC(t);
+    std::cout << "Transposed preference diagonals: " << runtimePhase << " ms" << std::endl;
+
+    // Pre-rotate diagonals by giant steps (BSGS phase (1) products).
+    if (phase1RotationMode == RotationMode::BabyStepGiantStep) {
+        TIC(t);
+        for (int user=0; user<phase1Groups ; ++user){
+            encUsersPrefMatrixDiagonals[user] = preRotateDiagonals(encUsersPrefMatrixDiagonals[user],
+                                                                   phase1BabySteps, cc, &rotationPlan);
         }
-        encUsersPrefMatrixDiagonals.push_back(usersPrefDiagonal);
-        encUsersPrefMatrixTransposedDiagonals.push_back(usersPrefTransposedDiagonal);
+        runtimePhase = TOC(t);
+        std::cout << "Pre-rotation of diagonals (BSGS): " << runtimePhase << " ms" << std::endl;
     }
+    endPhase();
 
 
     // Online: Top Trading Cycle
     // -----------------------------------------------------------------------
 
-    // Log runtime.
-    double runtimePhase1Total(0.0);
-    double runtimePhase2aTotal(0.0);
-    double runtimePhase2bTotal(0.0);
-    double runtimePhase3Total(0.0);
-
-    // Initialize availability and output variables.
-    Ciphertext<DCRTPoly> encUserAvailability;
-    encUserAvailability = encOnes;
-    auto enc_output = encZeros;
-
-    // Main loop for cycle finding algorithm.
-    for (int i = 0; i < n ; ++i)
-    {
-        std::cout << "--------------" << std::endl;
-        std::cout << "Round ... " << i+1 << "/" << n << std::endl;
-        std::cout << "--------------" << std::endl;
-
-        //----------------------------------------------------------
-        // (1) Update adjacency matix.
-        //----------------------------------------------------------
-
-        std::vector<Ciphertext<DCRTPoly>> encRowsAdjMatrix;
-        encRowsAdjMatrix.resize(n);
-        Ciphertext<DCRTPoly> encAdjMatrixPacked;
-        double runtimePhase1(0.0);
+    // Per-phase timings of each repetition of the online part.
+    PhaseTimings phaseTimings;
+    // Refresh stage: decryptions and re-encryptions as tasks, overlapping each other and the phases.
+    WorkerPool refreshPool(config.refreshWorkers);
+    std::cout << "Refresh workers: " << refreshPool.workers() << std::endl;
+    // Early termination: every K rounds, one decrypted bit per market (1 while the market has an available user).
+    // Reveals the first checked round after which all users of a market are assigned.
+    if (config.earlyTermination > 0) {
+        std::cout << "Early termination: check every " << config.earlyTermination
+                  << " rounds (reveals the round by which each market is fully assigned)" << std::endl;
+    }
+    for (int repetition = 0; repetition < config.repetitions; ++repetition) {
+        if (config.repetitions > 1) {
+            std::cout << "=========================================" << std::endl;
+            std::cout << "Repetition " << repetition+1 << "/" << config.repetitions << std::endl;
+        }
 
-        TIC(t);
-        #pragma omp parallel for
-        for (int user = 0; user < n; ++user){
-            auto encUserAvailablePref = evalDiagMatrixVecMult(encUsersPrefMatrixDiagonals[user],
-                                                              encUserAvailability, cc);
-            auto encUserFirstAvailablePref = evalPreserveLeadOne(encUserAvailablePref,
-                                                                 cc, initPreserveLeadOne);
-            // Mask and replicate availability row left and right.
-            encUserFirstAvailablePref = cc->EvalMult(encUserFirstAvailablePref,encOnesRow);
-            std::vector<Ciphertext<DCRTPoly>> addContainer;
-            addContainer.push_back(encUserFirstAvailablePref);
-            addContainer.push_back(cc->EvalRotate(encUserFirstAvailablePref,-n));
-            addContainer.push_back(cc->EvalRotate(encUserFirstAvailablePref,n));
-            encUserFirstAvailablePref = cc->EvalAddMany(addContainer);
-            auto tmp = evalDiagMatrixVecMult(encUsersPrefMatrixTransposedDiagonals[user], encUserFirstAvailablePref,cc);
-            #pragma omp critical
-            {
-            encRowsAdjMatrix[user] = tmp;
+        // Log runtime.
+        double runtimePhase1Total(0.0);
+        double runtimePhase2aTotal(0.0);
+        double runtimePhase2bTotal(0.0);
+        double runtimePhase3Total(0.0);
+        double runtimeOther2aTotal(0.0);
+        double runtimeOther2bTotal(0.0);
+        double runtimeTerminationTotal(0.0);
+        // Refresh (decryption and re-encryption) and bookkeeping between phases: round time minus phase times.
+        double runtimeRefreshTotal(0.0);
+
+        // Initialize availability and output variables.
+        Ciphertext<DCRTPoly> encUserAvailability;
+        encUserAvailability = encOnes;
+        auto enc_output = encZeros;
+        // Re-encryption of the output after (3), consumed by (3) of the next round.
+        std::future<Ciphertext<DCRTPoly>> encOutputRefreshed;
+
+        // Main loop for cycle finding algorithm.
+        bool allAssigned = false; int rounds = 0;
+        for (int i = 0; i < n && !allAssigned; ++i)
+        {
+            TimeVar tRound; TIC(tRound); rounds++;
+            CryptoOpsScope roundScope("round", {{"repetition", repetition}, {"round", i}});
+            double runtimePhasesStart = runtimePhase1Total+runtimePhase2aTotal+runtimePhase2bTotal+runtimePhase3Total
+                                        +runtimeOther2aTotal+runtimeOther2bTotal+runtimeTerminationTotal;
+            std::cout << "--------------" << std::endl;
+            std::cout << "Round ... " << i+1 << "/" << n << std::endl;
+            std::cout << "--------------" << std::endl;
+
+            //----------------------------------------------------------
+            // (1) Update adjacency matix.
+            //----------------------------------------------------------
+
+            // Rows of the adjacency matrix per user, or all rows in one packed ciphertext.
+            std::vector<Ciphertext<DCRTPoly>> encRowsAdjMatrix;
+            encRowsAdjMatrix.resize(phase1Groups);
+            Ciphertext<DCRTPoly> encAdjMatrixPacked;
+            double runtimePhase1(0.0);
+
+            beginPhase("phase1");
+            TIC(t);
+            auto encAvailability = evalLevelReduce(cc, encUserAvailability, preferenceLevel);
+            // Circuit of all users: the rotations of the availability vector are shared by the users' products, and
+            // the users' kernels interleave on all threads. Packed: one product chain on the segments of all users.
+            Circuit phase1Circuit(&rotationPlan);
+            auto availability = phase1Circuit.input(encAvailability);
+            std::vector<Circuit::Node> phase1Outputs;
+            std::vector<Circuit::Node> transposedDiagonalNodes;
+            for (int user = 0; user < phase1Groups; ++user){
+                CircuitScope userScope(phase1Circuit, "", packedPhase1 ? TraceArgs{} : TraceArgs{{"user", user}});
+                std::vector<Circuit::Node> diagonals;
+                for (auto &encDiagonal : encUsersPrefMatrixDiagonals[user]) { diagonals.push_back(phase1Circuit.input(encDiagonal)); }
+                auto firstAvailablePref = circuitPreserveLeadOne(phase1Circuit,
+                    circuitDiagMatrixVecMult(phase1Circuit, diagonals, availability, phase1RotationMode, phase1BabySteps),
+                    initPreserveLeadOne);
+                // Mask and replicate availability row left and right (packed: right only, within the user segment).
+                firstAvailablePref = phase1Circuit.modReduce(phase1Circuit.mult(firstAvailablePref,
+                                                                                circuitConstant(levelPhase1Mask)));
+                std::vector<Circuit::Node> copies{firstAvailablePref, phase1Circuit.rotate(firstAvailablePref, -n)};
+                if (!packedPhase1) { copies.push_back(phase1Circuit.rotate(firstAvailablePref, n)); }
+                firstAvailablePref = phase1Circuit.addMany(copies);
+                // Transposed diagonals dropped to the level of their input (kept for the next rounds).
+                std::vector<Circuit::Node> transposedDiagonals;
+                for (auto &encDiagonal : encUsersPrefMatrixTransposedDiagonals[user]) {
+                    transposedDiagonals.push_back(phase1Circuit.levelReduce(phase1Circuit.input(encDiagonal),
+                                                                            firstAvailablePref));
+                }
+                transposedDiagonalNodes.insert(transposedDiagonalNodes.end(), transposedDiagonals.begin(),
+                                               transposedDiagonals.end());
+                phase1Outputs.push_back(circuitDiagMatrixVecMult(phase1Circuit, transposedDiagonals, firstAvailablePref,
+                                                                 phase1RotationMode, phase1BabySteps));
             }
-        }
-        runtimePhase1 = TOC(t);
-        runtimePhase1Total += runtimePhase1;
-        std::cout << "Online part 1 - Adjacency matrix update time: " << runtimePhase1 << "ms" << std::endl;
-
-        // Refresh after (1) update adjacency matrix.
-        //----------------------------------------------------------
-        std::cout << "Adjacency Matrix: " << std::endl;
-
-        // Flat encoded adjacency matrix for matrix exponentiation.
-        Ciphertext<DCRTPoly> encAdjMatrixFlat;
-
-        // Refresh "encRowsAdjMatrix" as encrypted flat packed matrix.
-        std::vector<std::vector<int64_t>> rowsAdjMatrix;
-        for (int row=0; row < n; ++row){
-            Plaintext plaintext;
-            cc->Decrypt(keyPair.secretKey, encRowsAdjMatrix[row], &plaintext);
-            plaintext->SetLength(n); auto payload = plaintext->GetPackedValue();
-            // Print adjacence matrix.
-            std::cout << payload << std::endl;
-            rowsAdjMatrix.push_back(payload);
-            // Also refresh "encRowsAdjMatrix" in row form for phase (3).
-            refreshInPlace(encRowsAdjMatrix[row],n,keyPair,cc);
-        }
-        std::vector<int64_t> flatMatrix(n*n,0);
-        for (int row=0; row < n; ++row){
-            for (int col=0; col < n; ++col){
-                flatMatrix[row*n+col] = rowsAdjMatrix[row][col];
+            if (i == 0) {
+                std::cout << "Phase 1 circuit: " << phase1Circuit.size() << " nodes, " << phase1Circuit.merged()
+                          << " merged operations" << std::endl;
             }
-        }
-        encAdjMatrixFlat = cc->Encrypt(keyPair.publicKey,
-                                       cc->MakePackedPlaintext(repFillSlots(flatMatrix,slotTotal)));
-
-        //----------------------------------------------------------
-        // (2) Cycle finding.
-        //----------------------------------------------------------
-
-        // 2a) Matrix exponentiation.
-        //----------------------------------------------------------
-        // Cycle finding result [r_1, ..., r_n]. On cycle, r_i = 1. Not on cycle: r_i = 0.
-        Ciphertext<DCRTPoly> encMatrixExpFlat;
-        double runtimePhase2a(0.0);
-
-        bool contFlag = true; int sqs = 1;
-        while (contFlag) {
-            int exp = 2 * sqs;
-            if (exp >= n) { contFlag = false; }
-            else { sqs = sqs + 1; }
-        }
-
-        TIC(t);
-        encMatrixExpFlat = encAdjMatrixFlat;
-        int refreshInterval = std::floor(chosen_depth/3);
-        for (int i=1; i <= sqs; i++){
-            encMatrixExpFlat = evalMatrixMultParallel(cc,encMatrixExpFlat,encMatrixExpFlat,initMatrixMult);
-            if (i % refreshInterval == 0) {
-                runtimePhase2a += TOC(t);
-                refreshInPlace(encMatrixExpFlat,cc->GetRingDimension(),keyPair,cc);
-                TIC(t);
+            phase1Outputs.insert(phase1Outputs.end(), transposedDiagonalNodes.begin(), transposedDiagonalNodes.end());
+            auto phase1Results = evalCircuit(cc, phase1Circuit, phase1Outputs);
+            for (int user = 0; user < phase1Groups; ++user){
+                encRowsAdjMatrix[user] = phase1Results[user];
+                for (int l = 0; l < n; ++l){
+                    encUsersPrefMatrixTransposedDiagonals[user][l] = phase1Results[phase1Groups + user*n + l];
+                }
             }
-        }
-        runtimePhase2a += TOC(t);
-        runtimePhase2aTotal += runtimePhase2a;
-        std::cout << "Online part 2a - Matrix exponentiation: " << runtimePhase2a << " ms" << std::endl;
-
-        // Refresh after (2a) matrix squaring.
-        //----------------------------------------------------------
-        Ciphertext<DCRTPoly> encMatrixExpPacked;
-
-        std::vector<int64_t> packedMatrix(slotsPadded*n,0);
-        Plaintext plaintext;
-        cc->Decrypt(keyPair.secretKey,encMatrixExpFlat,&plaintext);
-        plaintext->SetLength(n*n); auto payload = plaintext->GetPackedValue();
-        for (int row = 0; row < n; row++){
-            // std::vector<int64_t> matrixElemsRow;
-            for (int col = 0; col < n; col++){
-                int pos = col*slotsPadded + row;
-                packedMatrix[pos] = payload[row*n+col];
+            runtimePhase1 = TOC(t);
+            endPhase();
+            runtimePhase1Total += runtimePhase1;
+            std::cout << "Online part 1 - Adjacency matrix update time: " << runtimePhase1 << "ms" << std::endl;
+
+            // Refresh after (1) update adjacency matrix.
+            //----------------------------------------------------------
+            beginPhase("refresh");
+            std::cout << "Adjacency Matrix: " << std::endl;
+
+            // Flat encoded adjacency matrix for matrix exponentiation.
+            Ciphertext<DCRTPoly> encAdjMatrixFlat;
+
+            // Refresh "encRowsAdjMatrix" as encrypted flat packed matrix (per market: [market][row]).
+            // Rows are decrypted in parallel on the refresh pool (packed: one ciphertext, row u in user segment u).
+            std::vector<std::future<std::vector<int64_t>>> rowPayloads;
+            for (int group=0; group < phase1Groups; ++group){
+                rowPayloads.push_back(decryptAsync(cc, keyPair.secretKey, encRowsAdjMatrix[group], slotTotal, refreshPool));
+            }
+            std::vector<std::vector<int64_t>> payloads;
+            for (auto &rowPayload : rowPayloads) { payloads.push_back(rowPayload.get()); }
+            std::vector<std::vector<std::vector<int64_t>>> rowsAdjMatrix(markets);
+            for (int row=0; row < n; ++row){
+                int offset = packedPhase1 ? row*phase1Width : 0;
+                for (int market=0; market < markets; ++market){
+                    auto segment = unpackMarket(payloads[packedPhase1 ? 0 : row],market,markets,offset+n);
+                    rowsAdjMatrix[market].push_back(std::vector<int64_t>(segment.begin()+offset, segment.end()));
+                }
+            }
+            std::vector<std::vector<int64_t>> flatMatrix(markets, std::vector<int64_t>(n*n,0));
+            for (int market=0; market < markets; ++market){
+                // Print adjacence matrix.
+                if (markets > 1) { std::cout << "Market " << market << ":" << std::endl; }
+                for (int row=0; row < n; ++row){
+                    std::cout << rowsAdjMatrix[market][row] << std::endl;
+                    for (int col=0; col < n; ++col){
+                        flatMatrix[market][row*n+col] = rowsAdjMatrix[market][row][col];
+                    }
+                }
+            }
+            if (!tiledMatrixMult) {
+                encAdjMatrixFlat = evalEncrypt(cc, keyPair.publicKey,
+                                               cc->MakePackedPlaintext(tileMarkets(flatMatrix,slotTotal)));
+            }
+            endPhase();
+
+            // Preference indices t of (3) do not depend on (2): the refresh pool re-encrypts "encRowsAdjMatrix" in row
+            // form and computes the rotated t of each user while (2) runs.
+            std::vector<std::future<Ciphertext<DCRTPoly>>> enc_elements_refreshed;
+            for (int user=0; user < n; ++user){
+                std::vector<std::vector<int64_t>> marketRows;
+                for (int market=0; market < markets; ++market){ marketRows.push_back(rowsAdjMatrix[market][user]); }
+                auto plaintextRow = cc->MakePackedPlaintext(packMarkets(marketRows,slotTotal));
+                enc_elements_refreshed.push_back(refreshPool.submit("phase3", [&, user, plaintextRow]() {
+                    TraceSpan userSpan("user", {{"user", user}});
+                    auto encRow = evalEncrypt(cc, keyPair.publicKey, plaintextRow);
+                    auto enc_t_user = evalInnerProduct(cc, encRow, encRange, n);
+                    evalModReduceInPlace(cc, enc_t_user);
+                    enc_t_user = evalMult(cc, enc_t_user, levelLeadingOne.at(enc_t_user->GetLevel()));
+                    evalModReduceInPlace(cc, enc_t_user);
+                    return evalRotate(cc, enc_t_user, -user, &rotationPlan);
+                }));
             }
-        }
-        encMatrixExpPacked = cc->Encrypt(keyPair.publicKey,
-                                         cc->MakePackedPlaintext(packedMatrix));
-
-        // 2b) Cycle computation.
-        //----------------------------------------------------------
-        Ciphertext<DCRTPoly> enc_u_unmasked;
-        double runtimePhase2b(0.0);
 
-        TIC(t);
+            //----------------------------------------------------------
+            // (2) Cycle finding.
+            //----------------------------------------------------------
+            // Both engines return u: u_i = 1 if user i is on a cycle, 0 otherwise.
+
+            // Squarings: A^(2^sqs) with 2^sqs >= n. Column j of A^t counts the walks of length t ending in j; off a
+            // cycle they follow distinct users (one out-edge each), so they have fewer than n edges, while a user on a
+            // cycle is reached by walks of every length. Any t >= n separates both, hence ceil(log2 n) squarings
+            // (the former bound 2*sqs >= n squared ceil(n/2) times for the same result).
+            bool contFlag = true; int sqs = 1;
+            while (contFlag) {
+                int exp = std::pow(2, sqs);
+                if (exp >= n) { contFlag = false; }
+                else { sqs = sqs + 1; }
+            }
 
-        auto encResMult = cc->EvalMult(encMatrixExpPacked,encOnes);
-        auto encResInnerProd = evalPrefixAdd(encResMult,slotsPadded,cc);
-        enc_u_unmasked = evalNotEqualZero(encResInnerProd,cc,initNotEqualZero);
+            // Bounded cycle lengths: S = A + A^2 + ... + A^L of the blocks x blocks grid encAdjMatrix (1 x 1: flat),
+            // refreshed (power and sum) at the matrix squaring intervals.
+            auto evalCycleSums = [&](std::vector<std::vector<Ciphertext<DCRTPoly>>> encAdjMatrix, int slots,
+                                     double &runtimePhase2a) {
+                auto encPower = encAdjMatrix; auto encSum = encAdjMatrix;
+                auto steps = cycleSumSteps(maxCycleLength);
+                int stepCount = steps.size();
+                for (int step=1; step <= stepCount; step++){
+                    evalCycleSumStep(cc,encPower,encSum,encAdjMatrix,steps[step-1],step < stepCount,initMatrixMult);
+                    if (parameterPlan.refreshAfterStep(CycleFindingMode::MatrixSquaring, step, stepCount)) {
+                        runtimePhase2a += TOC(t);
+                        for (auto &encBlockRow : encPower) { refreshInPlace(encBlockRow,slots,keyPair,cc,refreshPool); }
+                        for (auto &encBlockRow : encSum) { refreshInPlace(encBlockRow,slots,keyPair,cc,refreshPool); }
+                        TIC(t);
+                    }
+                }
+                return encSum;
+            };
+
+            // Tiled matrix squaring (single market): 2a) matrix exponentiation over blocks, 2b) column sums of block columns.
+            auto cycleFindingTiledMatrixSquaring = [&](double &runtimePhase2a, double &runtimePhase2b) {
+                // 2a) Matrix exponentiation.
+                //----------------------------------------------------------
+                auto encMatrixExpTiles = encTiledMatrix(rowsAdjMatrix[0], matrixMultDim, cc, keyPair);
+                int blocks = encMatrixExpTiles.size();
+
+                beginPhase("phase2a");
+                TIC(t);
+                if (maxCycleLength > 0) {
+                    encMatrixExpTiles = evalCycleSums(encMatrixExpTiles,cc->GetRingDimension(),runtimePhase2a);
+                }
+                for (int i=1; i <= sqs && maxCycleLength == 0; i++){
+                    encMatrixExpTiles = evalTiledMatrixMult(cc,encMatrixExpTiles,encMatrixExpTiles,initMatrixMult);
+                    if (parameterPlan.refreshAfterStep(CycleFindingMode::MatrixSquaring, i, sqs)) {
+                        runtimePhase2a += TOC(t);
+                        for (auto &encBlockRow : encMatrixExpTiles) {
+                            refreshInPlace(encBlockRow,cc->GetRingDimension(),keyPair,cc,refreshPool);
+                        }
+                        TIC(t);
+                    }
+                }
+                runtimePhase2a += TOC(t);
+                endPhase();
+
+                // Refresh after (2a) matrix squaring.
+                //----------------------------------------------------------
+                beginPhase("refresh");
+                for (auto &encBlockRow : encMatrixExpTiles) {
+                    refreshInPlace(encBlockRow,matrixMultDim*matrixMultDim,keyPair,cc,refreshPool);
+                }
+                endPhase();
+
+                // 2b) Cycle computation.
+                //----------------------------------------------------------
+                // Column sums of block column J: sum of blocks, then of tile rows (slot j of the first tile row).
+                // Bounded cycle lengths: diagonal of block JJ, moved to the first tile row the same way.
+                std::vector<Ciphertext<DCRTPoly>> enc_u_blocks;
+                enc_u_blocks.resize(blocks);
+
+                beginPhase("phase2b");
+                TIC(t);
+                #pragma omp parallel for
+                for (int J = 0; J < blocks; J++) {
+                    std::vector<Ciphertext<DCRTPoly>> encBlockColumn;
+                    for (int I = 0; I < blocks; I++) { encBlockColumn.push_back(encMatrixExpTiles[I][J]); }
+                    Ciphertext<DCRTPoly> encColumn;
+                    if (maxCycleLength > 0) {
+                        encColumn = evalMult(cc, encMatrixExpTiles[J][J], encDiagonalTile);
+                        evalModReduceInPlace(cc, encColumn);
+                    } else {
+                        encColumn = evalAddMany(cc, encBlockColumn);
+                    }
+                    auto encColSums = evalRotateSum(cc, encColumn, matrixMultDim, matrixMultDim, &rotationPlan);
+                    enc_u_blocks[J] = evalNotEqualZero(encColSums,cc,initCycleNotEqualZero);
+                }
+                runtimePhase2b = TOC(t);
+                endPhase();
+
+                // Refresh after (2b) cycle computation.
+                //----------------------------------------------------------
+                beginPhase("refresh");
+                std::vector<int64_t> uElems;
+                for (int J = 0; J < blocks; J++) {
+                    Plaintext plaintext2b;
+                    evalDecrypt(cc, keyPair.secretKey,enc_u_blocks[J],&plaintext2b);
+                    plaintext2b->SetLength(matrixMultDim); auto payload2b = plaintext2b->GetPackedValue();
+                    for (int col = 0; col < matrixMultDim && J*matrixMultDim+col < n; col++) { uElems.push_back(payload2b[col]); }
+                }
+                endPhase();
+                return std::vector<std::vector<int64_t>>{uElems};
+            };
+
+            // Matrix squaring: 2a) matrix exponentiation, 2b) column sums of the matrix power.
+            auto cycleFindingMatrixSquaring = [&](double &runtimePhase2a, double &runtimePhase2b) {
+                if (tiledMatrixMult) { return cycleFindingTiledMatrixSquaring(runtimePhase2a, runtimePhase2b); }
+
+                // 2a) Matrix exponentiation.
+                //----------------------------------------------------------
+                // Cycle finding result [r_1, ..., r_n]. On cycle, r_i = 1. Not on cycle: r_i = 0.
+                Ciphertext<DCRTPoly> encMatrixExpFlat;
+
+                beginPhase("phase2a");
+                TIC(t);
+                encMatrixExpFlat = encAdjMatrixFlat;
+                if (maxCycleLength > 0) {
+                    encMatrixExpFlat = evalCycleSums({{encAdjMatrixFlat}},cc->GetRingDimension(),runtimePhase2a)[0][0];
+                }
+                for (int i=1; i <= sqs && maxCycleLength == 0; i++){
+                    encMatrixExpFlat = evalMatrixMultParallel(cc,encMatrixExpFlat,encMatrixExpFlat,initMatrixMult);
+                    if (parameterPlan.refreshAfterStep(CycleFindingMode::MatrixSquaring, i, sqs)) {
+                        runtimePhase2a += TOC(t);
+                        refreshInPlace(encMatrixExpFlat,cc->GetRingDimension(),keyPair,cc);
+                        TIC(t);
+                    }
+                }
+                runtimePhase2a += TOC(t);
+                endPhase();
+
+                // Refresh after (2a) matrix squaring.
+                //----------------------------------------------------------
+                beginPhase("refresh");
+                Ciphertext<DCRTPoly> encMatrixExpPacked;
+
+                std::vector<std::vector<int64_t>> packedMatrix(markets, std::vector<int64_t>(slotsPadded*n,0));
+                Plaintext plaintext;
+                evalDecrypt(cc, keyPair.secretKey,encMatrixExpFlat,&plaintext);
+                plaintext->SetLength(slotTotal); auto payloadMarkets = plaintext->GetPackedValue();
+                for (int market = 0; market < markets; market++){
+                    auto payload = unpackMarket(payloadMarkets,market,markets,n*n);
+                    for (int row = 0; row < n; row++){
+                        // std::vector<int64_t> matrixElemsRow;
+                        for (int col = 0; col < n; col++){
+                            int pos = col*slotsPadded + row;
+                            packedMatrix[market][pos] = payload[row*n+col];
+                        }
+                    }
+                }
+                encMatrixExpPacked = evalEncrypt(cc, keyPair.publicKey,
+                                                 cc->MakePackedPlaintext(packMarkets(packedMatrix,slotTotal)));
+                endPhase();
+
+                // 2b) Cycle computation.
+                //----------------------------------------------------------
+                Ciphertext<DCRTPoly> enc_u_unmasked;
+
+                beginPhase("phase2b");
+                TIC(t);
 
-        runtimePhase2b = TOC(t);
-        runtimePhase2bTotal += runtimePhase2b;
-        std::cout << "Online part 2b - Cycle computation: " << runtimePhase2b << "ms" << std::endl;
+                // Column sums, or the diagonal (bounded cycle lengths), in the first slot of each column.
+                auto encResMult = evalMult(cc, encMatrixExpPacked,(maxCycleLength > 0) ? encDiagonalPacked : encOnes);
+                evalModReduceInPlace(cc, encResMult);
+                auto encResInnerProd = evalPrefixAdd(encResMult,initPrefixScan,cc);
+                enc_u_unmasked = evalNotEqualZero(encResInnerProd,cc,initCycleNotEqualZero);
+
+                runtimePhase2b = TOC(t);
+                endPhase();
+
+                // Refresh after (2b) cycle computation.
+                //----------------------------------------------------------
+                beginPhase("refresh");
+                Plaintext plaintext2b;
+                evalDecrypt(cc, keyPair.secretKey,enc_u_unmasked,&plaintext2b);
+                plaintext2b->SetLength(slotTotal); auto payload2bMarkets = plaintext2b->GetPackedValue();
+                std::vector<std::vector<int64_t>> uElems(markets);
+                for (int market = 0; market < markets; market++){
+                    auto payload2b = unpackMarket(payload2bMarkets,market,markets,n*slotsPadded);
+                    for (int user = 0; user < n; user++){
+                        uElems[market].push_back(payload2b[user*slotsPadded]);
+                    }
+                }
+                endPhase();
+                return uElems;
+            };
+
+            // Functional graph: 2a) walk counts v <- A^T v, 2b) NotEqualZero of walk counts.
+            auto cycleFindingFunctionalGraph = [&](double &runtimePhase2a, double &runtimePhase2b) {
+                // Flat and transposed flat adjacency matrix, zero padded (walk steps sum over blocks).
+                std::vector<std::vector<int64_t>> flatMatrixTransposed(markets, std::vector<int64_t>(n*n,0));
+                for (int market=0; market < markets; ++market){
+                    for (int row=0; row < n; ++row){
+                        for (int col=0; col < n; ++col){
+                            flatMatrixTransposed[market][col*n+row] = rowsAdjMatrix[market][row][col];
+                        }
+                    }
+                }
+                // Copies at every level of the walk (reused after each refresh).
+                LevelConstant levelAdjMatrixFlatPadded(cc, evalEncrypt(cc, keyPair.publicKey,
+                                                       cc->MakePackedPlaintext(packMarkets(flatMatrix,slotTotal))),
+                                                       chosen_depth+1);
+                LevelConstant levelAdjMatrixTransposedFlat(cc, evalEncrypt(cc, keyPair.publicKey,
+                                                           cc->MakePackedPlaintext(packMarkets(flatMatrixTransposed,slotTotal))),
+                                                           chosen_depth+1);
+
+                // 2a) Walk counts: number of walks of length t >= n ending in each user.
+                //----------------------------------------------------------
+                beginPhase("phase2a");
+                TIC(t);
+                auto encWalkCounts = initFunctionalGraph.encOnesRow();
+                int steps = initFunctionalGraph.steps();
+                for (int step=1; step <= steps; step++){
+                    if (step % 2) {
+                        auto encAdjMatrixTransposedFlat = levelAdjMatrixTransposedFlat.at(encWalkCounts->GetLevel());
+                        encWalkCounts = evalWalkStepRowToBlock(encWalkCounts,encAdjMatrixTransposedFlat,cc,initFunctionalGraph);
+                    }
+                    else {
+                        auto encAdjMatrixFlatPadded = levelAdjMatrixFlatPadded.at(encWalkCounts->GetLevel());
+                        encWalkCounts = evalWalkStepBlockToRow(encWalkCounts,encAdjMatrixFlatPadded,cc,initFunctionalGraph);
+                    }
+                    if (parameterPlan.refreshAfterStep(CycleFindingMode::FunctionalGraph, step, steps)) {
+                        runtimePhase2a += TOC(t);
+                        refreshInPlace(encWalkCounts,slotTotal,keyPair,cc);
+                        TIC(t);
+                    }
+                }
+                runtimePhase2a += TOC(t);
+                endPhase();
 
-        // Refresh after (2b) cycle computation.
-        //----------------------------------------------------------
-        Ciphertext<DCRTPoly> enc_u;
+                // Refresh after (2a) walk counts.
+                beginPhase("refresh");
+                refreshInPlace(encWalkCounts,slotTotal,keyPair,cc);
+                endPhase();
 
-        Plaintext plaintext2b;
-        cc->Decrypt(keyPair.secretKey,enc_u_unmasked,&plaintext2b);
-        plaintext2b->SetLength(n*slotsPadded); auto payload2b = plaintext2b->GetPackedValue();
-        std::vector<int64_t> uElems;
-        for (int user = 0; user < n; user++){
-            uElems.push_back(payload2b[user*slotsPadded]);
-        }
-        enc_u = cc->Encrypt(keyPair.publicKey,
-                cc->MakePackedPlaintext(uElems));
+                // 2b) Cycle computation.
+                //----------------------------------------------------------
+                beginPhase("phase2b");
+                TIC(t);
+                auto enc_u_unmasked = evalNotEqualZero(encWalkCounts,cc,initNotEqualZero);
+                runtimePhase2b = TOC(t);
+                endPhase();
+
+                // Refresh after (2b) cycle computation.
+                //----------------------------------------------------------
+                beginPhase("refresh");
+                Plaintext plaintext2b;
+                evalDecrypt(cc, keyPair.secretKey,enc_u_unmasked,&plaintext2b);
+                plaintext2b->SetLength(slotTotal); auto payload2b = plaintext2b->GetPackedValue();
+                std::vector<std::vector<int64_t>> uElems;
+                for (int market = 0; market < markets; market++){ uElems.push_back(unpackMarket(payload2b,market,markets,n)); }
+                endPhase();
+                return uElems;
+            };
+
+            double runtimePhase2a(0.0);
+            double runtimePhase2b(0.0);
+            std::vector<std::vector<int64_t>> uElems = (cycleFindingMode == CycleFindingMode::FunctionalGraph)
+                                          ? cycleFindingFunctionalGraph(runtimePhase2a, runtimePhase2b)
+                                          : cycleFindingMatrixSquaring(runtimePhase2a, runtimePhase2b);
+            runtimePhase2aTotal += runtimePhase2a;
+            runtimePhase2bTotal += runtimePhase2b;
+            std::cout << "Online part 2a - " << cycleFindingEngineName(cycleFindingMode) << ": "
+                      << runtimePhase2a << " ms" << std::endl;
+            std::cout << "Online part 2b - Cycle computation: " << runtimePhase2b << "ms" << std::endl;
+
+            // Benchmark: run the other engine on the same adjacency matrix.
+            if (benchmarkCycleFinding) {
+                CryptoOpsScope benchmarkScope("benchmark");
+                double runtimeOther2a(0.0);
+                double runtimeOther2b(0.0);
+                std::vector<std::vector<int64_t>> uElemsOther = (cycleFindingMode == CycleFindingMode::FunctionalGraph)
+                                                   ? cycleFindingMatrixSquaring(runtimeOther2a, runtimeOther2b)
+                                                   : cycleFindingFunctionalGraph(runtimeOther2a, runtimeOther2b);
+                runtimeOther2aTotal += runtimeOther2a;
+                runtimeOther2bTotal += runtimeOther2b;
+                std::cout << "Benchmark part 2a - " << cycleFindingEngineName(otherCycleFindingMode) << ": "
+                          << runtimeOther2a << " ms" << std::endl;
+                std::cout << "Benchmark part 2b - Cycle computation: " << runtimeOther2b << "ms" << std::endl;
+                std::cout << "Benchmark cycle vector match: " << (uElemsOther == uElems ? "yes" : "NO") << std::endl;
+            }
 
-        //----------------------------------------------------------
-        // (3) Update user availability and outputs.
-        //----------------------------------------------------------
-        double runtimePhase3(0.0);
+            Ciphertext<DCRTPoly> enc_u;
+            enc_u = evalEncrypt(cc, keyPair.publicKey,
+                    cc->MakePackedPlaintext(packMarkets(uElems,slotTotal)));
+
+            //----------------------------------------------------------
+            // (3) Update user availability and outputs.
+            //----------------------------------------------------------
+            double runtimePhase3(0.0);
+
+            beginPhase("phase3");
+            TIC(t);
+
+            // Compute current preference index (t) for all users in packed ciphertext (from the refresh pool).
+            std::vector<Ciphertext<DCRTPoly>> enc_elements;
+            for (auto &enc_t_user : enc_elements_refreshed) { enc_elements.push_back(enc_t_user.get()); }
+            auto enc_t = evalAddMany(cc, enc_elements);
+            if (encOutputRefreshed.valid()) { enc_output = encOutputRefreshed.get(); }
+            // o: Update output for all users in packed ciphertext: o <- t x u + o x (1-u)
+            auto enc_t_mult_u = evalMult(cc, enc_t, evalLevelReduce(cc, enc_u, enc_t->GetLevel()));
+            evalModReduceInPlace(cc, enc_t_mult_u);
+            auto enc_neg_u = evalMult(cc, enc_u, levelNegOnes.at(enc_u->GetLevel())); evalModReduceInPlace(cc, enc_neg_u);
+            auto enc_one_min_u = evalAdd(cc, levelOnes.at(enc_neg_u->GetLevel()), enc_neg_u);
+            // output <- t x u + o x (1-u)
+            auto enc_output_mult = evalMult(cc, evalLevelReduce(cc, enc_output, enc_one_min_u->GetLevel()), enc_one_min_u);
+            evalModReduceInPlace(cc, enc_output_mult);
+            enc_output = evalAdd(cc, enc_t_mult_u, evalLevelReduce(cc, enc_output_mult, enc_t_mult_u->GetLevel()));
+            // Update availability: 1-NotEqualZero(output)
+            auto enc_output_reduced = evalNotEqualZero(enc_output,cc,initNotEqualZero);
+            auto enc_neg_output = evalMult(cc, enc_output_reduced, levelNegOnes.at(enc_output_reduced->GetLevel()));
+            evalModReduceInPlace(cc, enc_neg_output);
+            encUserAvailability = evalAdd(cc, levelOnes.at(enc_neg_output->GetLevel()), enc_neg_output);
+
+            runtimePhase3 = TOC(t);
+            endPhase();
+            runtimePhase3Total += runtimePhase3;
+            std::cout << "Online part 3 - User availability & output update: " << runtimePhase3 << "ms" << std::endl;
+
+            // Refresh after (3) update availability.
+            //----------------------------------------------------------
+            beginPhase("refresh");
+
+            // Output and availability decrypted in parallel on the refresh pool.
+            auto outputDecrypted = decryptAsync(cc, keyPair.secretKey, enc_output, slotTotal, refreshPool);
+            auto userAvailabilityDecrypted = decryptAsync(cc, keyPair.secretKey, encUserAvailability, slotTotal, refreshPool);
+            // Refresh encrypted output vector: re-encryption overlaps the next round up to its phase (3).
+            auto outputMarkets = outputDecrypted.get();
+            std::vector<std::vector<int64_t>> output;
+            for (int market = 0; market < markets; market++){
+                output.push_back(unpackMarket(outputMarkets,market,markets,n));
+                std::cout << "Output vector" << marketLabel(market) << ": " << output[market] << std::endl;
+            }
+            encOutputRefreshed = encryptAsync(cc, keyPair.publicKey,
+                                              cc->MakePackedPlaintext(packMarkets(output,slotTotal)), refreshPool);
+            // Refresh & pack copies of user availability vector into single ciphertext.
+            auto userAvailabilityMarkets = userAvailabilityDecrypted.get();
+            std::vector<std::vector<int64_t>> userAvailability;
+            for (int market = 0; market < markets; market++){
+                userAvailability.push_back(unpackMarket(userAvailabilityMarkets,market,markets,n));
+                std::cout << "Availability vector" << marketLabel(market) << ": " << userAvailability[market] << std::endl;
+            }
+            encUserAvailability = evalEncrypt(cc, keyPair.publicKey,
+                                              cc->MakePackedPlaintext(phase1Layout(userAvailability,-1)));
+            endPhase();
+
+            // Early termination check: available users per market (first n slots, prefix add into slot 0), masked
+            // to slot 0 and NotEqualZero. Only these bits are decrypted.
+            if (config.earlyTermination > 0 && (i+1) % config.earlyTermination == 0 && i+1 < n) {
+                beginPhase("termination");
+                TIC(t);
+                auto encAvailable = evalMult(cc, encUserAvailability, encOnesRow);
+                evalModReduceInPlace(cc, encAvailable);
+                auto encAvailableCount = evalPrefixAdd(encAvailable, initPrefixScan, cc);
+                encAvailableCount = evalMult(cc, encAvailableCount, levelLeadingOne.at(encAvailableCount->GetLevel()));
+                evalModReduceInPlace(cc, encAvailableCount);
+                auto encAnyAvailable = evalNotEqualZero(encAvailableCount,cc,initNotEqualZero);
+                Plaintext plaintextAny;
+                evalDecrypt(cc, keyPair.secretKey, encAnyAvailable, &plaintextAny);
+                plaintextAny->SetLength(slotTotal); auto payloadAny = plaintextAny->GetPackedValue();
+                allAssigned = true;
+                for (int market = 0; market < markets; market++){
+                    allAssigned = allAssigned && unpackMarket(payloadAny,market,markets,1)[0] == 0;
+                }
+                double runtimeTermination = TOC(t);
+                runtimeTerminationTotal += runtimeTermination;
+                std::cout << "Early termination check: " << runtimeTermination << " ms"
+                          << (allAssigned ? ", all users assigned after round " + std::to_string(i+1) : "") << std::endl;
+                endPhase();
+            }
+            runtimeRefreshTotal += TOC(tRound) - (runtimePhase1Total+runtimePhase2aTotal+runtimePhase2bTotal+runtimePhase3Total
+                                                  +runtimeOther2aTotal+runtimeOther2bTotal+runtimeTerminationTotal
+                                                  -runtimePhasesStart);
 
-        TIC(t);
+        // End loop.
+        }
+        std::cout << "-----------------------------------------" << std::endl;
+        std::cout << "Rounds: " << rounds << "/" << n << std::endl;
+        std::cout << "Online part 1 - Total runtime: " << runtimePhase1Total << "ms" << std::endl;
+        std::cout << "Online part 2a - Total runtime: " << runtimePhase2aTotal << "ms" << std::endl;
+        std::cout << "Online part 2b - Total runtime: " << runtimePhase2bTotal << "ms" << std::endl;
+        std::cout << "Online part 3 - Total runtime: " << runtimePhase3Total << "ms" << std::endl;
+        std::cout << "Online all - Total runtime: " << runtimePhase1Total+runtimePhase2aTotal+runtimePhase2bTotal+runtimePhase3Total << "ms" << std::endl;
+        if (config.earlyTermination > 0) {
+            std::cout << "Early termination - Total runtime: " << runtimeTerminationTotal << "ms" << std::endl;
+        }
+        std::cout << "Refresh - Total runtime: " << runtimeRefreshTotal << "ms" << std::endl;
+        if (benchmarkCycleFinding) {
+            std::cout << "Benchmark part 2a - Total runtime (" << cycleFindingEngineName(otherCycleFindingMode) << "): "
+                      << runtimeOther2aTotal << "ms" << std::endl;
+            std::cout << "Benchmark part 2b - Total runtime: " << runtimeOther2bTotal << "ms" << std::endl;
+        }
 
-        // Compute current preference index (t) for all users in packed ciphertext.
-        std::vector<Ciphertext<DCRTPoly>> enc_elements;
-        enc_elements.resize(n);
-        #pragma omp parallel for
-        for (int user=0; user < n; ++user){
-            // Note: encRowsAdjMatrix must be refreshed after (1)
-            auto enc_t_user = cc->EvalInnerProduct(encRowsAdjMatrix[user], encRange,
-                                                   encRowsAdjMatrix.size());
-            // enc_t_user = cc->EvalMult(enc_t_user, initRotsMasks.encMasks()[0]);
-            enc_t_user = cc->EvalMult(enc_t_user, encLeadingOne);
-            cc->ModReduceInPlace(enc_t_user);
-            auto tmp = cc->EvalRotate(enc_t_user,-user);
-            #pragma omp critical
-            {
-            enc_elements[user] = tmp;
-            }
+        phaseTimings.add("phase1", runtimePhase1Total);
+        phaseTimings.add("phase2a", runtimePhase2aTotal);
+        phaseTimings.add("phase2b", runtimePhase2bTotal);
+        phaseTimings.add("phase3", runtimePhase3Total);
+        if (config.earlyTermination > 0) { phaseTimings.add("termination", runtimeTerminationTotal); }
+        phaseTimings.add("refresh", runtimeRefreshTotal);
+        phaseTimings.add("total", runtimePhase1Total+runtimePhase2aTotal+runtimePhase2bTotal+runtimePhase3Total
+                                  +runtimeTerminationTotal+runtimeRefreshTotal);
+        if (benchmarkCycleFinding) {
+            phaseTimings.add("compare_phase2a", runtimeOther2aTotal);
+            phaseTimings.add("compare_phase2b", runtimeOther2bTotal);
         }
-        auto enc_t = cc->EvalAddMany(enc_elements);
-        // o: Update output for all users in packed ciphertext: o <- t x u + o x (1-u)
-        auto enc_t_mult_u = cc->EvalMult(enc_t, enc_u); cc->ModReduceInPlace(enc_t);
-        auto enc_one_min_u = cc->EvalAdd(encOnes, cc->EvalMult(enc_u, encNegOnes));
-        // output <- t x u + o x (1-u)
-        enc_output = cc->EvalAdd(enc_t_mult_u, cc->EvalMult(enc_output,enc_one_min_u));
-        // Update availability: 1-NotEqualZero(output)
-        auto enc_output_reduced = evalNotEqualZero(enc_output,cc,initNotEqualZero);
-        encUserAvailability = cc->EvalAdd(encOnes, cc->EvalMult(enc_output_reduced, encNegOnes));
-
-        runtimePhase3 = TOC(t);
-        runtimePhase3Total += runtimePhase3;
-        std::cout << "Online part 3 - User availability & output update: " << runtimePhase3 << "ms" << std::endl;
-
-        // Refresh after (3) update availability.
-        //----------------------------------------------------------
-
-        // Refresh encrypted output vector.
-        Plaintext plaintext3; cc->Decrypt(keyPair.secretKey, enc_output, &plaintext3);
-        plaintext3->SetLength(n); auto output = plaintext3->GetPackedValue();
-        std::cout << "Output vector: " << output << std::endl;
-        enc_output = cc->Encrypt(keyPair.publicKey,cc->MakePackedPlaintext(output));
-        // Refresh & pack copies of user availability vector into single ciphertext.
-        cc->Decrypt(keyPair.secretKey, encUserAvailability, &plaintext3);
-        plaintext3->SetLength(n); auto userAvailability = plaintext3->GetPackedValue();
-        std::cout << "Availability vector: " << userAvailability << std::endl;
-        encUserAvailability = cc->Encrypt(keyPair.publicKey,
-                                          cc->MakePackedPlaintext(repFillSlots(userAvailability,slotTotal)));
-
-    // End loop.
+    // End repetitions.
+    }
+
+    // Per-phase summary (mean, percentiles) as CSV or JSON.
+    std::ofstream outputFile;
+    if (!config.output.empty()) { outputFile.open(config.output); }
+    std::ostream &report = config.output.empty() ? std::cout : outputFile;
+    if (config.format == "json") { phaseTimings.writeJson(report, config); }
+    else { phaseTimings.writeCsv(report, config); }
+    // Crypto operations per scope (offline, round/phase/kernel) and thread.
+    if (config.opsReport) { cryptoOpsLogger().report(std::cout); }
+    // Timeline of the phases and kernels per thread.
+    if (!config.trace.empty()) {
+        std::ofstream traceFile(config.trace);
+        traceRecorder().write(traceFile);
     }
-    std::cout << "-----------------------------------------" << std::endl;
-    std::cout << "Online part 1 - Total runtime: " << runtimePhase1Total << "ms" << std::endl;
-    std::cout << "Online part 2a - Total runtime: " << runtimePhase2aTotal << "ms" << std::endl;
-    std::cout << "Online part 2b - Total runtime: " << runtimePhase2bTotal << "ms" << std::endl;
-    std::cout << "Online part 3 - Total runtime: " << runtimePhase3Total << "ms" << std::endl;
-    std::cout << "Online all - Total runtime: " << runtimePhase1Total+runtimePhase2aTotal+runtimePhase2bTotal+runtimePhase3Total << "ms" << std::endl;
 
     return 0;
 }
@@ -1,5 +1,9 @@
 #include "utilities.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <omp.h>
+#include <stdexcept>
 
 
 int modFactorial(int n, int modulus) {
@@ -36,6 +40,73 @@ std::vector<int64_t> repFillSlots(std::vector<int64_t> vecIn, int maxSlots)
     return resVec;
 }
 
+// Segment size maxSlots/markets; throws unless markets is a power of two dividing maxSlots.
+static int marketSegment(int maxSlots, int markets)
+{
+    if (markets < 1 || (markets & (markets-1)) != 0 || maxSlots % markets != 0) {
+        throw std::invalid_argument(std::to_string(markets) + " markets: must be a power of two dividing "
+                                    + std::to_string(maxSlots) + " slots");
+    }
+    return maxSlots/markets;
+}
+
+int marketSlots(int maxSlots, int markets)
+{
+    int segment = marketSegment(maxSlots, markets);
+    return (markets == 1) ? maxSlots/2 : segment;
+}
+
+std::vector<int64_t> packMarkets(std::vector<std::vector<int64_t>> vecsIn, int maxSlots)
+{
+    int markets = vecsIn.size();
+    int segment = marketSegment(maxSlots, markets);
+    std::vector<int64_t> resVec(maxSlots,0);
+    for (int market = 0; market < markets; market++){
+        if (int(vecsIn[market].size()) > segment) {
+            throw std::invalid_argument("Market vector of " + std::to_string(vecsIn[market].size())
+                                        + " slots exceeds its segment of " + std::to_string(segment));
+        }
+        for (size_t slot = 0; slot < vecsIn[market].size(); slot++){
+            resVec[market*segment+slot] = vecsIn[market][slot];
+        }
+    }
+    return resVec;
+}
+
+std::vector<int64_t> tileMarkets(std::vector<std::vector<int64_t>> vecsIn, int maxSlots)
+{
+    int markets = vecsIn.size();
+    int segment = marketSegment(maxSlots, markets);
+    if (markets == 1) { return repFillSlots(vecsIn[0],maxSlots); }
+    std::vector<int64_t> resVec(maxSlots,0);
+    for (int market = 0; market < markets; market++){
+        int n = vecsIn[market].size();
+        int repNum = std::floor(segment/n);
+        for (int slot = 0; slot < repNum*n; slot++){
+            resVec[market*segment+slot] = vecsIn[market][slot%n];
+        }
+    }
+    return resVec;
+}
+
+std::vector<int64_t> packUsers(std::vector<std::vector<int64_t>> vecsIn, int width)
+{
+    int users = vecsIn.size();
+    std::vector<int64_t> resVec(users*width,0);
+    for (int user = 0; user < users; user++){
+        for (size_t slot = 0; slot < vecsIn[user].size(); slot++){
+            resVec[user*width+slot] = vecsIn[user][slot];
+        }
+    }
+    return resVec;
+}
+
+std::vector<int64_t> unpackMarket(std::vector<int64_t> &vecIn, int market, int markets, int length)
+{
+    int offset = market*marketSegment(vecIn.size(), markets);
+    return std::vector<int64_t>(vecIn.begin()+offset, vecIn.begin()+offset+length);
+}
+
 std::vector<std::vector<int64_t>> matrixDiagonals(std::vector<std::vector<int64_t>> matIn) 
 {
     int d = matIn.size();
@@ -48,29 +119,355 @@ std::vector<std::vector<int64_t>> matrixDiagonals(std::vector<std::vector<int64_
     return diagonals;
 }
 
-CryptoOpsLogger::CryptoOpsLogger() : innerProdOps_(0), innerProdTime_(0.0), 
-                                    //  addManyOps_(0), addManyTime_(0.0),
-                                     multOps_(0), multTime_(0.0), 
-                                     addOps_(0), addTime_(0.0),
-                                     rotOps_(0), rotTime_(0.0) {}
-
-void CryptoOpsLogger::logInnerProd(double ms) { innerProdOps_ += 1 ; innerProdTime_ = innerProdTime_ + ms; };
-void CryptoOpsLogger::logAddMany(int n, double ms) { addOps_ += n-1 ; addTime_ = addTime_ + ms; };
-void CryptoOpsLogger::logMult(double ms) { multOps_ += 1 ; multTime_ = multTime_ + ms; };
-void CryptoOpsLogger::logAdd(double ms) { addOps_ += 1 ; addTime_ = addTime_ + ms; };
-void CryptoOpsLogger::logRot(double ms) { rotOps_ += 1 ; rotTime_ = rotTime_ + ms; };
-
-int CryptoOpsLogger::innerProdOps() { return innerProdOps_; };  
-double CryptoOpsLogger::innerProdTime() { return innerProdTime_; };
-// int CryptoOpsLogger::addManyOps() { return addManyOps_; };      
-// double CryptoOpsLogger::addManyTime() { return addManyTime_; };
-int CryptoOpsLogger::multOps() { return multOps_; };            
-double CryptoOpsLogger::multTime() { return multTime_; };
-int CryptoOpsLogger::addOps() { return addOps_; };              
-double CryptoOpsLogger::addTime() { return addTime_; };
-int CryptoOpsLogger::rotOps() { return rotOps_; };              
-double CryptoOpsLogger::rotTime() { return rotTime_; };
-int CryptoOpsLogger::totalTime() { return innerProdTime_+multTime_+addTime_+rotTime_; }; 
+std::vector<int64_t> permutationDiagonal(const std::vector<int64_t> &permutation, int l, bool transposed)
+{
+    int d = permutation.size();
+    std::vector<int64_t> diagonal(d,0);
+    for (int i=0;i<d;i++){
+        if (transposed) { diagonal[i] = (permutation[(l+i)%d] == i); }
+        else { diagonal[i] = (permutation[i] == (l+i)%d); }
+    }
+    return diagonal;
+}
+
+std::string cryptoOpName(CryptoOp op) {
+    static const std::string names[cryptoOpCount] = {"Mult", "Rotate", "KeySwitch", "ModReduce", "Add", "InnerProd",
+                                                     "Encrypt", "Decrypt"};
+    return names[int(op)];
+}
+
+static int nextCryptoOpsLoggerId() {
+    static std::atomic<int> id(0);
+    return id++;
+}
+
+CryptoOpsLogger::CryptoOpsLogger(bool enabled) : enabled(enabled), id_(nextCryptoOpsLoggerId()) {}
+
+// Shard of the calling thread, registered once per thread and owner (logger or recorder id).
+template <typename Shard>
+static Shard &threadShard(int id, std::mutex &shardsMutex, std::vector<std::unique_ptr<Shard>> &shards) {
+    thread_local std::map<int, Shard*> threadShards;
+    auto it = threadShards.find(id);
+    if (it != threadShards.end()) { return *it->second; }
+    std::lock_guard<std::mutex> lock(shardsMutex);
+    shards.emplace_back(new Shard());
+    threadShards[id] = shards.back().get();
+    return *shards.back();
+}
+
+CryptoOpsLogger::Shard &CryptoOpsLogger::shard() { return threadShard(id_, shardsMutex_, shards_); }
+
+// Set in the threads of a WorkerPool.
+static thread_local bool workerThread = false;
+
+// Scopes and spans of the calling thread only: inside a parallel region or in a worker thread.
+static bool threadScoped() { return workerThread || omp_in_parallel(); }
+
+CryptoOpsLogger::ScopeStats &CryptoOpsLogger::currentStats(Shard &threadShard) {
+    if (threadShard.current && (workerThread || threadShard.generation == sharedGeneration_)) {
+        return *threadShard.current;
+    }
+    std::string path = workerThread ? "" : sharedPath_;
+    for (auto &scope : threadShard.scopes) { path += "/" + scope; }
+    if (path.empty()) { path = "/"; }
+    threadShard.current = &threadShard.stats[path];
+    // Not read in worker threads, which run concurrently with the pushes and pops of the shared scopes.
+    if (!workerThread) { threadShard.generation = sharedGeneration_; }
+    return *threadShard.current;
+}
+
+void CryptoOpsLogger::log(CryptoOp op, double ms, int count) {
+    if (!enabled) { return; }
+    auto &stats = currentStats(shard())[int(op)];
+    stats.count += count; stats.ms += ms;
+}
+
+void CryptoOpsLogger::pushScope(std::string name) {
+    if (!enabled) { return; }
+    if (threadScoped()) {
+        auto &threadShard = shard();
+        threadShard.scopes.push_back(name);
+        threadShard.current = nullptr;
+        return;
+    }
+    assert(!omp_in_parallel());
+    sharedScopes_.push_back(name);
+    sharedPath_ += "/" + name;
+    sharedGeneration_++;
+}
+
+void CryptoOpsLogger::popScope() {
+    if (!enabled) { return; }
+    if (threadScoped()) {
+        auto &threadShard = shard();
+        threadShard.scopes.pop_back();
+        threadShard.current = nullptr;
+        return;
+    }
+    assert(!omp_in_parallel());
+    sharedPath_.resize(sharedPath_.size() - sharedScopes_.back().size() - 1);
+    sharedScopes_.pop_back();
+    sharedGeneration_++;
+}
+
+std::vector<std::string> CryptoOpsLogger::scopes() {
+    if (!enabled) { return {}; }
+    std::vector<std::string> path;
+    if (!workerThread) { path = sharedScopes_; }
+    if (threadScoped()) { path.insert(path.end(), shard().scopes.begin(), shard().scopes.end()); }
+    return path;
+}
+
+void CryptoOpsLogger::logInnerProd(double ms) { log(CryptoOp::InnerProd, ms); }
+void CryptoOpsLogger::logAddMany(int n, double ms) { log(CryptoOp::Add, ms, n-1); }
+void CryptoOpsLogger::logMult(double ms) { log(CryptoOp::Mult, ms); }
+void CryptoOpsLogger::logAdd(double ms) { log(CryptoOp::Add, ms); }
+void CryptoOpsLogger::logRot(double ms) { log(CryptoOp::Rotate, ms); }
+
+int64_t CryptoOpsLogger::ops(CryptoOp op) {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    int64_t count = 0;
+    for (auto &threadShard : shards_) {
+        for (auto &scopeStats : threadShard->stats) { count += scopeStats.second[int(op)].count; }
+    }
+    return count;
+}
+
+double CryptoOpsLogger::time(CryptoOp op) {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    double ms = 0.0;
+    for (auto &threadShard : shards_) {
+        for (auto &scopeStats : threadShard->stats) { ms += scopeStats.second[int(op)].ms; }
+    }
+    return ms;
+}
+
+int CryptoOpsLogger::innerProdOps() { return ops(CryptoOp::InnerProd); }
+double CryptoOpsLogger::innerProdTime() { return time(CryptoOp::InnerProd); }
+int CryptoOpsLogger::multOps() { return ops(CryptoOp::Mult); }
+double CryptoOpsLogger::multTime() { return time(CryptoOp::Mult); }
+int CryptoOpsLogger::addOps() { return ops(CryptoOp::Add); }
+double CryptoOpsLogger::addTime() { return time(CryptoOp::Add); }
+int CryptoOpsLogger::rotOps() { return ops(CryptoOp::Rotate); }
+double CryptoOpsLogger::rotTime() { return time(CryptoOp::Rotate); }
+double CryptoOpsLogger::totalTime() {
+    double ms = 0.0;
+    for (int op = 0; op < cryptoOpCount; op++) { ms += time(CryptoOp(op)); }
+    return ms;
+}
+
+void CryptoOpsLogger::report(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    // Merge shards by scope.
+    std::map<std::string, ScopeStats> merged;
+    for (auto &threadShard : shards_) {
+        for (auto &scopeStats : threadShard->stats) {
+            for (int op = 0; op < cryptoOpCount; op++) {
+                merged[scopeStats.first][op].count += scopeStats.second[op].count;
+                merged[scopeStats.first][op].ms += scopeStats.second[op].ms;
+            }
+        }
+    }
+    // KeySwitch is count-only (timed within Mult and Rotate).
+    auto writeStats = [&](CryptoOp op, const OpStats &stats) {
+        out << " " << cryptoOpName(op) << " " << stats.count;
+        if (op != CryptoOp::KeySwitch) { out << " (" << stats.ms << " ms)"; }
+    };
+    out << "Crypto operations by scope: count (ms), KeySwitch count only" << std::endl;
+    ScopeStats totals;
+    for (auto &scopeStats : merged) {
+        out << scopeStats.first << ":";
+        for (int op = 0; op < cryptoOpCount; op++) {
+            auto &stats = scopeStats.second[op];
+            if (stats.count == 0) { continue; }
+            writeStats(CryptoOp(op), stats);
+            totals[op].count += stats.count; totals[op].ms += stats.ms;
+        }
+        out << std::endl;
+    }
+    out << "Total:";
+    for (int op = 0; op < cryptoOpCount; op++) { writeStats(CryptoOp(op), totals[op]); }
+    out << std::endl;
+    for (size_t thread = 0; thread < shards_.size(); thread++) {
+        int64_t count = 0; double ms = 0.0;
+        for (auto &scopeStats : shards_[thread]->stats) {
+            for (auto &stats : scopeStats.second) { count += stats.count; ms += stats.ms; }
+        }
+        out << "Thread " << thread << ": " << count << " operations (" << ms << " ms)" << std::endl;
+    }
+}
+
+void CryptoOpsLogger::reset() {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    for (auto &threadShard : shards_) { threadShard->stats.clear(); threadShard->current = nullptr; }
+    sharedGeneration_++;
+}
+
+CryptoOpsLogger &cryptoOpsLogger() {
+    static CryptoOpsLogger logger(false);
+    return logger;
+}
+
+TraceRecorder::TraceRecorder(bool enabled) :
+    enabled(enabled), id_(nextCryptoOpsLoggerId()), start_(std::chrono::steady_clock::now()) {}
+
+TraceRecorder::Shard &TraceRecorder::shard() { return threadShard(id_, shardsMutex_, shards_); }
+
+double TraceRecorder::now() {
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start_;
+    return elapsed.count();
+}
+
+void TraceRecorder::begin(std::string name, TraceArgs args) {
+    if (!enabled) { return; }
+    auto &spans = threadScoped() ? shard().spans : sharedSpans_;
+    // Inherited args first; own args override them.
+    TraceArgs merged = this->args();
+    for (auto &arg : args) {
+        auto it = std::find_if(merged.begin(), merged.end(),
+                               [&](const std::pair<std::string, int64_t> &a) { return a.first == arg.first; });
+        if (it != merged.end()) { it->second = arg.second; }
+        else { merged.push_back(arg); }
+    }
+    spans.push_back({name, merged, now()});
+}
+
+void TraceRecorder::end() {
+    if (!enabled) { return; }
+    auto &events = shard().events;
+    auto &spans = threadScoped() ? shard().spans : sharedSpans_;
+    auto &span = spans.back();
+    events.push_back({span.name, span.args, span.ts, now() - span.ts});
+    spans.pop_back();
+}
+
+TraceArgs TraceRecorder::args() {
+    if (!enabled) { return {}; }
+    if (threadScoped() && !shard().spans.empty()) { return shard().spans.back().args; }
+    if (workerThread || sharedSpans_.empty()) { return {}; }
+    return sharedSpans_.back().args;
+}
+
+// JSON string contents: quotes, backslashes and control characters escaped.
+static std::string jsonEscape(const std::string &text) {
+    std::string escaped;
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    static const char hex[] = "0123456789abcdef";
+                    escaped += "\\u00"; escaped += hex[c >> 4]; escaped += hex[c & 0xf];
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+void TraceRecorder::write(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+    bool first = true;
+    for (size_t tid = 0; tid < shards_.size(); tid++) {
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << tid
+            << ", \"args\": {\"name\": \"thread " << tid << "\"}}";
+        first = false;
+        for (auto &event : shards_[tid]->events) {
+            out << ",\n{\"name\": \"" << jsonEscape(event.name) << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << tid
+                << ", \"ts\": " << event.ts << ", \"dur\": " << event.dur << ", \"args\": {";
+            for (size_t i = 0; i < event.args.size(); i++) {
+                out << (i ? ", " : "") << "\"" << jsonEscape(event.args[i].first) << "\": " << event.args[i].second;
+            }
+            out << "}}";
+        }
+    }
+    out << std::endl << "]}" << std::endl;
+}
+
+void TraceRecorder::reset() {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    for (auto &shard : shards_) { shard->events.clear(); }
+}
+
+TraceRecorder &traceRecorder() {
+    static TraceRecorder recorder(false);
+    return recorder;
+}
+
+TraceSpan::TraceSpan(std::string name, TraceArgs args, TraceRecorder &recorder) :
+    recorder_(recorder), active_(recorder.enabled) {
+    if (active_) { recorder_.begin(name, args); }
+}
+TraceSpan::~TraceSpan() { if (active_) { recorder_.end(); } }
+
+CryptoOpsScope::CryptoOpsScope(std::string name, TraceArgs args, CryptoOpsLogger &logger) :
+    logger_(logger), active_(logger.enabled), span_(name, args) {
+    if (active_) { logger_.pushScope(name); }
+}
+CryptoOpsScope::~CryptoOpsScope() { if (active_) { logger_.popScope(); } }
+
+CryptoOpTimer::CryptoOpTimer(CryptoOp op, int count, CryptoOpsLogger &logger) :
+    logger_(logger), op_(op), count_(count), active_(logger.enabled) {
+    if (active_) { start_ = std::chrono::steady_clock::now(); }
+}
+CryptoOpTimer::~CryptoOpTimer() {
+    if (!active_) { return; }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_;
+    logger_.log(op_, elapsed.count(), count_);
+}
+
+
+WorkerPool::WorkerPool(int workers) : stop_(false) {
+    if (workers <= 0) { workers = std::max(1, omp_get_max_threads() / 2); }
+    for (int i = 0; i < workers; i++) { threads_.emplace_back(&WorkerPool::work, this); }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_all();
+    for (auto &thread : threads_) { thread.join(); }
+}
+
+int WorkerPool::workers() const { return threads_.size(); }
+
+void WorkerPool::enqueue(Job job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    ready_.notify_one();
+}
+
+void WorkerPool::work() {
+    workerThread = true;
+    omp_set_num_threads(1);
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) { return; }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        auto &logger = cryptoOpsLogger();
+        for (auto &scope : job.scopes) { logger.pushScope(scope); }
+        {
+            CryptoOpsScope scope(job.scope, job.args);
+            job.run();
+        }
+        for (size_t i = 0; i < job.scopes.size(); i++) { logger.popScope(); }
+    }
+}
 
 
 VectorIter::VectorIter(int modulus, int slots) {
@@ -1,8 +1,20 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <array>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <map>
 
@@ -12,9 +24,44 @@ int modInverse(int A, int M);
 
 std::vector<int64_t> repFillSlots(std::vector<int64_t> vecIn, int maxSlots);
 
+// Multi-market packing: markets share the slots, market m in segment [m*S, (m+1)*S) with S = maxSlots/markets.
+// Markets must be a power of two, so that segments do not straddle the two slot rows (std::invalid_argument
+// otherwise). One market uses the single-market layout (repFillSlots) and its segment is one slot row.
+int marketSlots(int maxSlots, int markets);
+// Vector of market m at the start of segment m, zero elsewhere.
+std::vector<int64_t> packMarkets(std::vector<std::vector<int64_t>> vecsIn, int maxSlots);
+// Vector of market m replicated over segment m (repFillSlots per market).
+std::vector<int64_t> tileMarkets(std::vector<std::vector<int64_t>> vecsIn, int maxSlots);
+// Users side by side (packed phase (1)): vector u at [u*width, u*width + size), 0 elsewhere. Empty vectors leave
+// their segment zero, so one user's upload is placed at its own segment.
+std::vector<int64_t> packUsers(std::vector<std::vector<int64_t>> vecsIn, int width);
+// First length elements of segment m.
+std::vector<int64_t> unpackMarket(std::vector<int64_t> &vecIn, int market, int markets, int length);
+
+// Crypto operation counts and times (ms). Logging is sharded per thread: each thread appends to its own shard,
+// without locks or atomics, and shards are merged by the report (outside parallel regions).
+// Operations are attributed to the path of nested scopes (CryptoOpsScope). Scopes opened outside parallel regions
+// are shared by all threads (round/phase1), scopes opened inside a parallel region extend the path of their
+// thread only (round/phase1/evalPreserveLeadOne). Threads of a WorkerPool never see the shared scopes: their tasks
+// start from the path open at submission. Shared scopes must only be opened and closed outside parallel regions
+// (asserted), so that threads inside a region read them without locks.
+// Each shard caches the stats of its current path; pushes and pops invalidate it, log() only bumps two counters.
+// KeySwitch is count-only: OpenFHE switches keys inside EvalMult and EvalRotate, so its time is part of Mult and
+// Rotate.
+enum class CryptoOp { Mult, Rotate, KeySwitch, ModReduce, Add, InnerProd, Encrypt, Decrypt };
+const int cryptoOpCount = 8;
+std::string cryptoOpName(CryptoOp op);
+
 class CryptoOpsLogger {
 public:
-    CryptoOpsLogger();
+    CryptoOpsLogger(bool enabled = true);
+
+    void log(CryptoOp op, double ms, int count = 1);
+    // No-ops while disabled: enable before the first scope.
+    void pushScope(std::string name);
+    void popScope();
+    // Path of the calling thread (shared and own scopes).
+    std::vector<std::string> scopes();
 
     void logInnerProd(double ms);
     void logAddMany(int n, double ms);
@@ -22,21 +69,163 @@ public:
     void logAdd(double ms);
     void logRot(double ms);
 
+    int64_t ops(CryptoOp op);
+    double time(CryptoOp op);
     int innerProdOps();     double innerProdTime();
-    // int addManyOps();       double addManyTime();
     int multOps();          double multTime();
     int addOps();           double addTime();
     int rotOps();           double rotTime();
-    int totalTime();
-    
+    double totalTime();
+
+    // Operations per scope, totals per operation and per-thread totals.
+    void report(std::ostream &out);
+    void reset();
+
+    bool enabled;
+
+private:
+    struct OpStats { int64_t count = 0; double ms = 0.0; };
+    typedef std::array<OpStats, cryptoOpCount> ScopeStats;
+    struct Shard {
+        std::vector<std::string> scopes;
+        std::map<std::string, ScopeStats> stats;
+        // Stats of the current path; null after a push or pop of the thread's scopes. Valid while generation equals
+        // sharedGeneration_ (worker threads ignore the shared scopes).
+        ScopeStats *current = nullptr;
+        int64_t generation = -1;
+    };
+    Shard &shard();
+    ScopeStats &currentStats(Shard &threadShard);
+
+    const int id_;
+    std::mutex shardsMutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::string> sharedScopes_;
+    // Joined shared scopes ("/round/phase1"), and a counter bumped when they change or the stats are reset.
+    std::string sharedPath_;
+    int64_t sharedGeneration_ = 0;
+};
+
+// Process-wide logger of the crypto kernels (disabled by default).
+CryptoOpsLogger &cryptoOpsLogger();
+
+// Timeline of spans in Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev): one track per thread.
+// Recorded per thread like CryptoOpsLogger. Spans inherit the args (round, user, level) of their enclosing spans:
+// spans begun outside parallel regions enclose the spans of all threads.
+typedef std::vector<std::pair<std::string, int64_t>> TraceArgs;
+
+class TraceRecorder {
+public:
+    TraceRecorder(bool enabled = true);
+
+    // No-ops while disabled: enable before the first span.
+    void begin(std::string name, TraceArgs args = {});
+    void end();
+    // Args of the innermost span of the calling thread.
+    TraceArgs args();
+
+    void write(std::ostream &out);
+    void reset();
+
+    bool enabled;
+
+private:
+    struct Span { std::string name; TraceArgs args; double ts; };
+    struct Event { std::string name; TraceArgs args; double ts; double dur; };
+    // Thread id in the trace: registration order of the shard.
+    struct Shard {
+        std::vector<Span> spans;
+        std::vector<Event> events;
+    };
+    Shard &shard();
+    double now();
+
+    const int id_;
+    const std::chrono::steady_clock::time_point start_;
+    std::mutex shardsMutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<Span> sharedSpans_;
+};
+
+// Process-wide trace of the crypto kernels (disabled by default).
+TraceRecorder &traceRecorder();
+
+// Span of a recorder for the lifetime of the object (no-op if the recorder is disabled).
+class TraceSpan {
+public:
+    TraceSpan(std::string name, TraceArgs args = {}, TraceRecorder &recorder = traceRecorder());
+    ~TraceSpan();
+private:
+    TraceRecorder &recorder_;
+    bool active_;
+};
+
+// Scope of a logger and span of traceRecorder() for the lifetime of the object.
+class CryptoOpsScope {
+public:
+    CryptoOpsScope(std::string name, TraceArgs args = {}, CryptoOpsLogger &logger = cryptoOpsLogger());
+    ~CryptoOpsScope();
+private:
+    CryptoOpsLogger &logger_;
+    bool active_;
+    TraceSpan span_;
+};
+
+// Logs the time from construction to destruction as count operations (no-op if the logger is disabled).
+class CryptoOpTimer {
+public:
+    CryptoOpTimer(CryptoOp op, int count = 1, CryptoOpsLogger &logger = cryptoOpsLogger());
+    ~CryptoOpTimer();
+private:
+    CryptoOpsLogger &logger_;
+    CryptoOp op_;
+    int count_;
+    bool active_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+// Fixed pool of worker threads running tasks in submission order; submit() returns the future of the result.
+// Workers run OpenFHE single-threaded (next to the OpenMP regions of the submitting thread) and log operations and
+// spans of a task under the scopes and span args open at its submission, extended by scope.
+class WorkerPool {
+public:
+    // workers <= 0: half of the OpenMP threads, at least one.
+    WorkerPool(int workers = 0);
+    // Runs the queued tasks, then joins the workers.
+    ~WorkerPool();
+
+    template <typename Task>
+    std::future<std::invoke_result_t<Task>> submit(std::string scope, Task task);
+    int workers() const;
+
 private:
-    int innerProdOps_; double innerProdTime_;
-    // int addManyOps_; double addManyTime_;
-    int multOps_; double multTime_;
-    int addOps_; double addTime_;
-    int rotOps_; double rotTime_; 
+    struct Job {
+        std::vector<std::string> scopes;
+        TraceArgs args;
+        std::string scope;
+        std::function<void()> run;
+    };
+    void enqueue(Job job);
+    void work();
+
+    std::vector<std::thread> threads_;
+    std::deque<Job> jobs_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stop_;
 };
 
+template <typename Task>
+std::future<std::invoke_result_t<Task>> WorkerPool::submit(std::string scope, Task task) {
+    typedef std::invoke_result_t<Task> Result;
+    // std::function needs a copyable callable.
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    auto future = packaged->get_future();
+    enqueue({cryptoOpsLogger().scopes(), traceRecorder().args(), scope, [packaged]() { (*packaged)(); }});
+    return future;
+}
+
 
 // Helper class for matrix exponentiation.
 // Iterator steps through for all slot indices (i,j,k...) in [0,modulus) x [0,modulus) x [0,modulus) x ...